@@ -0,0 +1,540 @@
+/* global_done_rma.c
+ *
+ * MPI-3 RMA port of the global termination detectors (STAR, H-STAR and the
+ * dynamic-leader tree), next to the two MPI collectives they compete with
+ * (MPI_Allreduce and MPI_Ibarrier), so all of them run on the same runtime.
+ *
+ * Every symmetric array of the SHMEM versions becomes a displacement in one
+ * MPI_Win_allocate'd int window (same layout on every rank); ELAPSED_MS lives
+ * in a second, double window.  All ranks hold MPI_Win_lock_all for the whole
+ * run (passive target), and the SHMEM calls map as:
+ *   shmem_int_p + quiet           -> MPI_Accumulate(MPI_REPLACE) + flush
+ *   shmem_int_g / wait_until      -> MPI_Fetch_and_op(MPI_NO_OP) + flush
+ *   shmem_int_atomic_fetch_inc    -> MPI_Fetch_and_op(MPI_SUM)
+ *   shmem_int_atomic_compare_swap -> MPI_Compare_and_swap
+ *   shmem_double_g                -> MPI_Get
+ * Flags are written with accumulate rather than MPI_Put because the owner
+ * polls them with atomics while they are written; plain puts are used for
+ * data nobody reads concurrently (GROUP_LEADER).
+ *
+ * MPI has no shmem_global_exit, so the H-STAR root releases every rank with
+ * a gate flag (as STAR does) and all schemes end in MPI_Finalize.
+ *
+ * Synthetic workload (shared by all schemes): each rank busy-works for a
+ * deterministic pseudo-random time in [0, GLOBAL_WORK_US] before it marks
+ * itself done; 0 (default) reproduces the SHMEM programs, where everyone is
+ * done right after the start barrier.
+ *
+ * Output: the usual "Aggregated ELAPSED_MS" line (per-rank local-done times)
+ * plus DETECT_MS, the time at which the root proved termination and how long
+ * that was after the last rank finished.  The latter compares raw
+ * CLOCK_MONOTONIC stamps across ranks (not the per-rank start times, which
+ * skew by however late each rank left the barrier), so it is only meaningful
+ * when all ranks share a node.
+ *
+ * Env:
+ *   GLOBAL_DONE_SCHEME -> star (default) | hstar | dynamic | allreduce | ibarrier
+ *   GLOBAL_GROUP_SIZE  -> leaf group size (default 8)
+ *   GLOBAL_BRANCH_K    -> H-STAR branch factor above the leaf (default 8, >=2)
+ *   GLOBAL_WORK_US     -> max synthetic work per rank in us (default 0)
+ *   GLOBAL_DONE_DEBUG  -> per-run debug toggle (0/1)
+ *
+ * Compile:
+ *   mpicc -O3 -std=c11 -o global_done_rma global_done_rma.c
+ *
+ * Run:
+ *   GLOBAL_DONE_SCHEME=hstar GLOBAL_WORK_US=2000 mpirun -n 24 ./global_done_rma
+ */
+
+ #define _POSIX_C_SOURCE 199309L
+
+ #include <mpi.h>
+ #include <sched.h>
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <time.h>
+
+ /* ---------- timing ---------- */
+ static inline double now_sec(void) {
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+ }
+
+ /* ---------- schemes ---------- */
+ typedef enum { SCHEME_STAR, SCHEME_HSTAR, SCHEME_DYNAMIC,
+                SCHEME_ALLREDUCE, SCHEME_IBARRIER } scheme_t;
+ static const char *scheme_names[] = { "star", "hstar", "dynamic", "allreduce", "ibarrier" };
+
+ /* ---------- globals ---------- */
+ static int     me, npes;
+ static int     G_LEAF = 8;                 /* leaf group size (env: GLOBAL_GROUP_SIZE) */
+ static int     K = 8;                      /* H-STAR branch factor (env: GLOBAL_BRANCH_K) */
+ static int     g_debug = 0;
+ static double  g_start_time = 0.0;
+ static const int ROOT_PE = 0;
+
+ /* Window "symmetric heap": flags/counters are int displacements in FLAGS. */
+ static MPI_Win FLAGS;
+ static int    *FLAG_BASE;                  /* my copy (local view) */
+ static int     FLAG_COUNT = 0;             /* ints allocated so far (layout pass) */
+ static MPI_Win ELAPSED_WIN;
+ static double *ELAPSED_MS;                 /* [0] elapsed (ms), [1] CLOCK_MONOTONIC at done (s) */
+
+ /* reserve n ints in the flag window; returns the displacement */
+ static int flag_alloc(int n) {
+     int d = FLAG_COUNT;
+     FLAG_COUNT += n;
+     return d;
+ }
+
+ /* ---------- helpers ---------- */
+
+ static int env_debug_enabled(void) {
+     const char *e = getenv("GLOBAL_DONE_DEBUG");
+     if (!e) return 0;
+     if (e[0] == '\0' || e[0] == '0') return 0;
+     return 1;
+ }
+
+ static int env_group_size(void) {
+     const char *e = getenv("GLOBAL_GROUP_SIZE");
+     if (!e || e[0] == '\0') return 8;
+     int v = atoi(e);
+     return (v >= 1) ? v : 8;
+ }
+
+ static int env_branch_k(void) {
+     const char *e = getenv("GLOBAL_BRANCH_K");
+     if (!e || e[0] == '\0') return 8;
+     int v = atoi(e);
+     return (v >= 2) ? v : 8;
+ }
+
+ static int env_work_us(void) {
+     const char *e = getenv("GLOBAL_WORK_US");
+     if (!e || e[0] == '\0') return 0;
+     int v = atoi(e);
+     return (v >= 0) ? v : 0;
+ }
+
+ static int env_scheme(scheme_t *s) {
+     const char *e = getenv("GLOBAL_DONE_SCHEME");
+     *s = SCHEME_STAR;
+     if (!e || e[0] == '\0') return 1;
+     for (int i = 0; i < (int)(sizeof(scheme_names) / sizeof(scheme_names[0])); i++)
+         if (!strcmp(e, scheme_names[i])) { *s = (scheme_t)i; return 1; }
+     return 0;
+ }
+
+ static inline int ceil_div(int a, int b) { return (a + b - 1) / b; }
+
+ static inline int ipow(int base, int exp) {
+     int r = 1;
+     while (exp-- > 0) r *= base;
+     return r;
+ }
+
+ /* ---------- one-sided primitives (the shmem_* equivalents) ---------- */
+
+ /* shmem_int_p + shmem_quiet */
+ static void flag_put(int disp, int value, int pe) {
+     MPI_Accumulate(&value, 1, MPI_INT, pe, disp, 1, MPI_INT, MPI_REPLACE, FLAGS);
+     MPI_Win_flush(pe, FLAGS);
+ }
+
+ /* shmem_int_g (atomic w.r.t. concurrent flag_put / fetch-ops) */
+ static int flag_get(int disp, int pe) {
+     int v;
+     MPI_Fetch_and_op(NULL, &v, MPI_INT, pe, disp, MPI_NO_OP, FLAGS);
+     MPI_Win_flush(pe, FLAGS);
+     return v;
+ }
+
+ static int flag_fetch_add(int disp, int add, int pe) {
+     int old;
+     MPI_Fetch_and_op(&add, &old, MPI_INT, pe, disp, MPI_SUM, FLAGS);
+     MPI_Win_flush(pe, FLAGS);
+     return old;
+ }
+
+ static int flag_cswap(int disp, int cond, int value, int pe) {
+     int old;
+     MPI_Compare_and_swap(&value, &cond, &old, MPI_INT, pe, disp, FLAGS);
+     MPI_Win_flush(pe, FLAGS);
+     return old;
+ }
+
+ /* shmem_int_wait_until(local, CMP_EQ/GE, v); yields so oversubscribed ranks progress */
+ static void flag_wait_eq(int disp, int value) {
+     while (flag_get(disp, me) != value) sched_yield();
+ }
+ static void flag_wait_ge(int disp, int value) {
+     while (flag_get(disp, me) < value) sched_yield();
+ }
+
+ static void elapsed_get(double v[2], int pe) {
+     MPI_Get(v, 2, MPI_DOUBLE, pe, 0, 2, MPI_DOUBLE, ELAPSED_WIN);
+     MPI_Win_flush(pe, ELAPSED_WIN);
+ }
+
+ /* ---------- synthetic workload + local completion ---------- */
+
+ static void do_synthetic_work(int work_us) {
+     if (work_us <= 0) return;
+     unsigned h = (unsigned)me * 2654435761u;
+     h ^= h >> 15;
+     double us = (double)(h % 1000u) / 999.0 * work_us;
+     double until = now_sec() + us * 1e-6;
+     while (now_sec() < until) { }
+ }
+
+ /* Local stores into an exposed window: MPI_Win_sync makes them visible to the
+  * root's MPI_Get (root_report) before this rank's done flag can reach it. */
+ static void mark_local_done(void) {
+     ELAPSED_MS[1] = now_sec();
+     ELAPSED_MS[0] = (ELAPSED_MS[1] - g_start_time) * 1e3;
+     MPI_Win_sync(ELAPSED_WIN);
+ }
+
+ /* ---------- root report (same format as the SHMEM programs) ---------- */
+
+ static void root_report(void) {
+     const double detect_at = now_sec();
+     double sum = 0.0, minv = 0.0, maxv = 0.0, last_done = 0.0;
+     for (int pe = 0; pe < npes; pe++) {
+         double v[2];
+         if (pe == me) { v[0] = ELAPSED_MS[0]; v[1] = ELAPSED_MS[1]; }
+         else elapsed_get(v, pe);
+         const double val = v[0];
+         if (pe == 0) { minv = maxv = val; last_done = v[1]; }
+         if (val < minv) minv = val;
+         if (val > maxv) maxv = val;
+         if (v[1] > last_done) last_done = v[1];
+         sum += val;
+     }
+     double avg = sum / (double)npes;
+     printf("Aggregated ELAPSED_MS across %d PEs: min=%.3f ms  avg=%.3f ms  max=%.3f ms\n",
+            npes, minv, avg, maxv);
+     printf("DETECT_MS: root proved termination at %.3f ms (%.3f ms after the last PE)\n",
+            (detect_at - g_start_time) * 1e3, (detect_at - last_done) * 1e3);
+     fflush(stdout);
+ }
+
+ /* ========== STAR ========== */
+
+ static int NUM_GROUPS0;
+ static int D_GROUP_PE_DONE;                /* [NUM_GROUPS0][G_LEAF] at group anchors */
+ static int D_ROOT_GROUP_DONE;              /* [NUM_GROUPS0] at ROOT_PE */
+ static int D_GLOBAL_READY;                 /* gate, each rank waits on its own copy */
+
+ static void layout_star(void) {
+     NUM_GROUPS0       = ceil_div(npes, G_LEAF);
+     D_GROUP_PE_DONE   = flag_alloc(NUM_GROUPS0 * G_LEAF);
+     D_ROOT_GROUP_DONE = flag_alloc(NUM_GROUPS0);
+     D_GLOBAL_READY    = flag_alloc(1);
+ }
+
+ static void run_star_termination(void) {
+     const int gidx  = me / G_LEAF;
+     const int idx   = me % G_LEAF;
+     const int owner = gidx * G_LEAF;
+
+     mark_local_done();
+     flag_put(D_GROUP_PE_DONE + gidx * G_LEAF + idx, -1, owner);
+
+     if (me == owner) {
+         int end = owner + G_LEAF;
+         if (end > npes) end = npes;
+         for (int i = 0; i < end - owner; i++)
+             flag_wait_eq(D_GROUP_PE_DONE + gidx * G_LEAF + i, -1);
+         flag_put(D_ROOT_GROUP_DONE + gidx, -1, ROOT_PE);
+     }
+
+     if (me == ROOT_PE) {
+         for (int g = 0; g < NUM_GROUPS0; g++)
+             flag_wait_eq(D_ROOT_GROUP_DONE + g, -1);
+         root_report();
+
+         for (int pe = 0; pe < npes; pe++) {
+             int v = -1;
+             MPI_Accumulate(&v, 1, MPI_INT, pe, D_GLOBAL_READY, 1, MPI_INT, MPI_REPLACE, FLAGS);
+         }
+         MPI_Win_flush_all(FLAGS);
+     }
+
+     flag_wait_eq(D_GLOBAL_READY, -1);
+ }
+
+ /* ========== H-STAR ========== */
+
+ static int  LEVELS;
+ static int *NUM_GROUPS;                    /* [LEVELS] */
+ static int *D_LVL_CHILD_DONE;              /* [LEVELS] base of [NUM_GROUPS[l]][cap(l)] */
+ static int  D_HSTAR_GO;
+
+ static inline int hstar_cap(int l) { return (l == 0) ? G_LEAF : K; }
+ static inline int hstar_span(int l) { return G_LEAF * ipow(K, l); }
+
+ static void layout_hstar(void) {
+     int ng0 = ceil_div(npes, G_LEAF);
+     LEVELS = 1;
+     for (int prev = ng0; prev > 1; prev = ceil_div(prev, K)) LEVELS++;
+
+     NUM_GROUPS       = malloc(sizeof(int) * LEVELS);
+     D_LVL_CHILD_DONE = malloc(sizeof(int) * LEVELS);
+     if (!NUM_GROUPS || !D_LVL_CHILD_DONE) MPI_Abort(MPI_COMM_WORLD, 1);
+
+     NUM_GROUPS[0] = ng0;
+     for (int l = 1; l < LEVELS; l++) NUM_GROUPS[l] = ceil_div(NUM_GROUPS[l-1], K);
+     for (int l = 0; l < LEVELS; l++)
+         D_LVL_CHILD_DONE[l] = flag_alloc(NUM_GROUPS[l] * hstar_cap(l));
+     D_HSTAR_GO = flag_alloc(1);
+     NUM_GROUPS0 = ng0;
+ }
+
+ static inline int hstar_slot(int l, int g, int i) {
+     return D_LVL_CHILD_DONE[l] + g * hstar_cap(l) + i;
+ }
+
+ static void run_hstar_termination(void) {
+     const int g0 = me / G_LEAF;
+
+     mark_local_done();
+     flag_put(hstar_slot(0, g0, me % G_LEAF), -1, g0 * G_LEAF);
+
+     for (int l = 0; l < LEVELS; l++) {
+         const int g_l     = me / hstar_span(l);
+         const int owner_l = g_l * hstar_span(l);
+         if (me != owner_l) break;          /* not an owner here => not above either */
+
+         int gsize;
+         if (l == 0) {
+             int end = owner_l + G_LEAF;
+             if (end > npes) end = npes;
+             gsize = end - owner_l;
+         } else {
+             const int first_child = g_l * K;
+             gsize = (first_child + K <= NUM_GROUPS[l-1]) ? K : (NUM_GROUPS[l-1] - first_child);
+             if (gsize < 0) gsize = 0;
+         }
+         for (int i = 0; i < gsize; i++)
+             flag_wait_eq(hstar_slot(l, g_l, i), -1);
+
+         if (l + 1 < LEVELS) {
+             const int parent_g = g_l / K;
+             flag_put(hstar_slot(l + 1, parent_g, g_l % K), -1, parent_g * hstar_span(l + 1));
+         }
+     }
+
+     if (me == ROOT_PE) {
+         root_report();
+         for (int pe = 0; pe < npes; pe++) {
+             int v = -1;
+             MPI_Accumulate(&v, 1, MPI_INT, pe, D_HSTAR_GO, 1, MPI_INT, MPI_REPLACE, FLAGS);
+         }
+         MPI_Win_flush_all(FLAGS);
+     }
+     flag_wait_eq(D_HSTAR_GO, -1);
+ }
+
+ /* ========== dynamic-leader binary tree ========== */
+
+ static int  MAX_LEVELS;
+ static int *DYN_GROUPS;                    /* [MAX_LEVELS] */
+ static int *D_GROUP_DONE;                  /* [MAX_LEVELS] base of [DYN_GROUPS[L]] */
+ static int *D_GROUP_LEADER;                /* [MAX_LEVELS] base of [DYN_GROUPS[L]] */
+ static int *D_CHILD_DONE_COUNT;            /* [MAX_LEVELS] base (levels >= 1) */
+ static int  D_LEAF_COUNT;                  /* [DYN_GROUPS[0]] */
+ static int  D_AGG_PRINTED, D_ROOT_GO, D_EXIT_ACKS;
+
+ static inline int dyn_span(int L) { return G_LEAF << L; }
+ static inline int dyn_owner(int L, int g) { return g * dyn_span(L); }
+
+ static void layout_dynamic(void) {
+     MAX_LEVELS = 0;
+     for (;;) {
+         int ng = ceil_div(npes, dyn_span(MAX_LEVELS));
+         MAX_LEVELS++;
+         if (ng <= 1) break;
+     }
+     DYN_GROUPS         = malloc(sizeof(int) * MAX_LEVELS);
+     D_GROUP_DONE       = malloc(sizeof(int) * MAX_LEVELS);
+     D_GROUP_LEADER     = malloc(sizeof(int) * MAX_LEVELS);
+     D_CHILD_DONE_COUNT = malloc(sizeof(int) * MAX_LEVELS);
+     if (!DYN_GROUPS || !D_GROUP_DONE || !D_GROUP_LEADER || !D_CHILD_DONE_COUNT)
+         MPI_Abort(MPI_COMM_WORLD, 1);
+
+     for (int L = 0; L < MAX_LEVELS; L++) {
+         DYN_GROUPS[L]         = ceil_div(npes, dyn_span(L));
+         D_GROUP_DONE[L]       = flag_alloc(DYN_GROUPS[L]);
+         D_GROUP_LEADER[L]     = flag_alloc(DYN_GROUPS[L]);
+         D_CHILD_DONE_COUNT[L] = (L > 0) ? flag_alloc(DYN_GROUPS[L]) : -1;
+     }
+     D_LEAF_COUNT  = flag_alloc(DYN_GROUPS[0]);
+     D_AGG_PRINTED = flag_alloc(1);
+     D_ROOT_GO     = flag_alloc(1);
+     D_EXIT_ACKS   = flag_alloc(1);
+ }
+
+ /* GROUP_LEADER is write-only during the run, so a plain put is enough */
+ static void set_leader(int L, int g, int host) {
+     MPI_Put(&me, 1, MPI_INT, host, D_GROUP_LEADER[L] + g, 1, MPI_INT, FLAGS);
+     MPI_Win_flush(host, FLAGS);
+ }
+
+ static void complete_group_and_maybe_propagate(int L, int gidx) {
+     int host = dyn_owner(L, gidx);
+     (void) flag_cswap(D_GROUP_DONE[L] + gidx, 0, 1, host);
+     set_leader(L, gidx, host);
+
+     if (g_debug) {
+         printf("PE %d finalized L=%d,g=%d (host=%d) as dynamic leader\n", me, L, gidx, host);
+         fflush(stdout);
+     }
+
+     /* Walk up while we are the LAST finishing child at each parent */
+     while (L + 1 < MAX_LEVELS) {
+         const int parent_L    = L + 1;
+         const int parent_idx  = gidx / 2;
+         const int parent_host = dyn_owner(parent_L, parent_idx);
+         const int expected    = 1 + (parent_idx * 2 + 1 < DYN_GROUPS[L] ? 1 : 0);
+
+         int prior = flag_fetch_add(D_CHILD_DONE_COUNT[parent_L] + parent_idx, 1, parent_host);
+         if (prior + 1 != expected) break;
+
+         (void) flag_cswap(D_GROUP_DONE[parent_L] + parent_idx, 0, 1, parent_host);
+         set_leader(parent_L, parent_idx, parent_host);
+         if (g_debug) {
+             printf("PE %d became DYNAMIC leader at L=%d,g=%d (last child; host=%d)\n",
+                    me, parent_L, parent_idx, parent_host);
+             fflush(stdout);
+         }
+         L    = parent_L;
+         gidx = parent_idx;
+     }
+ }
+
+ /* Each PE bumps its leaf counter exactly once; the one that sees
+  * gsize-1 is the last finisher and becomes the leaf's dynamic leader. */
+ static void mark_leaf_group_done(void) {
+     const int gidx = me / G_LEAF;
+     const int host = dyn_owner(0, gidx);
+     int end = host + G_LEAF;
+     if (end > npes) end = npes;
+
+     int prior = flag_fetch_add(D_LEAF_COUNT + gidx, 1, host);
+     if (prior == end - host - 1) complete_group_and_maybe_propagate(0, gidx);
+ }
+
+ static void run_dynamic_termination(void) {
+     const int top = MAX_LEVELS - 1;
+
+     mark_local_done();
+     mark_leaf_group_done();
+
+     /* Wait for the top flag (hosted at ROOT_PE), then two-phase exit with ACKs. */
+     while (flag_get(D_GROUP_DONE[top], ROOT_PE) != 1) sched_yield();
+
+     if (me == ROOT_PE) {
+         if (flag_cswap(D_AGG_PRINTED, 0, 1, ROOT_PE) == 0) root_report();
+         flag_put(D_ROOT_GO, 1, ROOT_PE);
+         flag_wait_ge(D_EXIT_ACKS, npes - 1);
+     } else {
+         while (flag_get(D_ROOT_GO, ROOT_PE) == 0) sched_yield();
+         (void) flag_fetch_add(D_EXIT_ACKS, 1, ROOT_PE);
+     }
+ }
+
+ /* ========== MPI collective baselines ========== */
+
+ static void run_allreduce_termination(void) {
+     int done = 1, all = 0;
+     mark_local_done();
+     MPI_Allreduce(&done, &all, 1, MPI_INT, MPI_LAND, MPI_COMM_WORLD);
+     if (me == ROOT_PE && all) root_report();
+ }
+
+ static void run_ibarrier_termination(void) {
+     MPI_Request req;
+     int flag = 0;
+     mark_local_done();
+     MPI_Ibarrier(MPI_COMM_WORLD, &req);
+     while (!flag) MPI_Test(&req, &flag, MPI_STATUS_IGNORE);
+     if (me == ROOT_PE) root_report();
+ }
+
+ /* ---------- main ---------- */
+
+ int main(int argc, char **argv) {
+     MPI_Init(&argc, &argv);
+     MPI_Comm_rank(MPI_COMM_WORLD, &me);
+     MPI_Comm_size(MPI_COMM_WORLD, &npes);
+
+     scheme_t scheme;
+     if (!env_scheme(&scheme)) {
+         if (me == 0) fprintf(stderr, "GLOBAL_DONE_SCHEME must be star|hstar|dynamic|allreduce|ibarrier\n");
+         MPI_Finalize();
+         return 1;
+     }
+     g_debug = env_debug_enabled();
+     G_LEAF  = env_group_size();
+     K       = env_branch_k();
+     const int work_us = env_work_us();
+
+     /* Layout pass: every rank computes the same displacements. */
+     switch (scheme) {
+     case SCHEME_STAR:    layout_star();    break;
+     case SCHEME_HSTAR:   layout_hstar();   break;
+     case SCHEME_DYNAMIC: layout_dynamic(); break;
+     default:                               break;
+     }
+
+     MPI_Win_allocate((MPI_Aint)((FLAG_COUNT > 0 ? FLAG_COUNT : 1) * sizeof(int)), sizeof(int),
+                      MPI_INFO_NULL, MPI_COMM_WORLD, &FLAG_BASE, &FLAGS);
+     MPI_Win_allocate((MPI_Aint)(2 * sizeof(double)), sizeof(double),
+                      MPI_INFO_NULL, MPI_COMM_WORLD, &ELAPSED_MS, &ELAPSED_WIN);
+     memset(FLAG_BASE, 0, (size_t)(FLAG_COUNT > 0 ? FLAG_COUNT : 1) * sizeof(int));
+     ELAPSED_MS[0] = ELAPSED_MS[1] = 0.0;
+     MPI_Win_lock_all(MPI_MODE_NOCHECK, FLAGS);
+     MPI_Win_lock_all(MPI_MODE_NOCHECK, ELAPSED_WIN);
+     MPI_Win_sync(FLAGS);
+     MPI_Win_sync(ELAPSED_WIN);
+
+     if (g_debug && me == 0) {
+         printf("[DEBUG] scheme=%s, npes=%d, group_size=%d, K=%d, work_us=%d, flag_ints=%d\n",
+                scheme_names[scheme], npes, G_LEAF, K, work_us, FLAG_COUNT);
+         fflush(stdout);
+     }
+
+     /* Align start for timing (also orders the zeroing above before any RMA) */
+     MPI_Barrier(MPI_COMM_WORLD);
+     g_start_time = now_sec();
+
+     do_synthetic_work(work_us);
+
+     switch (scheme) {
+     case SCHEME_STAR:      run_star_termination();      break;
+     case SCHEME_HSTAR:     run_hstar_termination();     break;
+     case SCHEME_DYNAMIC:   run_dynamic_termination();   break;
+     case SCHEME_ALLREDUCE: run_allreduce_termination(); break;
+     case SCHEME_IBARRIER:  run_ibarrier_termination();  break;
+     }
+
+     /* Final collective proof, as in the STAR program */
+     MPI_Barrier(MPI_COMM_WORLD);
+     if (me == ROOT_PE) {
+         printf("ALL_CLEAR: all %d PEs observed termination and reached the final barrier.\n", npes);
+         fflush(stdout);
+     }
+
+     MPI_Win_unlock_all(ELAPSED_WIN);
+     MPI_Win_unlock_all(FLAGS);
+     MPI_Win_free(&ELAPSED_WIN);
+     MPI_Win_free(&FLAGS);
+     free(NUM_GROUPS); free(D_LVL_CHILD_DONE);
+     free(DYN_GROUPS); free(D_GROUP_DONE); free(D_GROUP_LEADER); free(D_CHILD_DONE_COUNT);
+     MPI_Finalize();
+     return 0;
+ }
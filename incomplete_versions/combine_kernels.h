@@ -0,0 +1,236 @@
+/* combine_kernels.h
+ * Datatype- and op-generic reduction kernels shared by the reduction benches.
+ *
+ * One entry point per (dtype, op):
+ *     combine_n(acc, srcs, nsrc, len):  acc[j] = acc[j] OP srcs[0][j] OP ... OP srcs[nsrc-1][j]
+ * folding all sources in a single pass over acc (one load + one store of acc
+ * per vector, the sources streamed alongside), instead of one pass per child.
+ *
+ * Types: int32, int64, float, double.  Ops: sum, min, max, band, bor
+ * (band/bor are integer-only).  Explicit AVX2 and AVX-512 paths are picked at
+ * runtime (__builtin_cpu_supports); COMBINE_ISA=scalar|avx2|avx512 forces one.
+ * Header-only and MPI/SHMEM-agnostic: callers map dtype/op to their runtime.
+ */
+#ifndef COMBINE_KERNELS_H
+#define COMBINE_KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define CK_HAVE_X86 1
+#else
+#define CK_HAVE_X86 0
+#endif
+
+typedef enum { DT_INT32, DT_INT64, DT_FLOAT, DT_DOUBLE, DT_COUNT } ck_dtype_t;
+typedef enum { OP_SUM, OP_MIN, OP_MAX, OP_BAND, OP_BOR, OP_COUNT } ck_op_t;
+typedef enum { ISA_SCALAR, ISA_AVX2, ISA_AVX512, ISA_COUNT } ck_isa_t;
+
+static const char *const ck_dtype_names[DT_COUNT] = { "int32", "int64", "float", "double" };
+static const char *const ck_op_names[OP_COUNT]    = { "sum", "min", "max", "band", "bor" };
+static const char *const ck_isa_names[ISA_COUNT]  = { "scalar", "avx2", "avx512" };
+static const size_t      ck_dtype_size[DT_COUNT]  = { 4, 8, 4, 8 };
+
+typedef void (*combine_n_fn)(void *acc, const void *const *srcs, int nsrc, size_t len);
+
+typedef struct {
+    ck_dtype_t   dtype;
+    ck_op_t      op;
+    ck_isa_t     isa;
+    size_t       esize;
+    combine_n_fn combine_n;
+} combine_kernel_t;
+
+/* ---------- scalar ---------- */
+
+#define CK_SUM(x, y)  ((x) + (y))
+#define CK_MIN(x, y)  ((y) < (x) ? (y) : (x))
+#define CK_MAX(x, y)  ((y) > (x) ? (y) : (x))
+#define CK_BAND(x, y) ((x) & (y))
+#define CK_BOR(x, y)  ((x) | (y))
+
+/* Blocked so each acc block stays in L1 while all sources are folded in. */
+#define CK_SCALAR_BLOCK 512
+
+#define CK_DEFINE_SCALAR(T, tname, oname, SOP)                                          \
+static void ck_scalar_##tname##_##oname(void *acc, const void *const *srcs,             \
+                                        int nsrc, size_t len) {                         \
+    T *a = (T *)acc;                                                                    \
+    for (size_t b = 0; b < len; b += CK_SCALAR_BLOCK) {                                 \
+        const size_t e = (b + CK_SCALAR_BLOCK < len) ? b + CK_SCALAR_BLOCK : len;       \
+        for (int s = 0; s < nsrc; ++s) {                                                \
+            const T *src = (const T *)srcs[s];                                          \
+            for (size_t j = b; j < e; ++j) a[j] = SOP(a[j], src[j]);                    \
+        }                                                                               \
+    }                                                                                   \
+}
+
+CK_DEFINE_SCALAR(int32_t, int32,  sum,  CK_SUM)
+CK_DEFINE_SCALAR(int32_t, int32,  min,  CK_MIN)
+CK_DEFINE_SCALAR(int32_t, int32,  max,  CK_MAX)
+CK_DEFINE_SCALAR(int32_t, int32,  band, CK_BAND)
+CK_DEFINE_SCALAR(int32_t, int32,  bor,  CK_BOR)
+CK_DEFINE_SCALAR(int64_t, int64,  sum,  CK_SUM)
+CK_DEFINE_SCALAR(int64_t, int64,  min,  CK_MIN)
+CK_DEFINE_SCALAR(int64_t, int64,  max,  CK_MAX)
+CK_DEFINE_SCALAR(int64_t, int64,  band, CK_BAND)
+CK_DEFINE_SCALAR(int64_t, int64,  bor,  CK_BOR)
+CK_DEFINE_SCALAR(float,   float,  sum,  CK_SUM)
+CK_DEFINE_SCALAR(float,   float,  min,  CK_MIN)
+CK_DEFINE_SCALAR(float,   float,  max,  CK_MAX)
+CK_DEFINE_SCALAR(double,  double, sum,  CK_SUM)
+CK_DEFINE_SCALAR(double,  double, min,  CK_MIN)
+CK_DEFINE_SCALAR(double,  double, max,  CK_MAX)
+
+/* ---------- SIMD ---------- */
+
+#if CK_HAVE_X86
+
+/* acc vector is loaded once, every source folded in registers, stored once. */
+#define CK_DEFINE_SIMD(isa, TGT, T, tname, oname, W, VT, LD, ST, VOP, SOP)              \
+__attribute__((target(TGT)))                                                            \
+static void ck_##isa##_##tname##_##oname(void *acc, const void *const *srcs,            \
+                                         int nsrc, size_t len) {                        \
+    T *a = (T *)acc;                                                                    \
+    size_t j = 0;                                                                       \
+    for (; j + (W) <= len; j += (W)) {                                                  \
+        VT v = LD(a + j);                                                               \
+        for (int s = 0; s < nsrc; ++s) v = VOP(v, LD((const T *)srcs[s] + j));          \
+        ST(a + j, v);                                                                   \
+    }                                                                                   \
+    for (; j < len; ++j) {                                                              \
+        T x = a[j];                                                                     \
+        for (int s = 0; s < nsrc; ++s) x = SOP(x, ((const T *)srcs[s])[j]);             \
+        a[j] = x;                                                                       \
+    }                                                                                   \
+}
+
+/* AVX2 */
+#define CK_LD256I(p)     _mm256_loadu_si256((const __m256i *)(const void *)(p))
+#define CK_ST256I(p, v)  _mm256_storeu_si256((__m256i *)(void *)(p), (v))
+#define CK_LD256S(p)     _mm256_loadu_ps(p)
+#define CK_ST256S(p, v)  _mm256_storeu_ps((p), (v))
+#define CK_LD256D(p)     _mm256_loadu_pd(p)
+#define CK_ST256D(p, v)  _mm256_storeu_pd((p), (v))
+
+/* AVX2 has no 64-bit integer min/max: compare + blend. */
+__attribute__((target("avx2")))
+static inline __m256i ck_mm256_min_epi64(__m256i a, __m256i b) {
+    return _mm256_blendv_epi8(a, b, _mm256_cmpgt_epi64(a, b));
+}
+__attribute__((target("avx2")))
+static inline __m256i ck_mm256_max_epi64(__m256i a, __m256i b) {
+    return _mm256_blendv_epi8(b, a, _mm256_cmpgt_epi64(a, b));
+}
+
+CK_DEFINE_SIMD(avx2, "avx2", int32_t, int32,  sum,  8, __m256i, CK_LD256I, CK_ST256I, _mm256_add_epi32,   CK_SUM)
+CK_DEFINE_SIMD(avx2, "avx2", int32_t, int32,  min,  8, __m256i, CK_LD256I, CK_ST256I, _mm256_min_epi32,   CK_MIN)
+CK_DEFINE_SIMD(avx2, "avx2", int32_t, int32,  max,  8, __m256i, CK_LD256I, CK_ST256I, _mm256_max_epi32,   CK_MAX)
+CK_DEFINE_SIMD(avx2, "avx2", int32_t, int32,  band, 8, __m256i, CK_LD256I, CK_ST256I, _mm256_and_si256,   CK_BAND)
+CK_DEFINE_SIMD(avx2, "avx2", int32_t, int32,  bor,  8, __m256i, CK_LD256I, CK_ST256I, _mm256_or_si256,    CK_BOR)
+CK_DEFINE_SIMD(avx2, "avx2", int64_t, int64,  sum,  4, __m256i, CK_LD256I, CK_ST256I, _mm256_add_epi64,   CK_SUM)
+CK_DEFINE_SIMD(avx2, "avx2", int64_t, int64,  min,  4, __m256i, CK_LD256I, CK_ST256I, ck_mm256_min_epi64, CK_MIN)
+CK_DEFINE_SIMD(avx2, "avx2", int64_t, int64,  max,  4, __m256i, CK_LD256I, CK_ST256I, ck_mm256_max_epi64, CK_MAX)
+CK_DEFINE_SIMD(avx2, "avx2", int64_t, int64,  band, 4, __m256i, CK_LD256I, CK_ST256I, _mm256_and_si256,   CK_BAND)
+CK_DEFINE_SIMD(avx2, "avx2", int64_t, int64,  bor,  4, __m256i, CK_LD256I, CK_ST256I, _mm256_or_si256,    CK_BOR)
+CK_DEFINE_SIMD(avx2, "avx2", float,   float,  sum,  8, __m256,  CK_LD256S, CK_ST256S, _mm256_add_ps,      CK_SUM)
+CK_DEFINE_SIMD(avx2, "avx2", float,   float,  min,  8, __m256,  CK_LD256S, CK_ST256S, _mm256_min_ps,      CK_MIN)
+CK_DEFINE_SIMD(avx2, "avx2", float,   float,  max,  8, __m256,  CK_LD256S, CK_ST256S, _mm256_max_ps,      CK_MAX)
+CK_DEFINE_SIMD(avx2, "avx2", double,  double, sum,  4, __m256d, CK_LD256D, CK_ST256D, _mm256_add_pd,      CK_SUM)
+CK_DEFINE_SIMD(avx2, "avx2", double,  double, min,  4, __m256d, CK_LD256D, CK_ST256D, _mm256_min_pd,      CK_MIN)
+CK_DEFINE_SIMD(avx2, "avx2", double,  double, max,  4, __m256d, CK_LD256D, CK_ST256D, _mm256_max_pd,      CK_MAX)
+
+/* AVX-512 (foundation only) */
+#define CK_LD512I(p)     _mm512_loadu_si512((const void *)(p))
+#define CK_ST512I(p, v)  _mm512_storeu_si512((void *)(p), (v))
+#define CK_LD512S(p)     _mm512_loadu_ps(p)
+#define CK_ST512S(p, v)  _mm512_storeu_ps((p), (v))
+#define CK_LD512D(p)     _mm512_loadu_pd(p)
+#define CK_ST512D(p, v)  _mm512_storeu_pd((p), (v))
+
+CK_DEFINE_SIMD(avx512, "avx512f", int32_t, int32,  sum,  16, __m512i, CK_LD512I, CK_ST512I, _mm512_add_epi32, CK_SUM)
+CK_DEFINE_SIMD(avx512, "avx512f", int32_t, int32,  min,  16, __m512i, CK_LD512I, CK_ST512I, _mm512_min_epi32, CK_MIN)
+CK_DEFINE_SIMD(avx512, "avx512f", int32_t, int32,  max,  16, __m512i, CK_LD512I, CK_ST512I, _mm512_max_epi32, CK_MAX)
+CK_DEFINE_SIMD(avx512, "avx512f", int32_t, int32,  band, 16, __m512i, CK_LD512I, CK_ST512I, _mm512_and_si512, CK_BAND)
+CK_DEFINE_SIMD(avx512, "avx512f", int32_t, int32,  bor,  16, __m512i, CK_LD512I, CK_ST512I, _mm512_or_si512,  CK_BOR)
+CK_DEFINE_SIMD(avx512, "avx512f", int64_t, int64,  sum,  8,  __m512i, CK_LD512I, CK_ST512I, _mm512_add_epi64, CK_SUM)
+CK_DEFINE_SIMD(avx512, "avx512f", int64_t, int64,  min,  8,  __m512i, CK_LD512I, CK_ST512I, _mm512_min_epi64, CK_MIN)
+CK_DEFINE_SIMD(avx512, "avx512f", int64_t, int64,  max,  8,  __m512i, CK_LD512I, CK_ST512I, _mm512_max_epi64, CK_MAX)
+CK_DEFINE_SIMD(avx512, "avx512f", int64_t, int64,  band, 8,  __m512i, CK_LD512I, CK_ST512I, _mm512_and_si512, CK_BAND)
+CK_DEFINE_SIMD(avx512, "avx512f", int64_t, int64,  bor,  8,  __m512i, CK_LD512I, CK_ST512I, _mm512_or_si512,  CK_BOR)
+CK_DEFINE_SIMD(avx512, "avx512f", float,   float,  sum,  16, __m512,  CK_LD512S, CK_ST512S, _mm512_add_ps,    CK_SUM)
+CK_DEFINE_SIMD(avx512, "avx512f", float,   float,  min,  16, __m512,  CK_LD512S, CK_ST512S, _mm512_min_ps,    CK_MIN)
+CK_DEFINE_SIMD(avx512, "avx512f", float,   float,  max,  16, __m512,  CK_LD512S, CK_ST512S, _mm512_max_ps,    CK_MAX)
+CK_DEFINE_SIMD(avx512, "avx512f", double,  double, sum,  8,  __m512d, CK_LD512D, CK_ST512D, _mm512_add_pd,    CK_SUM)
+CK_DEFINE_SIMD(avx512, "avx512f", double,  double, min,  8,  __m512d, CK_LD512D, CK_ST512D, _mm512_min_pd,    CK_MIN)
+CK_DEFINE_SIMD(avx512, "avx512f", double,  double, max,  8,  __m512d, CK_LD512D, CK_ST512D, _mm512_max_pd,    CK_MAX)
+
+#endif /* CK_HAVE_X86 */
+
+/* ---------- dispatch ---------- */
+
+#define CK_ROW(isa, tname) \
+    { ck_##isa##_##tname##_sum, ck_##isa##_##tname##_min, ck_##isa##_##tname##_max, \
+      ck_##isa##_##tname##_band, ck_##isa##_##tname##_bor }
+#define CK_ROW_FP(isa, tname) \
+    { ck_##isa##_##tname##_sum, ck_##isa##_##tname##_min, ck_##isa##_##tname##_max, NULL, NULL }
+
+/* [isa][dtype][op]; NULL = unsupported combination (or ISA not compiled in) */
+static const combine_n_fn ck_table[ISA_COUNT][DT_COUNT][OP_COUNT] = {
+    { CK_ROW(scalar, int32), CK_ROW(scalar, int64), CK_ROW_FP(scalar, float), CK_ROW_FP(scalar, double) },
+#if CK_HAVE_X86
+    { CK_ROW(avx2, int32),   CK_ROW(avx2, int64),   CK_ROW_FP(avx2, float),   CK_ROW_FP(avx2, double) },
+    { CK_ROW(avx512, int32), CK_ROW(avx512, int64), CK_ROW_FP(avx512, float), CK_ROW_FP(avx512, double) },
+#endif
+};
+
+/* Widest ISA this CPU supports, unless COMBINE_ISA overrides it. */
+static ck_isa_t ck_detect_isa(void) {
+    ck_isa_t best = ISA_SCALAR;
+#if CK_HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))    best = ISA_AVX2;
+    if (__builtin_cpu_supports("avx512f")) best = ISA_AVX512;
+#endif
+    const char *e = getenv("COMBINE_ISA");
+    if (e && e[0] != '\0') {
+        for (int i = 0; i < ISA_COUNT; ++i)
+            if (!strcmp(e, ck_isa_names[i]) && i <= (int)best) return (ck_isa_t)i;
+    }
+    return best;
+}
+
+/* Returns 0 on success, -1 if (dtype, op) is not a valid combination. */
+static int combine_kernel_init(combine_kernel_t *k, ck_dtype_t dtype, ck_op_t op) {
+    memset(k, 0, sizeof(*k));
+    if (dtype >= DT_COUNT || op >= OP_COUNT || !ck_table[ISA_SCALAR][dtype][op]) return -1;
+    k->dtype = dtype;
+    k->op    = op;
+    k->esize = ck_dtype_size[dtype];
+    k->isa   = ck_detect_isa();
+    k->combine_n = ck_table[k->isa][dtype][op];
+    if (!k->combine_n) { k->isa = ISA_SCALAR; k->combine_n = ck_table[ISA_SCALAR][dtype][op]; }
+    return 0;
+}
+
+/* acc[j] = acc[j] OP src[j] */
+static inline void combine_1(const combine_kernel_t *k, void *acc, const void *src, size_t len) {
+    const void *srcs[1] = { src };
+    k->combine_n(acc, srcs, 1, len);
+}
+
+/* Name -> enum, -1 if unknown. */
+static inline int ck_dtype_from_name(const char *s) {
+    for (int i = 0; i < DT_COUNT; ++i) if (!strcmp(s, ck_dtype_names[i])) return i;
+    return -1;
+}
+static inline int ck_op_from_name(const char *s) {
+    for (int i = 0; i < OP_COUNT; ++i) if (!strcmp(s, ck_op_names[i])) return i;
+    return -1;
+}
+
+#endif /* COMBINE_KERNELS_H */
@@ -0,0 +1,133 @@
+/* lat_stats.h
+ * Per-iteration latency distributions shared by the benches.
+ *
+ * Each rank/PE stamps every timed iteration into a preallocated array of
+ * seconds; the root collects them rank-major (nranks x iters), takes the
+ * per-iteration maximum over ranks (the iteration is only done when its
+ * slowest participant is), and reports from that series:
+ *     p50 / p90 / p99 / p99.9 / max (nearest-rank percentiles)
+ *     a histogram over log2 buckets, [2^b, 2^(b+1)) ns
+ * lat_dump() appends the raw per-rank samples to a binary file, one record
+ * per timed loop (native byte order):
+ *     uint32 magic 'LAT1' | int32 nranks | int64 iters | char label[128]
+ *     double secs[nranks][iters]
+ * e.g. numpy: hdr = np.fromfile(f, '<u4,<i4,<i8,S128', 1); np.fromfile(f, '<f8', n*it).reshape(n, it)
+ * Header-only, MPI/SHMEM-agnostic and libm-free: callers do the gathering.
+ */
+#ifndef LAT_STATS_H
+#define LAT_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LAT_HIST_BUCKETS 40     /* 2^40 ns ~ 18 min: nothing lands past the end */
+#define LAT_LABEL_LEN    128
+#define LAT_MAGIC        0x3154414cu    /* "LAT1" little-endian */
+
+typedef struct {
+    long   n;
+    double mean, p50, p90, p99, p999, max;      /* seconds */
+    long   hist[LAT_HIST_BUCKETS];
+} lat_summary_t;
+
+/* worst[k] = max over ranks of all[r * iters + k] */
+static void lat_worst(const double *all, int nranks, long iters, double *worst) {
+    for (long k = 0; k < iters; ++k) worst[k] = all[k];
+    for (int r = 1; r < nranks; ++r) {
+        const double *s = all + (size_t)r * (size_t)iters;
+        for (long k = 0; k < iters; ++k) if (s[k] > worst[k]) worst[k] = s[k];
+    }
+}
+
+static int lat_cmp_double(const void *a, const void *b) {
+    const double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static int lat_bucket(double secs) {
+    const double ns = secs * 1e9;
+    if (!(ns >= 2.0)) return 0;
+    if (ns >= (double)(1ull << (LAT_HIST_BUCKETS - 1))) return LAT_HIST_BUCKETS - 1;
+    return 63 - __builtin_clzll((uint64_t)ns);
+}
+
+/* Nearest rank: the smallest sample with at least permille/1000 of the series
+   at or below it. */
+static double lat_percentile(const double *sorted, long n, long permille) {
+    long i = (n * permille + 999) / 1000 - 1;
+    if (i < 0) i = 0;
+    if (i >= n) i = n - 1;
+    return sorted[i];
+}
+
+/* Returns 0, or -1 if the sort copy cannot be allocated (s is then zeroed). */
+static int lat_summarize(const double *samples, long n, lat_summary_t *s) {
+    memset(s, 0, sizeof(*s));
+    if (n <= 0) return 0;
+    double *sorted = (double *)malloc((size_t)n * sizeof(double));
+    if (!sorted) return -1;
+    memcpy(sorted, samples, (size_t)n * sizeof(double));
+    qsort(sorted, (size_t)n, sizeof(double), lat_cmp_double);
+
+    double sum = 0.0;
+    for (long k = 0; k < n; ++k) {
+        sum += samples[k];
+        s->hist[lat_bucket(samples[k])]++;
+    }
+    s->n    = n;
+    s->mean = sum / (double)n;
+    s->p50  = lat_percentile(sorted, n, 500);
+    s->p90  = lat_percentile(sorted, n, 900);
+    s->p99  = lat_percentile(sorted, n, 990);
+    s->p999 = lat_percentile(sorted, n, 999);
+    s->max  = sorted[n - 1];
+    free(sorted);
+    return 0;
+}
+
+/* One table row, in us. */
+static void lat_print(FILE *f, int width, const char *label, const lat_summary_t *s) {
+    fprintf(f, "  %-*s : p50 %8.2f  p90 %8.2f  p99 %8.2f  p99.9 %8.2f  max %9.2f  (mean %.2f)\n",
+            width, label, 1e6 * s->p50, 1e6 * s->p90, 1e6 * s->p99, 1e6 * s->p999, 1e6 * s->max,
+            1e6 * s->mean);
+}
+
+/* Non-empty span of the histogram, one line per bucket, bars scaled to the fullest. */
+static void lat_print_hist(FILE *f, const char *label, const lat_summary_t *s) {
+    int lo = LAT_HIST_BUCKETS, hi = -1;
+    long peak = 0;
+    for (int b = 0; b < LAT_HIST_BUCKETS; ++b) {
+        if (!s->hist[b]) continue;
+        if (b < lo) lo = b;
+        hi = b;
+        if (s->hist[b] > peak) peak = s->hist[b];
+    }
+    fprintf(f, "  %s (us):\n", label);
+    for (int b = lo; b <= hi; ++b) {
+        const int bar = (int)((40 * s->hist[b] + peak - 1) / peak);
+        fprintf(f, "    [%10.3f, %10.3f) %9ld%s%.*s\n", (double)(1ull << b) * 1e-3, (double)(1ull << (b + 1)) * 1e-3,
+                s->hist[b], s->hist[b] ? "  " : "", bar, "########################################");
+    }
+}
+
+/* Append one record; returns 0, or -1 on a short write. */
+static int lat_dump(FILE *f, const char *label, int nranks, long iters, const double *all) {
+    const uint32_t magic = LAT_MAGIC;
+    const int32_t  nr = nranks;
+    const int64_t  it = iters;
+    char name[LAT_LABEL_LEN];
+    size_t len = strlen(label);
+    if (len >= sizeof(name)) len = sizeof(name) - 1;
+    memset(name, 0, sizeof(name));
+    memcpy(name, label, len);
+    const size_t n = (size_t)nranks * (size_t)iters;
+    if (fwrite(&magic, sizeof(magic), 1, f) != 1 || fwrite(&nr, sizeof(nr), 1, f) != 1 ||
+        fwrite(&it, sizeof(it), 1, f) != 1 || fwrite(name, sizeof(name), 1, f) != 1 ||
+        fwrite(all, sizeof(double), n, f) != n)
+        return -1;
+    return 0;
+}
+
+#endif /* LAT_STATS_H */
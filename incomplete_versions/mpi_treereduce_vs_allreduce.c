@@ -1,13 +1,44 @@
 // mpi_treereduce_vs_allreduce.c
 // Compare a manual k-ary TreeReduce (+ down-broadcast) against MPI_Allreduce.
-// Build: mpicc -O3 -march=native -std=c11 mpi_treereduce_vs_allreduce.c -o mpi_bench
+// Build: mpicc -O3 -march=native -std=c11 -pthread mpi_treereduce_vs_allreduce.c -o mpi_bench -lm
 // Run:   mpirun -np 8 --oversubscribe --bind-to none ./mpi_bench --iters 20000 --count 1 --checks
+//        (large counts: add --segment S to pipeline the tree in S-element segments)
+// Sweep: for c in 1 16 256 4096 65536 1048576 16777216; do
+//          mpirun -np 8 ./mpi_bench --iters 200 --algo tree,rabenseifner --count $c; done
+//        (multiroot: --roots 1,2,4,8 times one row per root count R)
+//        (hier on one box: MPI_BENCH_RANKS_PER_NODE=4 mpirun -np 8 ./mpi_bench --algo hier)
+//        (element type / op: --dtype int32|int64|float|double --op sum|min|max|band|bor;
+//         combine kernels live in combine_kernels.h, COMBINE_ISA=scalar|avx2|avx512 forces a path)
+//        (tree-async runs the tree on a progress thread; MPI is then initialised with
+//         MPI_THREAD_MULTIPLE, give each rank two cores)
+//        (many small reductions: --fuse 64 times 64 count-C reductions per step, fused vs unfused)
+//        (mostly-zero vectors: --count 1000000 --sparse 0.1,1,10,50 times the sparse tree)
+//        (reproducible double sums: --repro 64; the printed hashes match across -np and fanouts)
+//        (bandwidth-bound float sums: --count 4194304 --wire bf16,fp16,int8 [--wire-ef])
+//        (termination of a sparse exchange: --nbx 8 times NBX against summing message counts)
+//        (tree shape: --tree-shape heap|binomial|knomial|nodemap; also prints how many tree
+//         edges cross nodes, e.g. MPI_BENCH_RANKS_PER_NODE=4 mpirun -np 16 --map-by core)
+//        (fanout x count curves in one launch: --sweep-count 1,64,4096 --sweep-fanout 2,4,8
+//         --algos tree,ring --format csv|json --out FILE; one row per point and algorithm)
+//        (tail latency: --latency prints per-iteration percentiles and a log2 histogram of the
+//         slowest rank; --lat-dump FILE also writes every rank's samples, see lat_stats.h)
 
+#define _POSIX_C_SOURCE 200809L  /* pthreads, thread CPU-time clocks */
+
+#include <limits.h>
+#include <math.h>
 #include <mpi.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
+
+#include "combine_kernels.h"
+#include "lat_stats.h"
 
 static inline long value_for_iter(long k, int me) {
     return k + 1 + me; // make each iteration’s value change
@@ -15,234 +46,4241 @@ static inline long value_for_iter(long k, int me) {
 
 static void usage_and_exit(const char *prog) {
     fprintf(stderr,
-        "Usage: %s [--iters N] [--warmup W] [--count C] [--fanout K] [--checks]\n", prog);
+        "Usage: %s [--iters N] [--warmup W] [--count C] [--fanout K] [--segment S]\n"
+        "          [--combine arrival|waitall|both] [--algo|--algos A[,A...]] [--ring-chunk E]\n"
+        "          [--roots R[,R...]] [--hier-inter tree|ring] [--dtype T] [--op O] [--inplace]\n"
+        "          [--tree-shape heap|binomial|knomial|nodemap]\n"
+        "          [--overlap-us U] [--progress-us P] [--fuse N] [--fuse-bytes B]\n"
+        "          [--sparse D[,D...]] [--sparse-dense-at P] [--repro S]\n"
+        "          [--wire F[,F...]] [--wire-ef] [--nbx M] [--latency] [--lat-dump FILE] [--checks]\n"
+        "          [--sweep-count C[,C...]] [--sweep-fanout K[,K...]] [--format csv|json] [--out FILE]\n"
+        "  algos: tree, tree-persist, tree-nb, tree-async, tree-rma, rabenseifner, recdbl, ring, dbtree, multiroot, hier,\n"
+        "         iallreduce, allreduce-init (MPI-4), reduce-bcast (library baselines)\n"
+        "         (MPI_Allreduce is always timed as the baseline)\n"
+        "  --overlap-us U: compute window between start and wait of iallreduce / tree-nb /\n"
+        "                  tree-async (progress thread, needs MPI_THREAD_MULTIPLE);\n"
+        "                  with either selected, also reports the share of communication hidden,\n"
+        "                  without and with a test call every P us of compute (default 10)\n"
+        "  --fuse N: also time N independent count-C allreduces per step (even: --op, odd: max),\n"
+        "            as N MPI_Allreduce, N unfused trees, and fused into one tree pass per\n"
+        "            flush of at most B packed bytes (default 4096)\n"
+        "  --sparse D: also time a sparse (index, value) tree allreduce at each density D (percent\n"
+        "              of count) against the dense tree and MPI_Allreduce; lists switch to dense\n"
+        "              above P percent (default 25); op sum or bor\n"
+        "  --repro S: also time a bit-reproducible double sum of S summands per element (spread\n"
+        "             over the ranks) against the plain double tree, at fanouts 2, 3, 4, 8\n"
+        "  --wire F: also time the tree and the ring on a float sum with bf16, fp16 or int8\n"
+        "            (per-256-block scale) messages and fp32 accumulation, against their fp32\n"
+        "            versions, with the error vs MPI_Allreduce; --wire-ef adds error feedback\n"
+        "  --nbx M: also time a sparse exchange of 0..M messages per rank to random ranks,\n"
+        "           terminated by NBX (Issend + Ibarrier) or by first summing the message\n"
+        "           counts with MPI_Allreduce or the tree\n"
+        "  dtype: int32, int64 (default), float, double\n"
+        "  op:    sum (default), min, max, band, bor (band/bor: integer types only)\n"
+        "  --inplace: call every algorithm with sendbuf = MPI_IN_PLACE\n"
+        "  --latency: stamp every timed iteration on every rank and report p50/p90/p99/p99.9\n"
+        "             and a log2 histogram of the per-iteration maximum over ranks;\n"
+        "             --lat-dump FILE also appends the raw per-rank samples (implies --latency)\n"
+        "  --sweep-count / --sweep-fanout: time every selected algorithm at each (fanout, count)\n"
+        "             point (a missing list is --count / --fanout) and write one CSV or JSON-lines\n"
+        "             row per point and algorithm, with ranks, nodes, MPI library and CPU model,\n"
+        "             to --out (default stdout) instead of the table; multiroot uses the first\n"
+        "             --roots value; --combine both, the studies and the summary lines are off\n"
+        "  --tree-shape: tree, tree-persist, tree-nb and tree-async as a k-ary heap (default),\n"
+        "                binomial or k-nomial (radix --fanout) tree, or a node-contiguous heap\n"
+        "                (k-ary within each node, then across node leaders)\n"
+        "  env:   MPI_BENCH_RANKS_PER_NODE=N fakes N-rank nodes for hier and the tree shapes\n", prog);
     MPI_Abort(MPI_COMM_WORLD, 1);
 }
 
-enum { TAG_REDUCE = 1001, TAG_BCAST = 1002 };
+enum { TAG_REDUCE = 1001, TAG_BCAST = 1002, TAG_RSAG = 1003, TAG_RDBL = 1004, TAG_RING = 1005,
+       TAG_FUSE_UP = 1006, TAG_FUSE_DOWN = 1007, TAG_SPARSE_UP = 1008, TAG_SPARSE_DOWN = 1009,
+       TAG_SDX = 1010 /* and 1011: sparse-exchange rounds alternate */,
+       TAG_FOREST = 1100 /* tree t of a forest uses TAG_FOREST+2t (up), +2t+1 (down) */ };
+
+/* Element type and reduction every algorithm runs: the combine kernel plus the
+   matching MPI datatype/op (wire type, and the MPI_Allreduce baseline). */
+typedef struct {
+    combine_kernel_t k;
+    MPI_Datatype     type;
+    MPI_Op           op;
+} RedSpec;
+
+/* Returns -1 if op does not apply to dtype (bitwise ops on floating point). */
+static int red_spec_init(RedSpec *rs, ck_dtype_t dtype, ck_op_t op) {
+    static const MPI_Op ops[OP_COUNT] = { MPI_SUM, MPI_MIN, MPI_MAX, MPI_BAND, MPI_BOR };
+    if (combine_kernel_init(&rs->k, dtype, op) != 0) return -1;
+    switch (dtype) {
+    case DT_INT32:  rs->type = MPI_INT32_T; break;
+    case DT_INT64:  rs->type = MPI_INT64_T; break;
+    case DT_FLOAT:  rs->type = MPI_FLOAT;   break;
+    default:        rs->type = MPI_DOUBLE;  break;
+    }
+    rs->op = ops[op];
+    return 0;
+}
+
+/* Element i of a typed buffer. */
+static inline void *buf_at(void *p, size_t i, size_t esize) {
+    return (char*)p + i * esize;
+}
+static inline const void *cbuf_at(const void *p, size_t i, size_t esize) {
+    return (const char*)p + i * esize;
+}
+
+/* Receive slots per child in segmented mode: segment s+1 lands while s is combined. */
+#define TREE_SEG_SLOTS 2
+
+/* Tree shapes, all rooted at rank 0 (--tree-shape). */
+enum { TREE_SHAPE_HEAP, TREE_SHAPE_BINOMIAL, TREE_SHAPE_KNOMIAL, TREE_SHAPE_NODEMAP, TREE_NSHAPES };
+static const char *tree_shape_names[TREE_NSHAPES] = { "heap", "binomial", "knomial", "nodemap" };
+
+/* How a node folds its children's contributions into its result. */
+enum {
+    TREE_COMBINE_ON_ARRIVAL = 0,   // MPI_Waitsome: fold each child as it lands
+    TREE_COMBINE_WAITALL    = 1    // MPI_Waitall, then fold all children
+};
+
+/* One typed run of a fused message (FuseQueue): bytes [off, off + len*esize)
+   hold len elements reduced with k. */
+typedef struct {
+    size_t off;
+    size_t len;
+    const combine_kernel_t *k;
+} FuseRun;
 
-/* Plan describing my place in a k-ary heap tree rooted at rank 0. */
+/* Plan describing my place in one reduction tree.  tree_plan_init() builds the
+   k-ary heap tree rooted at rank 0 (tree_plan_init_shape(): any TREE_SHAPE_*);
+   other trees fill parent/children themselves and call tree_plan_setup(). */
 typedef struct {
     int me, np;
-    int fanout;
+    int fanout;                 // k (heap, nodemap) or radix (k-nomial, binomial: 2)
+    int shape;                  // TREE_SHAPE_*
     int parent;                 // -1 for root
-    int first_child, last_child;
     int num_children;
+    int *children;              // child ranks (size=num_children)
+    int tag_up, tag_down;       // distinct per tree when several trees run at once
+    const RedSpec *red;         // element type + op
 
     // per-iteration scratch (allocated once, reused)
     int   count;
-    long *acc;                  // accumulator (size=count)
-    long *tmp_all;              // receive buffers from children (size=num_children*count)
+    int   segment;              // elements per pipeline segment (0 = store-and-forward)
+    int   num_segs;             // ceil(count/segment) in segmented mode, else 1
+    int   cap_count;            // count the scratch was sized for (tree_plan_set_count)
+    int   cap_segment;          // segment as set up for cap_count
+    int   combine;              // TREE_COMBINE_* (default: fold on arrival)
+    void *tmp_all;              // receive buffers from children
+                                //   store-and-forward: num_children*count
+                                //   segmented:         TREE_SEG_SLOTS*num_children*segment
     MPI_Request *red_recvs;     // Irecv handles from children
     MPI_Request *bcast_sends;   // Isend handles to children (broadcast phase)
+    int         *ready_idx;     // MPI_Waitsome completion indices (size=num_children)
+    const void **srcs;          // child buffers handed to one combine_n (size=num_children)
+
+    // segmented mode only
+    MPI_Request *up_sends;      // Isend handles to parent, one per segment
+    MPI_Request *down_recvs;    // Irecv handles from parent, one per segment
+
+    // persistent mode only (tree_plan_persist): red_recvs/bcast_sends hold
+    // persistent requests and the buffers are fixed
+    int          persistent;
+    const void  *p_sendbuf;     // may be MPI_IN_PLACE
+    void        *p_recvbuf;
+    int          p_up_from_recvbuf;
+    MPI_Request *p_edge;        // [0] send to parent, [1] broadcast from parent
+
+    // nonblocking mode only (tree_start/tree_test/tree_wait): in-flight state
+    int          nb_stage;      // TREE_NB_*
+    int          nb_remaining;  // children not folded yet
+    const void  *nb_sendbuf;    // may be MPI_IN_PLACE
+    void        *nb_recvbuf;
+    MPI_Comm     nb_comm;
+    MPI_Request  nb_up, nb_down;
+
+    // fused mode only (FuseQueue): a byte message of typed runs, store-and-forward
+    const FuseRun *runs;
+    int            num_runs;
 } TreePlan;
 
-static void tree_plan_init(TreePlan *pl, int fanout, int count, MPI_Comm comm) {
+/* Allocate per-iteration scratch once the topology (parent, children) is set.
+   segment > 0 selects segmented mode (clamped to count). */
+static void tree_plan_setup(TreePlan *pl, int count, int segment, const RedSpec *red, MPI_Comm comm) {
+    const size_t es = red->k.esize;
+    pl->red      = red;
+    pl->count    = count;
+    pl->segment  = (segment > count) ? count : segment;
+    pl->num_segs = pl->segment ? (count + pl->segment - 1) / pl->segment : 1;
+    pl->cap_count   = count;
+    pl->cap_segment = pl->segment;
+    if (!pl->tag_up)   pl->tag_up   = TAG_REDUCE;
+    if (!pl->tag_down) pl->tag_down = TAG_BCAST;
+
+    if (pl->num_children > 0) {
+        // Segmented mode keeps tmp_all bounded: each child owns TREE_SEG_SLOTS
+        // segment-sized slots that are reused round-robin across segments.
+        size_t block = pl->segment ? (size_t)TREE_SEG_SLOTS * (size_t)pl->segment : (size_t)count;
+        size_t nreq  = pl->segment ? (size_t)TREE_SEG_SLOTS : 1;
+        size_t nbc   = (size_t)pl->num_segs;
+        pl->tmp_all      = malloc((size_t)pl->num_children * block * es);
+        pl->red_recvs    = (MPI_Request*)malloc((size_t)pl->num_children * nreq * sizeof(MPI_Request));
+        pl->bcast_sends  = (MPI_Request*)malloc((size_t)pl->num_children * nbc * sizeof(MPI_Request));
+        pl->ready_idx    = (int*)malloc((size_t)pl->num_children * sizeof(int));
+        pl->srcs         = (const void**)malloc((size_t)pl->num_children * sizeof(*pl->srcs));
+        if (!pl->tmp_all || !pl->red_recvs || !pl->bcast_sends || !pl->ready_idx || !pl->srcs) {
+            perror("malloc children scratch");
+            MPI_Abort(comm, 2);
+        }
+    }
+
+    if (pl->segment && pl->parent >= 0) {
+        pl->up_sends   = (MPI_Request*)malloc((size_t)pl->num_segs * sizeof(MPI_Request));
+        pl->down_recvs = (MPI_Request*)malloc((size_t)pl->num_segs * sizeof(MPI_Request));
+        if (!pl->up_sends || !pl->down_recvs) {
+            perror("malloc segment requests");
+            MPI_Abort(comm, 2);
+        }
+    }
+}
+
+/* Heap topology rotated so that `root` sits at heap index 0:
+   heap index h = (rank - root) mod np.  Scratch is left to the caller. */
+static void tree_plan_heap_topology(TreePlan *pl, int fanout, int root, MPI_Comm comm) {
     memset(pl, 0, sizeof(*pl));
     MPI_Comm_rank(comm, &pl->me);
     MPI_Comm_size(comm, &pl->np);
 
+    const int np = pl->np;
+    const int h  = (pl->me - root + np) % np;
+
     pl->fanout = (fanout < 2 ? 2 : fanout);
-    pl->count  = count;
+    pl->parent = (h == 0) ? -1 : ((h - 1) / pl->fanout + root) % np;
 
-    pl->parent = (pl->me == 0) ? -1 : (pl->me - 1) / pl->fanout;
+    // heap-style children: {k*h+1 ... k*h+k}
+    long first_child = (long)pl->fanout * h + 1;
+    if (first_child < np) {
+        long last_child = first_child + pl->fanout - 1;
+        if (last_child >= np) last_child = np - 1;
+        pl->num_children = (int)(last_child - first_child + 1);
+        pl->children = (int*)malloc((size_t)pl->num_children * sizeof(int));
+        if (!pl->children) { perror("malloc children"); MPI_Abort(comm, 2); }
+        for (int i = 0; i < pl->num_children; ++i) pl->children[i] = (int)((first_child + i + root) % np);
+    }
+}
 
-    // heap-style children: {k*i+1 ... k*i+k}
-    pl->first_child = pl->fanout * pl->me + 1;
-    pl->last_child  = pl->first_child + pl->fanout - 1;
-    if (pl->first_child >= pl->np) {
-        pl->num_children = 0;
-        pl->first_child = pl->last_child = -1;
-    } else {
-        if (pl->last_child >= pl->np) pl->last_child = pl->np - 1;
-        pl->num_children = pl->last_child - pl->first_child + 1;
+/* k-nomial tree (radix k; k = 2 is the binomial tree) rooted at rank 0.  The
+   parent of r clears r's lowest nonzero base-k digit; the children of r are
+   r + d*w for d = 1..k-1 and every weight w = k^i below that digit's weight
+   (every weight for the root), largest subtree first.  Depth is log_k(np)
+   levels with up to (k-1)*log_k(np) children per rank, and every subtree is
+   a contiguous rank range, so with block rank placement most edges stay on
+   the node. */
+static void tree_plan_knomial_topology(TreePlan *pl, int radix, MPI_Comm comm) {
+    memset(pl, 0, sizeof(*pl));
+    MPI_Comm_rank(comm, &pl->me);
+    MPI_Comm_size(comm, &pl->np);
+
+    const long k = (radix < 2 ? 2 : radix), r = pl->me, np = pl->np;
+    pl->fanout = (int)k;
+    long low = 1;                               // weight of r's lowest nonzero digit
+    while (r > 0 && (r / low) % k == 0) low *= k;
+    pl->parent = (r == 0) ? -1 : (int)(r - ((r / low) % k) * low);
+
+    long weights[64];
+    int nw = 0;
+    for (long w = 1; (r == 0 || w < low) && r + w < np; w *= k) weights[nw++] = w;
+    int n = 0;
+    for (int i = 0; i < nw; ++i)
+        for (long d = 1; d < k && r + d * weights[i] < np; ++d) n++;
+    pl->num_children = n;
+    if (n > 0) {
+        pl->children = (int*)malloc((size_t)n * sizeof(int));
+        if (!pl->children) { perror("malloc children"); MPI_Abort(comm, 2); }
+        n = 0;
+        for (int i = nw - 1; i >= 0; --i)
+            for (long d = k - 1; d >= 1; --d)
+                if (r + d * weights[i] < np) pl->children[n++] = (int)(r + d * weights[i]);
     }
+}
 
-    pl->acc = (long*)malloc((size_t)count * sizeof(long));
-    if (!pl->acc) { perror("malloc acc"); MPI_Abort(comm, 2); }
+static int env_ranks_per_node(void);
 
-    if (pl->num_children > 0) {
-        size_t block = (size_t)count;
-        pl->tmp_all      = (long*)malloc((size_t)pl->num_children * block * sizeof(long));
-        pl->red_recvs    = (MPI_Request*)malloc((size_t)pl->num_children * sizeof(MPI_Request));
-        pl->bcast_sends  = (MPI_Request*)malloc((size_t)pl->num_children * sizeof(MPI_Request));
-        if (!pl->tmp_all || !pl->red_recvs || !pl->bcast_sends) {
-            perror("malloc children scratch");
-            MPI_Abort(comm, 2);
-        }
+/* node[i] = lowest rank on rank i's node, for all i (node_of[np] caller-owned).
+   MPI_BENCH_RANKS_PER_NODE fakes nodes as for hier.  Returns the node count. */
+static int tree_node_map(int *node_of, MPI_Comm comm) {
+    int me, np;
+    MPI_Comm_rank(comm, &me);
+    MPI_Comm_size(comm, &np);
+    MPI_Comm node_comm;
+    const int fake_ppn = env_ranks_per_node();
+    if (fake_ppn > 0) MPI_Comm_split(comm, me / fake_ppn, me, &node_comm);
+    else              MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, me, MPI_INFO_NULL, &node_comm);
+    int first = me;
+    MPI_Allreduce(MPI_IN_PLACE, &first, 1, MPI_INT, MPI_MIN, node_comm);
+    MPI_Comm_free(&node_comm);
+    MPI_Allgather(&first, 1, MPI_INT, node_of, 1, MPI_INT, comm);
+    int nodes = 0;
+    for (int i = 0; i < np; ++i) nodes += (node_of[i] == i);
+    return nodes;
+}
+
+/* Node-contiguous k-ary tree: a heap over each node's ranks, rooted at the
+   node's lowest rank, plus a heap over those node leaders (ordered by rank),
+   rooted at rank 0.  Exactly nodes-1 edges leave a node, whatever the rank
+   placement. */
+static void tree_plan_nodemap_topology(TreePlan *pl, int fanout, MPI_Comm comm) {
+    memset(pl, 0, sizeof(*pl));
+    MPI_Comm_rank(comm, &pl->me);
+    MPI_Comm_size(comm, &pl->np);
+    const int np = pl->np, me = pl->me, k = (fanout < 2 ? 2 : fanout);
+    pl->fanout = k;
+
+    int *node_of = (int*)malloc((size_t)np * sizeof(int));
+    int *local   = (int*)malloc((size_t)np * sizeof(int));   // my node's ranks, ascending
+    int *leaders = (int*)malloc((size_t)np * sizeof(int));   // first rank of each node, ascending
+    if (!node_of || !local || !leaders) { perror("malloc nodemap"); MPI_Abort(comm, 2); }
+    tree_node_map(node_of, comm);
+    int nl = 0, nn = 0, li = 0, ni = 0;
+    for (int i = 0; i < np; ++i) {
+        if (node_of[i] == node_of[me]) { if (i == me) li = nl; local[nl++] = i; }
+        if (node_of[i] == i)           { if (i == node_of[me]) ni = nn; leaders[nn++] = i; }
+    }
+
+    if (li > 0)      pl->parent = local[(li - 1) / k];
+    else if (ni > 0) pl->parent = leaders[(ni - 1) / k];
+    else             pl->parent = -1;
+
+    pl->children = (int*)malloc(2 * (size_t)k * sizeof(int));
+    if (!pl->children) { perror("malloc children"); MPI_Abort(comm, 2); }
+    int n = 0;
+    for (long c = (long)k * ni + 1; li == 0 && c <= (long)k * ni + k && c < nn; ++c)
+        pl->children[n++] = leaders[c];         // remote subtrees first: longer paths
+    for (long c = (long)k * li + 1; c <= (long)k * li + k && c < nl; ++c)
+        pl->children[n++] = local[c];
+    pl->num_children = n;
+    free(leaders); free(local); free(node_of);
+}
+
+static void tree_plan_shape_topology(TreePlan *pl, int shape, int fanout, MPI_Comm comm) {
+    switch (shape) {
+    case TREE_SHAPE_BINOMIAL: tree_plan_knomial_topology(pl, 2, comm); break;
+    case TREE_SHAPE_KNOMIAL:  tree_plan_knomial_topology(pl, fanout, comm); break;
+    case TREE_SHAPE_NODEMAP:  tree_plan_nodemap_topology(pl, fanout, comm); break;
+    default:                  tree_plan_heap_topology(pl, fanout, /*root=*/0, comm); break;
+    }
+    pl->shape = shape;
+}
+
+static void tree_plan_init_shape(TreePlan *pl, int shape, int fanout, int count, int segment,
+                                 const RedSpec *red, MPI_Comm comm)
+{
+    tree_plan_shape_topology(pl, shape, fanout, comm);
+
+    // A segment covering the whole vector is just store-and-forward.
+    tree_plan_setup(pl, count, (segment > 0 && segment < count) ? segment : 0, red, comm);
+}
+
+static void tree_plan_init(TreePlan *pl, int fanout, int count, int segment, const RedSpec *red,
+                           MPI_Comm comm)
+{
+    tree_plan_init_shape(pl, TREE_SHAPE_HEAP, fanout, count, segment, red, comm);
+}
+
+/* Re-aim a (non-persistent) plan at count <= cap_count without reallocating:
+   every per-child and per-segment buffer sized for cap_count covers it. */
+static void tree_plan_set_count(TreePlan *pl, int count, MPI_Comm comm) {
+    if (count <= 0 || count > pl->cap_count || pl->persistent) {
+        fprintf(stderr, "tree_plan_set_count: %d outside 1..%d\n", count, pl->cap_count);
+        MPI_Abort(comm, 2);
+    }
+    pl->count    = count;
+    pl->segment  = (pl->cap_segment < count) ? pl->cap_segment : 0;
+    pl->num_segs = pl->segment ? (count + pl->segment - 1) / pl->segment : 1;
+}
+
+/* Number of tree edges (child -> parent) whose ends are on different nodes. */
+static int tree_internode_edges(const TreePlan *pl, const int *node_of, MPI_Comm comm) {
+    int mine = (pl->parent >= 0 && node_of[pl->parent] != node_of[pl->me]), all = 0;
+    MPI_Allreduce(&mine, &all, 1, MPI_INT, MPI_SUM, comm);
+    return all;
+}
+
+/* ", binomial" etc. for labels; the heap tree keeps its plain label. */
+static const char *tree_shape_suffix(const TreePlan *pl) {
+    switch (pl->shape) {
+    case TREE_SHAPE_BINOMIAL: return ", binomial";
+    case TREE_SHAPE_KNOMIAL:  return ", k-nomial";
+    case TREE_SHAPE_NODEMAP:  return ", nodemap";
+    default:                  return "";
     }
 }
 
+static void tree_plan_unpersist(TreePlan *pl);
+
 static void tree_plan_free(TreePlan *pl) {
+    tree_plan_unpersist(pl);
+    free(pl->down_recvs);
+    free(pl->up_sends);
+    free(pl->srcs);
+    free(pl->ready_idx);
     free(pl->bcast_sends);
     free(pl->red_recvs);
     free(pl->tmp_all);
-    free(pl->acc);
+    free(pl->children);
     memset(pl, 0, sizeof(*pl));
 }
 
-/* k-ary TreeReduce (sum of longs) followed by a down-broadcast of the result.
-   Nonblocking Irecv from children so all arrivals can overlap.
+/* Fold the n child buffers in pl->srcs into acc (len elements).  A fused plan
+   folds each typed run with its own kernel, moving srcs along the runs. */
+static inline void tree_combine(const TreePlan *pl, void *acc, int n, size_t len) {
+    if (!pl->runs) { pl->red->k.combine_n(acc, pl->srcs, n, len); return; }
+    size_t at = 0;
+    for (int r = 0; r < pl->num_runs; ++r) {
+        const FuseRun *run = &pl->runs[r];
+        for (int i = 0; i < n; ++i) pl->srcs[i] = (const char*)pl->srcs[i] + (run->off - at);
+        at = run->off;
+        run->k->combine_n((char*)acc + run->off, pl->srcs, n, run->len);
+    }
+}
+
+/* Complete the child receives in reqs[0..num_children) and fold child i's data
+   (tmp + i*stride elements, len elements) into acc.  Every batch of children is
+   folded by one multi-source combine_n, i.e. a single pass over acc.  In
+   TREE_COMBINE_ON_ARRIVAL mode the batches come from MPI_Waitsome, so the
+   children that land first are folded while the stragglers are still in
+   flight; WAITALL folds all children in one pass.  Combine order differs
+   between the modes, which is exact for integer ops and for the bench's
+   floating-point inputs (small integers).
+*/
+static void combine_children(const TreePlan *pl, MPI_Request *reqs,
+                             const void *tmp, size_t stride, void *acc, int len)
+{
+    const int nch = pl->num_children;
+    const size_t es = pl->red->k.esize;
+
+    if (pl->combine == TREE_COMBINE_WAITALL) {
+        MPI_Waitall(nch, reqs, MPI_STATUSES_IGNORE);
+        for (int i = 0; i < nch; ++i) pl->srcs[i] = cbuf_at(tmp, (size_t)i * stride, es);
+        tree_combine(pl, acc, nch, (size_t)len);
+        return;
+    }
+
+    for (int remaining = nch; remaining > 0; ) {
+        int outcount = 0;
+        MPI_Waitsome(nch, reqs, &outcount, pl->ready_idx, MPI_STATUSES_IGNORE);
+        for (int r = 0; r < outcount; ++r)
+            pl->srcs[r] = cbuf_at(tmp, (size_t)pl->ready_idx[r] * stride, es);
+        if (outcount > 0) tree_combine(pl, acc, outcount, (size_t)len);
+        remaining -= outcount;
+    }
+}
+
+/* k-ary TreeReduce (pl->red's type/op) followed by a down-broadcast of the result.
+   Zero-copy: the reduction runs straight in recvbuf and the broadcast lands
+   there too, so there is no staging accumulator.  sendbuf may be MPI_IN_PLACE
+   (input already in recvbuf), in which case no rank copies anything; otherwise
+   interior ranks copy their input into recvbuf once (while the children's data
+   is in flight) and leaves send straight from sendbuf.  Child contributions
+   still land in tmp_all: MPI has no receive-and-reduce.
+   Nonblocking Irecv from children so all arrivals can overlap; each child is
+   folded as soon as it lands (see combine_children).
    A single blocking send to the parent. 
    A nonblocking Isend for the broadcast fan-out. 
 */
-static void kary_tree_reduce_bcast_sum_long_nb(
-    const long *sendbuf, long *recvbuf, const TreePlan *pl, MPI_Comm comm)
+static void kary_tree_reduce_bcast_nb(
+    const void *sendbuf, void *recvbuf, const TreePlan *pl, MPI_Comm comm)
 {
     const int count = pl->count;
+    const size_t es = pl->red->k.esize;
+    const MPI_Datatype dt = pl->red->type;
+    const int inplace = (sendbuf == MPI_IN_PLACE);
+    const void *up = inplace ? recvbuf : sendbuf;   // what goes to the parent
 
-    memcpy(pl->acc, sendbuf, (size_t)count * sizeof(long));
-
-    // Upward reduce: gather from children, then accumulate into acc
+    // Upward reduce: gather from children, accumulating into recvbuf as they land
     if (pl->num_children > 0) {
         for (int i = 0; i < pl->num_children; ++i) {
-            int child = pl->first_child + i;
-            long *dst = pl->tmp_all + (size_t)i * (size_t)count;
-            MPI_Irecv(dst, count, MPI_LONG, child, TAG_REDUCE, comm, &pl->red_recvs[i]);
-        }
-        MPI_Waitall(pl->num_children, pl->red_recvs, MPI_STATUSES_IGNORE);
-
-        for (int i = 0; i < pl->num_children; ++i) {
-            long *src = pl->tmp_all + (size_t)i * (size_t)count;
-            for (int j = 0; j < count; ++j) pl->acc[j] += src[j];
+            int child = pl->children[i];
+            void *dst = buf_at(pl->tmp_all, (size_t)i * (size_t)count, es);
+            MPI_Irecv(dst, count, dt, child, pl->tag_up, comm, &pl->red_recvs[i]);
         }
+        if (!inplace) memcpy(recvbuf, sendbuf, (size_t)count * es);
+        combine_children(pl, pl->red_recvs, pl->tmp_all, (size_t)count, recvbuf, count);
+        up = recvbuf;
     }
 
     // Non-root forwards upward once (blocking is fine—one parent)
-    if (pl->me != 0) {
-        MPI_Send(pl->acc, count, MPI_LONG, pl->parent, TAG_REDUCE, comm);
-        // Then wait for the broadcast from parent
-        MPI_Recv(pl->acc, count, MPI_LONG, pl->parent, TAG_BCAST, comm, MPI_STATUS_IGNORE);
+    if (pl->parent >= 0) {
+        MPI_Send(up, count, dt, pl->parent, pl->tag_up, comm);
+        // Then wait for the broadcast from parent, straight into place
+        MPI_Recv(recvbuf, count, dt, pl->parent, pl->tag_down, comm, MPI_STATUS_IGNORE);
+    } else if (pl->num_children == 0 && !inplace) {
+        memcpy(recvbuf, sendbuf, (size_t)count * es);   // single rank
     }
-    // Root already has the final sum in pl->acc at this point.
+    // Root already has the final result in recvbuf at this point.
 
     // Downward broadcast: push to each child
     if (pl->num_children > 0) {
         for (int i = 0; i < pl->num_children; ++i) {
-            int child = pl->first_child + i;
-            MPI_Isend(pl->acc, count, MPI_LONG, child, TAG_BCAST, comm, &pl->bcast_sends[i]);
+            int child = pl->children[i];
+            MPI_Isend(recvbuf, count, dt, child, pl->tag_down, comm, &pl->bcast_sends[i]);
         }
         MPI_Waitall(pl->num_children, pl->bcast_sends, MPI_STATUSES_IGNORE);
     }
+}
 
-    memcpy(recvbuf, pl->acc, (size_t)count * sizeof(long));
+/* Segment s covers elements [s*segment, s*segment + seg_len(s)). */
+static inline int seg_len(const TreePlan *pl, int s) {
+    int off = s * pl->segment;
+    return (off + pl->segment <= pl->count) ? pl->segment : pl->count - off;
 }
 
-int main(int argc, char **argv) {
-    MPI_Init(&argc, &argv);
+static inline void post_child_seg_recvs(const TreePlan *pl, int s, MPI_Comm comm) {
+    const int slot = s % TREE_SEG_SLOTS;
+    const int len  = seg_len(pl, s);
+    for (int i = 0; i < pl->num_children; ++i) {
+        void *dst = buf_at(pl->tmp_all, ((size_t)i * TREE_SEG_SLOTS + (size_t)slot) * (size_t)pl->segment,
+                           pl->red->k.esize);
+        MPI_Irecv(dst, len, pl->red->type, pl->children[i], pl->tag_up, comm,
+                  &pl->red_recvs[(size_t)slot * pl->num_children + i]);
+    }
+}
 
-    int me, np;
-    MPI_Comm_rank(MPI_COMM_WORLD, &me);
-    MPI_Comm_size(MPI_COMM_WORLD, &np);
+static inline void bcast_seg_to_children(const TreePlan *pl, const void *src, int s, MPI_Comm comm) {
+    const int len = seg_len(pl, s);
+    const void *p = cbuf_at(src, (size_t)s * (size_t)pl->segment, pl->red->k.esize);
+    for (int i = 0; i < pl->num_children; ++i) {
+        MPI_Isend(p, len, pl->red->type, pl->children[i], pl->tag_down, comm,
+                  &pl->bcast_sends[(size_t)s * pl->num_children + i]);
+    }
+}
 
-    long iters  = 20000;
-    long warmup = 100;
-    int  checks = 0;
-    int  count  = 1;
-    int  fanout = 2;
+/* Progress of one call through a segmented tree. */
+typedef struct {
+    int next_down;              // next broadcast segment to forward to the children
+    int next_post;              // next broadcast receive to post
+    int up_from_recvbuf;        // upward segments are sent out of recvbuf
+} TreeSegCursor;
 
-    for (int i = 1; i < argc; ++i) {
-        if (!strcmp(argv[i], "--iters") && i + 1 < argc) {
-            iters = strtol(argv[++i], NULL, 10);
-        } else if (!strcmp(argv[i], "--warmup") && i + 1 < argc) {
-            warmup = strtol(argv[++i], NULL, 10);
-        } else if (!strcmp(argv[i], "--count") && i + 1 < argc) {
-            count = (int)strtol(argv[++i], NULL, 10);
-        } else if (!strcmp(argv[i], "--fanout") && i + 1 < argc) {
-            fanout = (int)strtol(argv[++i], NULL, 10);
-        } else if (!strcmp(argv[i], "--checks")) {
-            checks = 1;
-        } else if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h")) {
-            usage_and_exit(argv[0]);
+static inline void post_down_seg_recv(const TreePlan *pl, void *recvbuf, int s, MPI_Comm comm) {
+    MPI_Irecv(buf_at(recvbuf, (size_t)s * (size_t)pl->segment, pl->red->k.esize), seg_len(pl, s),
+              pl->red->type, pl->parent, pl->tag_down, comm, &pl->down_recvs[s]);
+}
+
+/* When segments go up out of recvbuf, broadcast segment s may only be received
+   over them once its upward Isend has completed.  Post the receives of every
+   released segment below `upto`, testing (or, with block, waiting) in order. */
+static void post_released_down_recvs(const TreePlan *pl, void *recvbuf, TreeSegCursor *cur,
+                                     int upto, int block, MPI_Comm comm)
+{
+    while (cur->next_post < upto) {
+        int done = 1;
+        if (block) MPI_Wait(&pl->up_sends[cur->next_post], MPI_STATUS_IGNORE);
+        else       MPI_Test(&pl->up_sends[cur->next_post], &done, MPI_STATUS_IGNORE);
+        if (!done) break;
+        post_down_seg_recv(pl, recvbuf, cur->next_post, comm);
+        ++cur->next_post;
+    }
+}
+
+/* Forward every broadcast segment that has already arrived from the parent.
+   Segments from one parent arrive in order, so testing in order is enough. */
+static inline void forward_arrived_bcast_segs(const TreePlan *pl, const void *recvbuf, TreeSegCursor *cur,
+                                              MPI_Comm comm)
+{
+    while (cur->next_down < cur->next_post) {
+        int done = 0;
+        MPI_Test(&pl->down_recvs[cur->next_down], &done, MPI_STATUS_IGNORE);
+        if (!done) break;
+        bcast_seg_to_children(pl, recvbuf, cur->next_down, comm);
+        ++cur->next_down;
+    }
+}
+
+/* The segmented tree in three phases so several trees can be interleaved
+   segment by segment (see the double binary tree):
+     tree_seg_begin   - pre-post the broadcast receives and the first child slots
+     tree_seg_up_step - combine segment s and push it up (or down, at the root)
+     tree_seg_finish  - drain the broadcast, complete all sends
+   Zero-copy as in the store-and-forward tree: segments are reduced in recvbuf,
+   leaves send straight from sendbuf, and sendbuf may be MPI_IN_PLACE. */
+static void tree_seg_begin(const TreePlan *pl, const void *sendbuf, void *recvbuf, TreeSegCursor *cur,
+                           MPI_Comm comm)
+{
+    cur->next_down = 0;
+    cur->next_post = 0;
+    cur->up_from_recvbuf = (sendbuf == MPI_IN_PLACE || pl->num_children > 0);
+
+    // Broadcast segments may arrive while we are still reducing upward.
+    if (pl->parent >= 0 && !cur->up_from_recvbuf) {
+        for (int s = 0; s < pl->num_segs; ++s) post_down_seg_recv(pl, recvbuf, s, comm);
+        cur->next_post = pl->num_segs;
+    }
+
+    if (pl->num_children > 0) {
+        for (int s = 0; s < pl->num_segs && s < TREE_SEG_SLOTS; ++s) post_child_seg_recvs(pl, s, comm);
+    }
+}
+
+static void tree_seg_up_step(const TreePlan *pl, const void *sendbuf, void *recvbuf,
+                             int s, TreeSegCursor *cur, MPI_Comm comm)
+{
+    const int nch = pl->num_children;
+    const int inplace = (sendbuf == MPI_IN_PLACE);
+    const size_t es  = pl->red->k.esize;
+    const size_t off = (size_t)s * (size_t)pl->segment;
+    const int    len = seg_len(pl, s);
+    void *acc = buf_at(recvbuf, off, es);
+    const void *up = acc;
+
+    if (nch > 0) {
+        const int slot = s % TREE_SEG_SLOTS;
+        if (!inplace) memcpy(acc, cbuf_at(sendbuf, off, es), (size_t)len * es);
+        combine_children(pl, &pl->red_recvs[(size_t)slot * nch],
+                         cbuf_at(pl->tmp_all, (size_t)slot * (size_t)pl->segment, es),
+                         (size_t)TREE_SEG_SLOTS * (size_t)pl->segment, acc, len);
+        // Slot is free again: let segment s+TREE_SEG_SLOTS flow in
+        if (s + TREE_SEG_SLOTS < pl->num_segs) post_child_seg_recvs(pl, s + TREE_SEG_SLOTS, comm);
+    } else if (!inplace) {
+        up = cbuf_at(sendbuf, off, es);   // leaf: straight from the user buffer
+    }
+
+    if (pl->parent >= 0) {
+        MPI_Isend(up, len, pl->red->type, pl->parent, pl->tag_up, comm, &pl->up_sends[s]);
+        if (cur->up_from_recvbuf) post_released_down_recvs(pl, recvbuf, cur, s + 1, 0, comm);
+        if (nch > 0) forward_arrived_bcast_segs(pl, recvbuf, cur, comm);
+    } else if (nch > 0) {
+        // Root: segment s is final, start pushing it down immediately
+        bcast_seg_to_children(pl, recvbuf, s, comm);
+    } else if (!inplace) {
+        memcpy(acc, up, (size_t)len * es);   // single rank
+    }
+}
+
+static void tree_seg_finish(const TreePlan *pl, void *recvbuf, TreeSegCursor *cur, MPI_Comm comm) {
+    const int nseg = pl->num_segs;
+    const int nch  = pl->num_children;
+
+    // Drain the remaining broadcast segments from the parent
+    if (pl->parent >= 0) {
+        post_released_down_recvs(pl, recvbuf, cur, nseg, 1, comm);
+        for (; cur->next_down < nseg; ++cur->next_down) {
+            MPI_Wait(&pl->down_recvs[cur->next_down], MPI_STATUS_IGNORE);
+            if (nch > 0) bcast_seg_to_children(pl, recvbuf, cur->next_down, comm);
         }
+        MPI_Waitall(nseg, pl->up_sends, MPI_STATUSES_IGNORE);
     }
-    if (iters <= 0 || warmup < 0 || count <= 0 || fanout <= 0) usage_and_exit(argv[0]);
+    if (nch > 0) MPI_Waitall(nseg * nch, pl->bcast_sends, MPI_STATUSES_IGNORE);
+}
 
-    if (me == 0) {
-        printf("MPI ranks=%d, iters=%ld, warmup=%ld, count=%d, fanout=%d, checks=%s\n",
-               np, iters, warmup, count, fanout, checks ? "on" : "off");
-        fflush(stdout);
+/* Pipelined (segmented) variant of the k-ary TreeReduce + Bcast.
+   The vector is cut into pl->segment-element pieces.  Segment s is combined and
+   sent to the parent while segment s+1 is still arriving from the children
+   (TREE_SEG_SLOTS receive slots per child), and the root starts the
+   down-broadcast as soon as segment 0 is final.  Interior nodes forward
+   broadcast segments as they land, interleaved with their own upward work.
+   Every rank receives the broadcast straight into recvbuf.
+*/
+static void kary_tree_reduce_bcast_seg(
+    const void *sendbuf, void *recvbuf, const TreePlan *pl, MPI_Comm comm)
+{
+    TreeSegCursor cur;
+
+    tree_seg_begin(pl, sendbuf, recvbuf, &cur, comm);
+    for (int s = 0; s < pl->num_segs; ++s)
+        tree_seg_up_step(pl, sendbuf, recvbuf, s, &cur, comm);
+    tree_seg_finish(pl, recvbuf, &cur, comm);
+}
+
+/* sendbuf may be MPI_IN_PLACE: the input is taken from recvbuf. */
+static inline void tree_reduce_bcast(
+    const void *sendbuf, void *recvbuf, const TreePlan *pl, MPI_Comm comm)
+{
+    if (pl->segment) kary_tree_reduce_bcast_seg(sendbuf, recvbuf, pl, comm);
+    else             kary_tree_reduce_bcast_nb(sendbuf, recvbuf, pl, comm);
+}
+
+/* ---------- Persistent store-and-forward tree ----------
+   tree_plan_persist() binds the plan to fixed buffers (sendbuf may be
+   MPI_IN_PLACE) and creates every edge's request once with MPI_Recv_init /
+   MPI_Send_init: children -> tmp_all, up to the parent, down from the parent,
+   down to the children.  Each call is then MPI_Startall/MPI_Waitall, with no
+   per-iteration request setup or argument checking.  Same zero-copy data flow
+   as kary_tree_reduce_bcast_nb.
+*/
+static void tree_plan_persist(TreePlan *pl, const void *sendbuf, void *recvbuf, MPI_Comm comm) {
+    const int count = pl->count;
+    const MPI_Datatype dt = pl->red->type;
+    const int inplace = (sendbuf == MPI_IN_PLACE);
+
+    if (pl->segment) {
+        if (pl->me == 0) fprintf(stderr, "persistent tree requires store-and-forward (segment=0)\n");
+        MPI_Abort(comm, 2);
     }
+    pl->persistent = 1;
+    pl->p_sendbuf  = sendbuf;
+    pl->p_recvbuf  = recvbuf;
 
-    long *my  = (long*)malloc((size_t)count * sizeof(long));
-    long *out = (long*)malloc((size_t)count * sizeof(long));
-    long *ref = (long*)malloc((size_t)count * sizeof(long));
-    if (!my || !out || !ref) { if (me==0) perror("malloc"); MPI_Abort(MPI_COMM_WORLD, 3); }
+    for (int i = 0; i < pl->num_children; ++i) {
+        MPI_Recv_init(buf_at(pl->tmp_all, (size_t)i * (size_t)count, pl->red->k.esize), count, dt,
+                      pl->children[i], pl->tag_up, comm, &pl->red_recvs[i]);
+        MPI_Send_init(recvbuf, count, dt, pl->children[i], pl->tag_down, comm, &pl->bcast_sends[i]);
+    }
 
-    TreePlan plan;
-    tree_plan_init(&plan, fanout, count, MPI_COMM_WORLD);
+    if (pl->parent >= 0) {
+        // Interior and in-place ranks send up out of recvbuf, so the broadcast
+        // may only be received there after the upward send has completed.
+        pl->p_up_from_recvbuf = (inplace || pl->num_children > 0);
+        const void *up = pl->p_up_from_recvbuf ? recvbuf : sendbuf;
+        pl->p_edge = (MPI_Request*)malloc(2 * sizeof(MPI_Request));
+        if (!pl->p_edge) { perror("malloc persistent edges"); MPI_Abort(comm, 2); }
+        MPI_Send_init(up, count, dt, pl->parent, pl->tag_up, comm, &pl->p_edge[0]);
+        MPI_Recv_init(recvbuf, count, dt, pl->parent, pl->tag_down, comm, &pl->p_edge[1]);
+    }
+}
+
+static void tree_plan_unpersist(TreePlan *pl) {
+    if (!pl->persistent) return;
+    for (int i = 0; i < pl->num_children; ++i) {
+        MPI_Request_free(&pl->red_recvs[i]);
+        MPI_Request_free(&pl->bcast_sends[i]);
+    }
+    if (pl->p_edge) {
+        MPI_Request_free(&pl->p_edge[0]);
+        MPI_Request_free(&pl->p_edge[1]);
+        free(pl->p_edge);
+        pl->p_edge = NULL;
+    }
+    pl->persistent = 0;
+}
+
+static void kary_tree_reduce_bcast_persistent(const TreePlan *pl) {
+    const int count = pl->count;
+    const int nch = pl->num_children;
+    const int inplace = (pl->p_sendbuf == MPI_IN_PLACE);
+    void *recvbuf = pl->p_recvbuf;
+
+    if (nch > 0) {
+        MPI_Startall(nch, pl->red_recvs);
+        if (!inplace) memcpy(recvbuf, pl->p_sendbuf, (size_t)count * pl->red->k.esize);
+        combine_children(pl, pl->red_recvs, pl->tmp_all, (size_t)count, recvbuf, count);
+    }
+
+    if (pl->parent >= 0) {
+        if (pl->p_up_from_recvbuf) {
+            MPI_Start(&pl->p_edge[0]);
+            MPI_Wait(&pl->p_edge[0], MPI_STATUS_IGNORE);
+            MPI_Start(&pl->p_edge[1]);
+            MPI_Wait(&pl->p_edge[1], MPI_STATUS_IGNORE);
+        } else {
+            // Out-of-place leaf: the send and the broadcast receive are independent
+            MPI_Startall(2, pl->p_edge);
+            MPI_Waitall(2, pl->p_edge, MPI_STATUSES_IGNORE);
+        }
+    } else if (nch == 0 && !inplace) {
+        memcpy(recvbuf, pl->p_sendbuf, (size_t)count * pl->red->k.esize);   // single rank
+    }
+
+    if (nch > 0) {
+        MPI_Startall(nch, pl->bcast_sends);
+        MPI_Waitall(nch, pl->bcast_sends, MPI_STATUSES_IGNORE);
+    }
+}
 
-    // Warmup --> optional correctness check vs MPI_Allreduce
-    for (long k = 0; k < warmup; ++k) {
-        for (int j = 0; j < count; ++j) my[j] = value_for_iter(k, me) + j;
+/* ---------- Nonblocking store-and-forward tree ----------
+   tree_start() posts the child receives and returns; tree_test() advances the
+   operation as far as it can without blocking and returns 1 once recvbuf
+   holds the result; tree_wait() spins on tree_test().  Nothing moves between
+   calls unless the MPI library progresses on its own, so callers that overlap
+   compute should call tree_test() now and then.  Children are always folded
+   on arrival (MPI_Testsome); the data flow is the zero-copy one of
+   kary_tree_reduce_bcast_nb, and sendbuf may be MPI_IN_PLACE.
+*/
+enum { TREE_NB_CHILDREN, TREE_NB_UP_SENT, TREE_NB_DOWN, TREE_NB_BCAST, TREE_NB_DONE };
+
+static void tree_start(TreePlan *pl, const void *sendbuf, void *recvbuf, MPI_Comm comm) {
+    const int count = pl->count;
+    const size_t es = pl->red->k.esize;
+    const MPI_Datatype dt = pl->red->type;
+    const int inplace = (sendbuf == MPI_IN_PLACE);
+
+    if (pl->segment) {
+        if (pl->me == 0) fprintf(stderr, "nonblocking tree requires store-and-forward (segment=0)\n");
+        MPI_Abort(comm, 2);
+    }
+    pl->nb_sendbuf   = sendbuf;
+    pl->nb_recvbuf   = recvbuf;
+    pl->nb_comm      = comm;
+    pl->nb_remaining = pl->num_children;
+    pl->nb_stage     = TREE_NB_CHILDREN;
+    pl->nb_up = pl->nb_down = MPI_REQUEST_NULL;
+
+    for (int i = 0; i < pl->num_children; ++i)
+        MPI_Irecv(buf_at(pl->tmp_all, (size_t)i * (size_t)count, es), count, dt, pl->children[i],
+                  pl->tag_up, comm, &pl->red_recvs[i]);
+    if (pl->num_children > 0 && !inplace) memcpy(recvbuf, sendbuf, (size_t)count * es);
+    else if (pl->parent < 0 && !inplace)  memcpy(recvbuf, sendbuf, (size_t)count * es);   // single rank
+
+    // An out-of-place leaf sends from sendbuf, so its broadcast receive can go up front
+    if (pl->parent >= 0 && pl->num_children == 0 && !inplace)
+        MPI_Irecv(recvbuf, count, dt, pl->parent, pl->tag_down, comm, &pl->nb_down);
+}
 
-        kary_tree_reduce_bcast_sum_long_nb(my, out, &plan, MPI_COMM_WORLD);
+static void tree_nb_start_bcast(TreePlan *pl) {
+    for (int i = 0; i < pl->num_children; ++i)
+        MPI_Isend(pl->nb_recvbuf, pl->count, pl->red->type, pl->children[i], pl->tag_down, pl->nb_comm,
+                  &pl->bcast_sends[i]);
+    pl->nb_stage = TREE_NB_BCAST;
+}
+
+static int tree_test(TreePlan *pl) {
+    const int count = pl->count;
+    const int nch = pl->num_children;
+    const MPI_Datatype dt = pl->red->type;
+    int done = 0;
 
-        if (checks) {
-            MPI_Allreduce(my, ref, count, MPI_LONG, MPI_SUM, MPI_COMM_WORLD);
-            for (int j = 0; j < count; ++j) {
-                if (out[j] != ref[j]) {
-                    fprintf(stderr,
-                        "Warmup mismatch rank %d at elem %d: tree=%ld allreduce=%ld\n",
-                        me, j, out[j], ref[j]);
-                    MPI_Abort(MPI_COMM_WORLD, 4);
+    for (;;) {
+        switch (pl->nb_stage) {
+        case TREE_NB_CHILDREN:
+            if (pl->nb_remaining > 0) {
+                int outcount = 0;
+                MPI_Testsome(nch, pl->red_recvs, &outcount, pl->ready_idx, MPI_STATUSES_IGNORE);
+                if (outcount > 0) {
+                    for (int r = 0; r < outcount; ++r)
+                        pl->srcs[r] = cbuf_at(pl->tmp_all, (size_t)pl->ready_idx[r] * (size_t)count,
+                                              pl->red->k.esize);
+                    tree_combine(pl, pl->nb_recvbuf, outcount, (size_t)count);
+                    pl->nb_remaining -= outcount;
                 }
+                if (pl->nb_remaining > 0) return 0;
+            }
+            if (pl->parent < 0) { tree_nb_start_bcast(pl); break; }
+            {
+                const int leaf_src = (nch == 0 && pl->nb_sendbuf != MPI_IN_PLACE);
+                MPI_Isend(leaf_src ? pl->nb_sendbuf : pl->nb_recvbuf, count, dt, pl->parent, pl->tag_up,
+                          pl->nb_comm, &pl->nb_up);
+                pl->nb_stage = leaf_src ? TREE_NB_DOWN : TREE_NB_UP_SENT;
             }
+            break;
+        case TREE_NB_UP_SENT:
+            // The broadcast lands over what went up: only after the send completed
+            MPI_Test(&pl->nb_up, &done, MPI_STATUS_IGNORE);
+            if (!done) return 0;
+            MPI_Irecv(pl->nb_recvbuf, count, dt, pl->parent, pl->tag_down, pl->nb_comm, &pl->nb_down);
+            pl->nb_stage = TREE_NB_DOWN;
+            break;
+        case TREE_NB_DOWN:
+            MPI_Test(&pl->nb_down, &done, MPI_STATUS_IGNORE);
+            if (!done) return 0;
+            tree_nb_start_bcast(pl);
+            break;
+        case TREE_NB_BCAST:
+            if (nch > 0) {
+                MPI_Testall(nch, pl->bcast_sends, &done, MPI_STATUSES_IGNORE);
+                if (!done) return 0;
+            }
+            MPI_Test(&pl->nb_up, &done, MPI_STATUS_IGNORE);   // leaf: upward send
+            if (!done) return 0;
+            pl->nb_stage = TREE_NB_DONE;
+            return 1;
+        default:
+            return 1;
         }
     }
-    MPI_Barrier(MPI_COMM_WORLD);
+}
 
-    // Bench: manual TreeReduce (+Bcast)
-    volatile long sink_tree = 0;
-    MPI_Barrier(MPI_COMM_WORLD);
-    double t0 = MPI_Wtime();
-    for (long k = 0; k < iters; ++k) {
-        for (int j = 0; j < count; ++j) my[j] = value_for_iter(k, me) + j;
-        kary_tree_reduce_bcast_sum_long_nb(my, out, &plan, MPI_COMM_WORLD);
-        long sum_scalar = 0; for (int j = 0; j < count; ++j) sum_scalar += out[j];
-        sink_tree += sum_scalar; // prevent over-optimization
-    }
-    double t1 = MPI_Wtime();
-
-    // Bench: MPI_Allreduce
-    volatile long sink_allr = 0;
-    MPI_Barrier(MPI_COMM_WORLD);
-    double t2 = MPI_Wtime();
-    for (long k = 0; k < iters; ++k) {
-        for (int j = 0; j < count; ++j) my[j] = value_for_iter(k, me) + j;
-        MPI_Allreduce(my, out, count, MPI_LONG, MPI_SUM, MPI_COMM_WORLD);
-        long sum_scalar = 0; for (int j = 0; j < count; ++j) sum_scalar += out[j];
-        sink_allr += sum_scalar;
-    }
-    double t3 = MPI_Wtime();
+static void tree_wait(TreePlan *pl) {
+    while (!tree_test(pl)) { }
+}
 
-    // Final correctness spot-check (cheap scalar compare)
-    if (checks) {
-        for (int j = 0; j < count; ++j) my[j] = value_for_iter(iters, me) + j;
-        kary_tree_reduce_bcast_sum_long_nb(my, out, &plan, MPI_COMM_WORLD);
-        MPI_Allreduce(my, ref, count, MPI_LONG, MPI_SUM, MPI_COMM_WORLD);
+/* ---------- Asynchronous progress engine (tree-async) ----------
+   A dedicated thread owns a store-and-forward TreePlan and drives it with
+   tree_start/tree_test on a private duplicate of the communicator, so child
+   combines and the up/down forwarding proceed while the caller computes, with
+   no progress calls from the caller.  Needs MPI_THREAD_MULTIPLE: the caller
+   keeps using MPI meanwhile.  Hand-off is one atomic state word:
+   caller IDLE -> POSTED, engine POSTED -> DONE, caller DONE -> IDLE.
+   The engine spins (yielding) while idle; it is meant to own a spare core.
+*/
+enum { ENGINE_IDLE, ENGINE_POSTED, ENGINE_DONE, ENGINE_QUIT };
 
-        long t_scalar = 0, a_scalar = 0;
-        for (int j = 0; j < count; ++j) { t_scalar += out[j]; a_scalar += ref[j]; }
-        if (me == 0 && t_scalar != a_scalar) {
-            fprintf(stderr, "[CHECK] mismatch: tree=%ld allreduce=%ld\n", t_scalar, a_scalar);
-        }
+typedef struct {
+    TreePlan   *pl;
+    MPI_Comm    comm;           // private dup: the engine's traffic never matches the caller's
+    pthread_t   thread;
+    atomic_int  state;          // ENGINE_*
+    const void *sendbuf;        // may be MPI_IN_PLACE
+    void       *recvbuf;
+} TreeEngine;
+
+static void *tree_engine_main(void *arg) {
+    TreeEngine *e = (TreeEngine*)arg;
+    for (;;) {
+        int st = atomic_load_explicit(&e->state, memory_order_acquire);
+        if (st == ENGINE_QUIT) break;
+        if (st != ENGINE_POSTED) { sched_yield(); continue; }
+        tree_start(e->pl, e->sendbuf, e->recvbuf, e->comm);
+        while (!tree_test(e->pl)) { }
+        atomic_store_explicit(&e->state, ENGINE_DONE, memory_order_release);
     }
+    return NULL;
+}
 
-    if (me == 0) {
-        double tree_us = 1e6 * (t1 - t0) / (double)iters;
-        double allr_us = 1e6 * (t3 - t2) / (double)iters;
-        printf("\nResults (avg per iteration):\n");
-        printf("  TreeReduce (k=%d) + Bcast : %.2f us/iter\n", fanout, tree_us);
-        printf("  MPI_Allreduce              : %.2f us/iter\n", allr_us);
-        printf("  Rel. speed (Allreduce / Tree) : %.2fx  (>1 => Tree faster)\n",
-               (tree_us > 0.0) ? (allr_us / tree_us) : 0.0);
-        printf("  (accumulators) sink_tree=%ld sink_allreduce=%ld\n",
-               (long)sink_tree, (long)sink_allr);
-        fflush(stdout);
+static void tree_engine_init(TreeEngine *e, TreePlan *pl, MPI_Comm comm) {
+    e->pl = pl;
+    e->sendbuf = NULL;
+    e->recvbuf = NULL;
+    MPI_Comm_dup(comm, &e->comm);
+    atomic_init(&e->state, ENGINE_IDLE);
+    if (pthread_create(&e->thread, NULL, tree_engine_main, e) != 0) {
+        perror("pthread_create");
+        MPI_Abort(comm, 2);
+    }
+}
+
+static void tree_engine_post(TreeEngine *e, const void *sendbuf, void *recvbuf) {
+    e->sendbuf = sendbuf;
+    e->recvbuf = recvbuf;
+    atomic_store_explicit(&e->state, ENGINE_POSTED, memory_order_release);
+}
+
+static inline int tree_engine_done(TreeEngine *e) {
+    return atomic_load_explicit(&e->state, memory_order_acquire) == ENGINE_DONE;
+}
+
+static void tree_engine_wait(TreeEngine *e) {
+    while (!tree_engine_done(e)) sched_yield();
+    atomic_store_explicit(&e->state, ENGINE_IDLE, memory_order_relaxed);
+}
+
+static void tree_engine_stop(TreeEngine *e) {
+    atomic_store_explicit(&e->state, ENGINE_QUIT, memory_order_release);
+    pthread_join(e->thread, NULL);
+    MPI_Comm_free(&e->comm);
+}
+
+/* CPU seconds the engine thread has burnt so far (the cost of its core). */
+static double tree_engine_cpu_sec(const TreeEngine *e) {
+    clockid_t cid;
+    struct timespec ts;
+    if (pthread_getcpuclockid(e->thread, &cid) != 0 || clock_gettime(cid, &ts) != 0) return 0.0;
+    return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+/* ---------- Small-reduction fusion (--fuse N) ----------
+   Many independent count=1 allreduces each pay the full tree latency.  A
+   FuseQueue collects them (each with its own buffers, type and op) and runs
+   one store-and-forward tree pass per flush over a packed byte message,
+   then scatters the results.  Entries are packed grouped by (dtype, op), so
+   the message is at most DT_COUNT*OP_COUNT typed runs and every run is
+   folded by one combine_n (see tree_combine).
+   Collective semantics: every rank enqueues the same sequence of
+   (count, dtype, op).  The queue flushes by itself when the next entry would
+   not fit in `capacity` bytes; results are valid once the flush carrying them
+   has run (fuse_flush() forces one).  Inputs are read at flush time.
+*/
+typedef struct {
+    const void *sendbuf;        // may be MPI_IN_PLACE (input in recvbuf)
+    void       *recvbuf;
+    int         count;
+    int         key;            // dtype*OP_COUNT + op
+} FuseEntry;
+
+#define FUSE_KEYS  (DT_COUNT * OP_COUNT)
+#define FUSE_ALIGN 8            // run offsets: widest element
+
+typedef struct {
+    TreePlan   pl;              // byte-count tree, pl.count reset per flush
+    RedSpec    bytes;           // MPI_BYTE wire type; the runs carry the kernels
+    MPI_Comm   comm;
+    size_t     capacity;        // flush threshold (packed bytes)
+    void      *pack;            // packed message, reduced in place
+    FuseEntry *ent;
+    int        nent, max_ent;
+    size_t     key_bytes[FUSE_KEYS];
+    size_t     used;            // packed size of the queued entries
+    combine_kernel_t kern[FUSE_KEYS];
+    FuseRun    runs[FUSE_KEYS];
+    long       flushes, fused;  // stats: tree passes, reductions carried
+} FuseQueue;
+
+static inline size_t fuse_round(size_t b) { return (b + FUSE_ALIGN - 1) & ~(size_t)(FUSE_ALIGN - 1); }
+
+static void fuse_init(FuseQueue *q, int fanout, size_t capacity, int max_entries, MPI_Comm comm) {
+    memset(q, 0, sizeof(*q));
+    q->comm     = comm;
+    q->capacity = fuse_round(capacity < FUSE_ALIGN ? FUSE_ALIGN : capacity);
+    q->max_ent  = max_entries;
+    q->bytes.k.dtype = DT_INT64;    // unused: esize and type only
+    q->bytes.k.esize = 1;
+    q->bytes.type    = MPI_BYTE;
+    q->bytes.op      = MPI_OP_NULL;
+    q->pack = malloc(q->capacity);
+    q->ent  = (FuseEntry*)malloc((size_t)max_entries * sizeof(FuseEntry));
+    if (!q->pack || !q->ent) { perror("malloc fuse queue"); MPI_Abort(comm, 2); }
+    for (int key = 0; key < FUSE_KEYS; ++key)
+        if (combine_kernel_init(&q->kern[key], (ck_dtype_t)(key / OP_COUNT), (ck_op_t)(key % OP_COUNT)) != 0)
+            q->kern[key].combine_n = NULL;
+    tree_plan_heap_topology(&q->pl, fanout, /*root=*/0, comm);
+    q->pl.tag_up   = TAG_FUSE_UP;
+    q->pl.tag_down = TAG_FUSE_DOWN;
+    tree_plan_setup(&q->pl, (int)q->capacity, 0, &q->bytes, comm);
+}
+
+static void fuse_free(FuseQueue *q) {
+    tree_plan_free(&q->pl);
+    free(q->ent);
+    free(q->pack);
+    memset(q, 0, sizeof(*q));
+}
+
+/* Pack the queued entries by key, one tree pass over the packed bytes,
+   scatter the results.  Collective; a no-op on an empty queue. */
+static void fuse_flush(FuseQueue *q) {
+    if (q->nent == 0) return;
+
+    size_t key_off[FUSE_KEYS], at = 0;
+    int nruns = 0;
+    for (int key = 0; key < FUSE_KEYS; ++key) {
+        key_off[key] = at;
+        if (!q->key_bytes[key]) continue;
+        const combine_kernel_t *k = &q->kern[key];
+        q->runs[nruns++] = (FuseRun){ at, q->key_bytes[key] / k->esize, k };
+        at += fuse_round(q->key_bytes[key]);
+    }
+
+    size_t slot[FUSE_KEYS];
+    memcpy(slot, key_off, sizeof(slot));
+    for (int i = 0; i < q->nent; ++i) {
+        const FuseEntry *e = &q->ent[i];
+        const size_t b = (size_t)e->count * q->kern[e->key].esize;
+        memcpy((char*)q->pack + slot[e->key], e->sendbuf == MPI_IN_PLACE ? e->recvbuf : e->sendbuf, b);
+        slot[e->key] += b;
+    }
+
+    q->pl.count    = (int)at;
+    q->pl.runs     = q->runs;
+    q->pl.num_runs = nruns;
+    kary_tree_reduce_bcast_nb(MPI_IN_PLACE, q->pack, &q->pl, q->comm);
+
+    memcpy(slot, key_off, sizeof(slot));
+    for (int i = 0; i < q->nent; ++i) {
+        const FuseEntry *e = &q->ent[i];
+        const size_t b = (size_t)e->count * q->kern[e->key].esize;
+        memcpy(e->recvbuf, (const char*)q->pack + slot[e->key], b);
+        slot[e->key] += b;
+    }
+
+    q->flushes++;
+    q->fused += q->nent;
+    q->nent = 0;
+    q->used = 0;
+    memset(q->key_bytes, 0, sizeof(q->key_bytes));
+}
+
+/* Queue one allreduce.  Returns -1 (nothing queued) for an invalid dtype/op
+   combination or an entry larger than the capacity: run that one unfused. */
+static int fuse_enqueue(FuseQueue *q, const void *sendbuf, void *recvbuf, int count, ck_dtype_t dtype, ck_op_t op) {
+    const int key = (int)dtype * OP_COUNT + (int)op;
+    if (!q->kern[key].combine_n || count <= 0) return -1;
+    const size_t b = (size_t)count * q->kern[key].esize;
+    if (fuse_round(b) > q->capacity) return -1;
+
+    size_t grown = q->used - fuse_round(q->key_bytes[key]) + fuse_round(q->key_bytes[key] + b);
+    if (grown > q->capacity || q->nent == q->max_ent) {
+        fuse_flush(q);
+        grown = fuse_round(b);
+    }
+    q->ent[q->nent++] = (FuseEntry){ sendbuf, recvbuf, count, key };
+    q->key_bytes[key] += b;
+    q->used = grown;
+    return 0;
+}
+
+/* ---------- Sparse tree allreduce (--sparse) ----------
+   For mostly-zero vectors: each rank contributes sorted (index, value) pairs,
+   interior ranks merge the sorted lists of their children into their own, and
+   a list whose nnz passes max_sparse switches to the dense representation
+   (after which children are scattered into it).  The root's result travels
+   down the same heap tree as-is, and every rank expands it into a dense
+   recvbuf.  Absent entries are zero, so the op must have zero as identity:
+   sum or bor.
+   Wire message (MPI_BYTE): int64 nnz (SPARSE_DENSE for dense), then
+     sparse: int32 idx[nnz], padded to 8 bytes, values[nnz]
+     dense:  values[count]
+*/
+#define SPARSE_DENSE (-1)
+
+typedef struct {
+    int      nnz;
+    int32_t *idx;               // ascending
+    void    *val;               // nnz elements
+} SparseVec;
+
+typedef struct {
+    TreePlan t;                 // heap topology only
+    const RedSpec *red;
+    int     count;
+    int     max_sparse;         // a list with more entries goes dense
+    size_t  msg_cap;            // bytes of the largest message
+    void   *acc, *tmp;          // running result and merge scratch (msg_cap each)
+    void   *child_msgs;         // num_children * msg_cap
+    MPI_Request *reqs;
+    int    *ready_idx;
+    long    bytes_sent;         // stats
+} SparsePlan;
+
+static inline int64_t sp_nnz(const void *msg) { return *(const int64_t*)msg; }
+static inline int32_t *sp_idx(void *msg) { return (int32_t*)((char*)msg + 8); }
+static inline void *sp_val(void *msg) {
+    const int64_t nnz = sp_nnz(msg);
+    return (char*)msg + 8 + (nnz == SPARSE_DENSE ? 0 : (((size_t)nnz * 4 + 7) & ~(size_t)7));
+}
+static inline size_t sp_bytes(const SparsePlan *pl, int64_t nnz) {
+    const size_t es = pl->red->k.esize;
+    if (nnz == SPARSE_DENSE) return 8 + (size_t)pl->count * es;
+    return 8 + (((size_t)nnz * 4 + 7) & ~(size_t)7) + (size_t)nnz * es;
+}
+
+/* dense_at: list density (fraction of count) above which it goes dense. */
+static void sparse_plan_init(SparsePlan *pl, int fanout, int count, double dense_at, const RedSpec *red,
+                             MPI_Comm comm)
+{
+    memset(pl, 0, sizeof(*pl));
+    tree_plan_heap_topology(&pl->t, fanout, /*root=*/0, comm);
+    pl->red = red;
+    pl->count = count;
+    pl->max_sparse = (int)(dense_at * (double)count);
+    if (pl->max_sparse > count) pl->max_sparse = count;
+    const size_t dense = sp_bytes(pl, SPARSE_DENSE), sparse = sp_bytes(pl, pl->max_sparse);
+    pl->msg_cap = dense > sparse ? dense : sparse;
+    pl->acc = malloc(pl->msg_cap);
+    pl->tmp = malloc(pl->msg_cap);
+    const int nch = pl->t.num_children;
+    pl->child_msgs = malloc((size_t)(nch ? nch : 1) * pl->msg_cap);
+    pl->reqs       = (MPI_Request*)malloc((size_t)(nch ? nch : 1) * sizeof(MPI_Request));
+    pl->ready_idx  = (int*)malloc((size_t)(nch ? nch : 1) * sizeof(int));
+    if (!pl->acc || !pl->tmp || !pl->child_msgs || !pl->reqs || !pl->ready_idx) {
+        perror("malloc sparse plan");
+        MPI_Abort(comm, 2);
     }
+}
+
+static void sparse_plan_free(SparsePlan *pl) {
+    tree_plan_free(&pl->t);
+    free(pl->ready_idx);
+    free(pl->reqs);
+    free(pl->child_msgs);
+    free(pl->tmp);
+    free(pl->acc);
+    memset(pl, 0, sizeof(*pl));
+}
+
+/* dense[idx[i]] op= val[i] for the two zero-identity ops, typed so the
+   scatter is not one kernel call per pair. */
+#define SPARSE_SCATTER(T, EXPR)                                                   \
+    do {                                                                          \
+        T *d_ = (T*)dense; const T *v_ = (const T*)val;                           \
+        for (int64_t i = 0; i < n; ++i) { T *a_ = &d_[idx[i]]; *a_ = EXPR; }      \
+    } while (0)
 
-    tree_plan_free(&plan);
+static void sparse_scatter(const combine_kernel_t *k, void *dense, const int32_t *idx, const void *val, int64_t n) {
+    const int bor = (k->op == OP_BOR);
+    switch (k->dtype) {
+    case DT_INT32:  if (bor) SPARSE_SCATTER(int32_t, *a_ | v_[i]); else SPARSE_SCATTER(int32_t, *a_ + v_[i]); break;
+    case DT_INT64:  if (bor) SPARSE_SCATTER(int64_t, *a_ | v_[i]); else SPARSE_SCATTER(int64_t, *a_ + v_[i]); break;
+    case DT_FLOAT:  SPARSE_SCATTER(float, *a_ + v_[i]); break;
+    default:        SPARSE_SCATTER(double, *a_ + v_[i]); break;
+    }
+}
+#undef SPARSE_SCATTER
+
+/* msg := dense zeros with the sparse list (idx, val, n) folded in. */
+static void sparse_to_dense(const SparsePlan *pl, void *msg, const int32_t *idx, const void *val, int64_t n) {
+    *(int64_t*)msg = SPARSE_DENSE;
+    void *dv = sp_val(msg);
+    memset(dv, 0, (size_t)pl->count * pl->red->k.esize);
+    sparse_scatter(&pl->red->k, dv, idx, val, n);
+}
+
+/* One element; es is 4 or 8, so both copies inline. */
+static inline void sp_copy_elem(void *dst, const void *src, size_t es) {
+    if (es == 8) memcpy(dst, src, 8);
+    else         memcpy(dst, src, 4);
+}
+
+static void sparse_load(const SparsePlan *pl, void *msg, const SparseVec *in) {
+    const size_t es = pl->red->k.esize;
+    if (in->nnz > pl->max_sparse) { sparse_to_dense(pl, msg, in->idx, in->val, in->nnz); return; }
+    *(int64_t*)msg = in->nnz;
+    memcpy(sp_idx(msg), in->idx, (size_t)in->nnz * sizeof(int32_t));
+    memcpy(sp_val(msg), in->val, (size_t)in->nnz * es);
+}
+
+/* acc op= child; may swap acc with the scratch buffer. */
+static void sparse_fold(SparsePlan *pl, void *child) {
+    const combine_kernel_t *k = &pl->red->k;
+    const size_t es = k->esize;
+    const int64_t na = sp_nnz(pl->acc), nb = sp_nnz(child);
+
+    if (na != SPARSE_DENSE && nb == SPARSE_DENSE) {
+        // Keep the dense one as accumulator: swap roles via the scratch
+        memcpy(pl->tmp, child, sp_bytes(pl, SPARSE_DENSE));
+        child = pl->acc;
+        pl->acc = pl->tmp;
+        pl->tmp = child;
+        sparse_fold(pl, child);
+        return;
+    }
+    if (na == SPARSE_DENSE) {
+        char *av = (char*)sp_val(pl->acc);
+        const char *bv = (const char*)sp_val(child);
+        if (nb == SPARSE_DENSE) { combine_1(k, av, bv, (size_t)pl->count); return; }
+        sparse_scatter(k, av, sp_idx(child), bv, nb);
+        return;
+    }
+
+    // Both sparse: size the union first, then merge or go dense
+    const int32_t *ai = sp_idx(pl->acc), *bi = sp_idx(child);
+    const char *av = (const char*)sp_val(pl->acc), *bv = (const char*)sp_val(child);
+    int64_t nu = 0;
+    for (int64_t i = 0, j = 0; i < na || j < nb; ++nu) {
+        if (j == nb || (i < na && ai[i] < bi[j])) ++i;
+        else if (i == na || bi[j] < ai[i]) ++j;
+        else { ++i; ++j; }
+    }
+    if (nu > pl->max_sparse) {
+        sparse_to_dense(pl, pl->tmp, ai, av, na);
+        void *t = pl->acc; pl->acc = pl->tmp; pl->tmp = t;
+        sparse_fold(pl, child);
+        return;
+    }
+    *(int64_t*)pl->tmp = nu;
+    int32_t *ui = sp_idx(pl->tmp);
+    char *uv = (char*)sp_val(pl->tmp);
+    for (int64_t i = 0, j = 0, u = 0; u < nu; ++u) {
+        if (j == nb || (i < na && ai[i] < bi[j])) {
+            ui[u] = ai[i];
+            sp_copy_elem(uv + (size_t)u * es, av + (size_t)i++ * es, es);
+        } else if (i == na || bi[j] < ai[i]) {
+            ui[u] = bi[j];
+            sp_copy_elem(uv + (size_t)u * es, bv + (size_t)j++ * es, es);
+        } else {
+            ui[u] = ai[i];
+            sp_copy_elem(uv + (size_t)u * es, av + (size_t)i++ * es, es);
+            combine_1(k, uv + (size_t)u * es, bv + (size_t)j++ * es, 1);
+        }
+    }
+    void *t = pl->acc; pl->acc = pl->tmp; pl->tmp = t;
+}
+
+static void sparse_expand(const SparsePlan *pl, void *msg, void *recvbuf) {
+    const size_t es = pl->red->k.esize;
+    const int64_t n = sp_nnz(msg);
+    if (n == SPARSE_DENSE) { memcpy(recvbuf, sp_val(msg), (size_t)pl->count * es); return; }
+    memset(recvbuf, 0, (size_t)pl->count * es);
+    sparse_scatter(&pl->red->k, recvbuf, sp_idx(msg), sp_val(msg), n);
+}
+
+/* Dense result (count elements) of the reduction of every rank's `in`. */
+static void sparse_tree_allreduce(SparsePlan *pl, const SparseVec *in, void *recvbuf, MPI_Comm comm) {
+    const int nch = pl->t.num_children;
+    for (int i = 0; i < nch; ++i)
+        MPI_Irecv((char*)pl->child_msgs + (size_t)i * pl->msg_cap, (int)pl->msg_cap, MPI_BYTE,
+                  pl->t.children[i], TAG_SPARSE_UP, comm, &pl->reqs[i]);
+    sparse_load(pl, pl->acc, in);
+
+    // Merge children as they land
+    for (int remaining = nch; remaining > 0; ) {
+        int outcount = 0;
+        MPI_Waitsome(nch, pl->reqs, &outcount, pl->ready_idx, MPI_STATUSES_IGNORE);
+        for (int r = 0; r < outcount; ++r)
+            sparse_fold(pl, (char*)pl->child_msgs + (size_t)pl->ready_idx[r] * pl->msg_cap);
+        remaining -= outcount;
+    }
+
+    if (pl->t.parent >= 0) {
+        const size_t b = sp_bytes(pl, sp_nnz(pl->acc));
+        MPI_Send(pl->acc, (int)b, MPI_BYTE, pl->t.parent, TAG_SPARSE_UP, comm);
+        pl->bytes_sent += (long)b;
+        MPI_Recv(pl->acc, (int)pl->msg_cap, MPI_BYTE, pl->t.parent, TAG_SPARSE_DOWN, comm, MPI_STATUS_IGNORE);
+    }
+    if (nch > 0) {
+        const size_t b = sp_bytes(pl, sp_nnz(pl->acc));
+        for (int i = 0; i < nch; ++i)
+            MPI_Isend(pl->acc, (int)b, MPI_BYTE, pl->t.children[i], TAG_SPARSE_DOWN, comm, &pl->reqs[i]);
+        pl->bytes_sent += (long)nch * (long)b;
+    }
+    sparse_expand(pl, pl->acc, recvbuf);
+    if (nch > 0) MPI_Waitall(nch, pl->reqs, MPI_STATUSES_IGNORE);
+}
+
+/* ---------- Reproducible floating-point sum (--repro) ----------
+   Bit-identical results for any rank count, fanout or arrival order.  Each
+   double summand is split exactly into REPRO_BINS signed fixed-point chunks
+   of REPRO_BIN_BITS bits, aligned to the element's global maximum exponent
+   (one int32 max tree pass), and the chunks are summed as int64 (one int64
+   sum tree pass).  Integer addition is associative, so every grouping gives
+   the same bins, and the fixed-order conversion back gives the same double.
+   Bits more than REPRO_BINS*REPRO_BIN_BITS below the largest summand are
+   truncated per summand, which is order-independent too.  The headroom
+   (63 - REPRO_BIN_BITS bits) bounds the summands per element to 2^23.
+   Finite inputs only.
+*/
+#define REPRO_BINS      3
+#define REPRO_BIN_BITS  40
+#define REPRO_EXP_ZERO  (-100000)   // exponent of an all-zero element
+_Static_assert(REPRO_BIN_BITS == 40, "repro_split scales by 0x1p40");
+
+typedef struct {
+    TreePlan exp_tree;          // int32 max over count
+    TreePlan bin_tree;          // int64 sum over REPRO_BINS*count
+    RedSpec  exp_red, bin_red;
+    int      count;
+    int32_t *exps;
+    double  *scale;             // 2^(REPRO_BIN_BITS - exps[j]), 0 when out of range
+    int64_t *bins;
+} ReproPlan;
+
+static void repro_plan_init(ReproPlan *pl, int fanout, int count, MPI_Comm comm) {
+    memset(pl, 0, sizeof(*pl));
+    pl->count = count;
+    red_spec_init(&pl->exp_red, DT_INT32, OP_MAX);
+    red_spec_init(&pl->bin_red, DT_INT64, OP_SUM);
+    tree_plan_init(&pl->exp_tree, fanout, count, 0, &pl->exp_red, comm);
+    tree_plan_init(&pl->bin_tree, fanout, REPRO_BINS * count, 0, &pl->bin_red, comm);
+    pl->exps = (int32_t*)malloc((size_t)count * sizeof(int32_t));
+    pl->scale = (double*)malloc((size_t)count * sizeof(double));
+    pl->bins = (int64_t*)malloc((size_t)REPRO_BINS * (size_t)count * sizeof(int64_t));
+    if (!pl->exps || !pl->scale || !pl->bins) { perror("malloc repro plan"); MPI_Abort(comm, 2); }
+}
+
+static void repro_plan_free(ReproPlan *pl) {
+    free(pl->bins);
+    free(pl->scale);
+    free(pl->exps);
+    tree_plan_free(&pl->bin_tree);
+    tree_plan_free(&pl->exp_tree);
+    memset(pl, 0, sizeof(*pl));
+}
+
+/* frexp's exponent (|x| < 2^e) straight from the bits; libm for subnormals. */
+static inline int repro_exponent(double x) {
+    uint64_t u;
+    memcpy(&u, &x, sizeof(u));
+    const int f = (int)((u >> 52) & 0x7ff);
+    if (f) return f - 1022;
+    int e;
+    frexp(x, &e);
+    return e;
+}
+
+/* 2^n as a double, n in the normal range. */
+static inline double repro_pow2(int n) {
+    const uint64_t u = (uint64_t)(n + 1023) << 52;
+    double d;
+    memcpy(&d, &u, sizeof(d));
+    return d;
+}
+
+/* bins += x split against exponent e (|x| < 2^e), scale = 2^(REPRO_BIN_BITS - e)
+   or 0 if that is not a normal double.  Each step is exact: the integer part
+   (|r| < 2^REPRO_BIN_BITS, so the cast truncates exactly) is taken off the
+   double itself and the rest is scaled by a power of two. */
+static inline void repro_split(double x, int e, double scale, int64_t *bins) {
+    double r = scale ? x * scale : ldexp(x, REPRO_BIN_BITS - e);
+    for (int b = 0; b < REPRO_BINS; ++b) {
+        const int64_t t = (int64_t)r;
+        bins[b] += t;
+        r = (r - (double)t) * 0x1p40;
+    }
+}
+
+static inline double repro_unsplit(const int64_t *bins, int e) {
+    double v = 0.0;
+    for (int b = REPRO_BINS - 1; b >= 0; --b) v += ldexp((double)bins[b], e - REPRO_BIN_BITS * (b + 1));
+    return v;
+}
+
+/* out[j] = sum over every rank's summands[s*count + j], s < nsum. */
+static void repro_sum(ReproPlan *pl, const double *summands, int nsum, double *out, MPI_Comm comm) {
+    const int count = pl->count;
+    for (int j = 0; j < count; ++j) pl->exps[j] = REPRO_EXP_ZERO;
+    for (int s = 0; s < nsum; ++s) {
+        const double *x = summands + (size_t)s * (size_t)count;
+        for (int j = 0; j < count; ++j) {
+            if (x[j] == 0.0) continue;
+            const int e = repro_exponent(x[j]);
+            if (e > pl->exps[j]) pl->exps[j] = e;
+        }
+    }
+    tree_reduce_bcast(MPI_IN_PLACE, pl->exps, &pl->exp_tree, comm);
+
+    for (int j = 0; j < count; ++j) {
+        const int n = REPRO_BIN_BITS - pl->exps[j];
+        pl->scale[j] = (n >= -1022 && n <= 1023) ? repro_pow2(n) : 0.0;
+    }
+    memset(pl->bins, 0, (size_t)REPRO_BINS * (size_t)count * sizeof(int64_t));
+    for (int s = 0; s < nsum; ++s) {
+        const double *x = summands + (size_t)s * (size_t)count;
+        for (int j = 0; j < count; ++j)
+            repro_split(x[j], pl->exps[j], pl->scale[j], &pl->bins[(size_t)j * REPRO_BINS]);
+    }
+    tree_reduce_bcast(MPI_IN_PLACE, pl->bins, &pl->bin_tree, comm);
+
+    for (int j = 0; j < count; ++j)
+        out[j] = (pl->exps[j] == REPRO_EXP_ZERO) ? 0.0 : repro_unsplit(&pl->bins[(size_t)j * REPRO_BINS], pl->exps[j]);
+}
+
+/* ---------- One-sided tree (tree-rma) ----------
+   Same heap tree, no tag matching: every rank exposes one window
+       [ flags: int64 x (fanout+1) | child slot 0 .. fanout-1 | down slot ]
+   (flags at offset 0, data at RMA_DATA_OFF, each slot count elements).  A
+   child MPI_Puts its partial into its slot at the parent, flushes, then sets
+   its arrival flag to the call's epoch with MPI_Accumulate(MPI_REPLACE); the
+   parent polls its own flags and folds the children as they arrive.  The
+   broadcast puts the result into each child's down slot and sets flag
+   [fanout] the same way.  Flags carry a monotonically increasing epoch, so
+   they are never reset.  Slots are never overwritten early: a child's next
+   put follows its receipt of this call's result, which the parent sends only
+   after folding.  The window stays under MPI_Win_lock_all for the plan's
+   lifetime (passive target).  Local flag polls are plain atomic loads after
+   MPI_Win_sync in the unified memory model, MPI_Fetch_and_op(MPI_NO_OP)
+   otherwise; a poll that finds nothing yields the core, which matters when
+   ranks are oversubscribed (two-sided waits yield inside the library).
+*/
+typedef struct {
+    TreePlan t;                 // heap topology only
+    const RedSpec *red;
+    int      count;
+    int      slot;              // my slot index at my parent
+    MPI_Win  win;
+    char    *base;              // my window
+    size_t   data_off;
+    int      unified;           // MPI_WIN_UNIFIED: flags can be read directly
+    int64_t  epoch;
+    int     *pending;           // children not folded yet (size=num_children)
+} RmaTreePlan;
+
+static inline size_t rma_slot_off(const RmaTreePlan *pl, int i) {
+    return pl->data_off + (size_t)i * (size_t)pl->count * pl->red->k.esize;
+}
+
+static void rma_tree_init(RmaTreePlan *pl, int fanout, int count, const RedSpec *red, MPI_Comm comm) {
+    memset(pl, 0, sizeof(*pl));
+    tree_plan_heap_topology(&pl->t, fanout, /*root=*/0, comm);
+    pl->red   = red;
+    pl->count = count;
+    pl->slot  = (pl->t.me - 1) % pl->t.fanout;     // heap children are k*h+1 .. k*h+k
+    pl->data_off = (((size_t)pl->t.fanout + 1) * sizeof(int64_t) + 63) & ~(size_t)63;
+
+    const size_t bytes = rma_slot_off(pl, pl->t.fanout + 1);
+    MPI_Info info;
+    MPI_Info_create(&info);
+    MPI_Info_set(info, "accumulate_ops", "same_op_no_op");
+    MPI_Win_allocate((MPI_Aint)bytes, 1, info, comm, &pl->base, &pl->win);
+    MPI_Info_free(&info);
+    memset(pl->base, 0, bytes);
+
+    int *model = NULL, flag = 0;
+    MPI_Win_get_attr(pl->win, MPI_WIN_MODEL, &model, &flag);
+    pl->unified = flag && *model == MPI_WIN_UNIFIED;
+
+    pl->pending = (int*)malloc((size_t)(pl->t.num_children ? pl->t.num_children : 1) * sizeof(int));
+    pl->t.srcs  = (const void**)malloc((size_t)(pl->t.num_children ? pl->t.num_children : 1) * sizeof(*pl->t.srcs));
+    if (!pl->pending || !pl->t.srcs) { perror("malloc rma tree"); MPI_Abort(comm, 2); }
+    MPI_Barrier(comm);          // every window zeroed before the first put
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, pl->win);
+}
+
+static void rma_tree_free(RmaTreePlan *pl) {
+    MPI_Win_unlock_all(pl->win);
+    MPI_Win_free(&pl->win);
+    free(pl->pending);
+    tree_plan_free(&pl->t);     // also frees t.srcs
+    memset(pl, 0, sizeof(*pl));
+}
+
+static inline int64_t rma_flag_read(const RmaTreePlan *pl, int i) {
+    int64_t v;
+    if (pl->unified) {
+        MPI_Win_sync(pl->win);
+        v = __atomic_load_n((const int64_t*)pl->base + i, __ATOMIC_ACQUIRE);
+    } else {
+        MPI_Fetch_and_op(NULL, &v, MPI_INT64_T, pl->t.me, (MPI_Aint)(i * (int)sizeof(int64_t)), MPI_NO_OP,
+                         pl->win);
+        MPI_Win_flush(pl->t.me, pl->win);
+    }
+    return v;
+}
+
+/* Put data into slot `slot` at `target`, then raise flag `flag` there. */
+static void rma_put_signal(RmaTreePlan *pl, const void *data, int target, int slot, int flag) {
+    const int n = pl->count;
+    MPI_Put(data, n, pl->red->type, target, (MPI_Aint)rma_slot_off(pl, slot), n, pl->red->type, pl->win);
+    MPI_Win_flush(target, pl->win);
+    MPI_Accumulate(&pl->epoch, 1, MPI_INT64_T, target, (MPI_Aint)(flag * (int)sizeof(int64_t)), 1, MPI_INT64_T,
+                   MPI_REPLACE, pl->win);
+    MPI_Win_flush(target, pl->win);
+}
+
+/* sendbuf may be MPI_IN_PLACE. */
+static void rma_tree_allreduce(const void *sendbuf, void *recvbuf, RmaTreePlan *pl) {
+    const int nch = pl->t.num_children;
+    const size_t bytes = (size_t)pl->count * pl->red->k.esize;
+    const int64_t epoch = ++pl->epoch;
+
+    if (sendbuf != MPI_IN_PLACE) memcpy(recvbuf, sendbuf, bytes);
+
+    // Fold children as their flags come up, one combine_n per poll sweep
+    for (int i = 0; i < nch; ++i) pl->pending[i] = i;
+    for (int left = nch; left > 0; ) {
+        int ready = 0;
+        for (int p = 0; p < left; ) {
+            const int i = pl->pending[p];
+            if (rma_flag_read(pl, i) >= epoch) {
+                pl->t.srcs[ready++] = pl->base + rma_slot_off(pl, i);
+                pl->pending[p] = pl->pending[--left];
+            } else {
+                ++p;
+            }
+        }
+        if (ready > 0) {
+            MPI_Win_sync(pl->win);  // the slots' puts landed before their flags
+            pl->red->k.combine_n(recvbuf, pl->t.srcs, ready, (size_t)pl->count);
+        } else {
+            sched_yield();
+        }
+    }
+
+    if (pl->t.parent >= 0) {
+        rma_put_signal(pl, recvbuf, pl->t.parent, pl->slot, pl->slot);
+        while (rma_flag_read(pl, pl->t.fanout) < epoch) sched_yield();
+        MPI_Win_sync(pl->win);      // the down slot's put landed before its flag
+        memcpy(recvbuf, pl->base + rma_slot_off(pl, pl->t.fanout), bytes);
+    }
+    if (nch > 0) {
+        // Broadcast: all puts, one flush, then all flags
+        const int n = pl->count, down = pl->t.fanout;
+        for (int i = 0; i < nch; ++i)
+            MPI_Put(recvbuf, n, pl->red->type, pl->t.children[i], (MPI_Aint)rma_slot_off(pl, down), n,
+                    pl->red->type, pl->win);
+        MPI_Win_flush_all(pl->win);
+        for (int i = 0; i < nch; ++i)
+            MPI_Accumulate(&pl->epoch, 1, MPI_INT64_T, pl->t.children[i], (MPI_Aint)(down * (int)sizeof(int64_t)),
+                           1, MPI_INT64_T, MPI_REPLACE, pl->win);
+        MPI_Win_flush_all(pl->win);
+    }
+}
+
+/* ---------- Sparse data exchange termination (--nbx M) ----------
+   Every rank sends a few small messages to destinations only it knows; the
+   problem is knowing when to stop receiving.  NBX (Hoefler, Siebert,
+   Lumsdaine): send with MPI_Issend, and once all my sends completed (so were
+   matched) join an MPI_Ibarrier; keep receiving whatever MPI_Iprobe finds
+   until the barrier completes.  The counting schemes first sum a
+   per-destination message count vector (MPI_Allreduce, or the k-ary tree),
+   then receive exactly their own entry.  Rounds alternate between two tags:
+   a rank that left the NBX barrier may already be sending the next round to
+   a rank still draining this one.
+*/
+typedef struct {
+    int      nmsg;              // messages this round
+    int     *dst;               // [max_msgs]
+    int64_t *payload;           // [max_msgs]
+    MPI_Request *reqs;          // [max_msgs]
+    int     *counts, *totals;   // [np] per-destination counts, and their sum over ranks
+    long     received, bad;     // cumulative
+    int64_t  rx_sum;            // cumulative payload sum (accumulator)
+} SdxRound;
+
+static void sdx_init(SdxRound *r, int max_msgs, int np) {
+    memset(r, 0, sizeof(*r));
+    const size_t m = (size_t)(max_msgs > 0 ? max_msgs : 1);
+    r->dst     = (int*)malloc(m * sizeof(int));
+    r->payload = (int64_t*)malloc(m * sizeof(int64_t));
+    r->reqs    = (MPI_Request*)malloc(m * sizeof(MPI_Request));
+    r->counts  = (int*)malloc((size_t)np * sizeof(int));
+    r->totals  = (int*)malloc((size_t)np * sizeof(int));
+    if (!r->dst || !r->payload || !r->reqs || !r->counts || !r->totals) {
+        perror("malloc sparse exchange"); MPI_Abort(MPI_COMM_WORLD, 3);
+    }
+}
+
+static void sdx_free(SdxRound *r) {
+    free(r->totals); free(r->counts); free(r->reqs); free(r->payload); free(r->dst);
+    memset(r, 0, sizeof(*r));
+}
+
+/* A payload names its round, source and destination, so receivers can tell
+   a message that leaked across rounds or ranks. */
+static inline int64_t sdx_payload(long k, int src, int dst, int np) {
+    return ((int64_t)k * np + src) * np + dst;
+}
+
+static inline void sdx_recv(SdxRound *r, int src, int tag, long k, int me, int np, MPI_Comm comm) {
+    int64_t v;
+    MPI_Recv(&v, 1, MPI_INT64_T, src, tag, comm, MPI_STATUS_IGNORE);
+    r->received++;
+    r->rx_sum += v;
+    if (v % np != me || v / np / np != k) r->bad++;
+}
+
+static void sdx_nbx(SdxRound *r, long k, int me, int np, MPI_Comm comm) {
+    const int tag = TAG_SDX + (int)(k & 1);
+    for (int i = 0; i < r->nmsg; ++i)
+        MPI_Issend(&r->payload[i], 1, MPI_INT64_T, r->dst[i], tag, comm, &r->reqs[i]);
+    MPI_Request barrier = MPI_REQUEST_NULL;
+    for (;;) {
+        int flag;
+        MPI_Status st;
+        MPI_Iprobe(MPI_ANY_SOURCE, tag, comm, &flag, &st);
+        if (flag) {
+            sdx_recv(r, st.MPI_SOURCE, tag, k, me, np, comm);
+            continue;
+        }
+        if (barrier == MPI_REQUEST_NULL) {
+            MPI_Testall(r->nmsg, r->reqs, &flag, MPI_STATUSES_IGNORE);
+            if (flag) MPI_Ibarrier(comm, &barrier);
+        } else {
+            MPI_Test(&barrier, &flag, MPI_STATUS_IGNORE);
+            if (flag) break;
+        }
+    }
+}
+
+/* tree == NULL: sum the counts with MPI_Allreduce */
+static void sdx_counted(SdxRound *r, TreePlan *tree, long k, int me, int np, MPI_Comm comm) {
+    const int tag = TAG_SDX + (int)(k & 1);
+    memset(r->counts, 0, (size_t)np * sizeof(int));
+    for (int i = 0; i < r->nmsg; ++i) r->counts[r->dst[i]]++;
+    if (tree) tree_reduce_bcast(r->counts, r->totals, tree, comm);
+    else      MPI_Allreduce(r->counts, r->totals, np, MPI_INT, MPI_SUM, comm);
+    for (int i = 0; i < r->nmsg; ++i)
+        MPI_Isend(&r->payload[i], 1, MPI_INT64_T, r->dst[i], tag, comm, &r->reqs[i]);
+    for (int n = r->totals[me]; n > 0; --n) sdx_recv(r, MPI_ANY_SOURCE, tag, k, me, np, comm);
+    MPI_Waitall(r->nmsg, r->reqs, MPI_STATUSES_IGNORE);
+}
+
+/* Local memcpy traffic (bytes read + written) of one tree call on this rank:
+   staged = the earlier scheme with a private accumulator (copy sendbuf in,
+   copy the result out; segmented non-roots received the broadcast in place),
+   otherwise the zero-copy scheme above, in- or out-of-place. */
+static double tree_copy_traffic(const TreePlan *pl, int staged, int inplace) {
+    const double pass = 2.0 * (double)pl->count * (double)pl->red->k.esize;
+    if (staged) return (pl->segment && pl->parent >= 0) ? pass : 2.0 * pass;
+    if (inplace) return 0.0;
+    return (pl->num_children > 0 || pl->parent < 0) ? pass : 0.0;
+}
+
+/* ---------- Double binary tree ----------
+   Two complementary binary trees, each reducing+broadcasting half of the vector
+   concurrently.  Tree 0 is an in-order binary tree in which every odd rank is a
+   leaf; tree 1 is its mirror (n even) or its shift by one (n odd), so those
+   leaves become interior nodes there.  Every rank then sends and receives in
+   both trees, using both directions of each link instead of idling as a leaf.
+   Both trees run the segmented pipeline, interleaved segment by segment.
+*/
+static void btree_links(int n, int rank, int *up, int *d0, int *d1) {
+    int bit;
+    for (bit = 1; bit < n; bit <<= 1)
+        if (bit & rank) break;
+
+    if (rank == 0) {
+        // Root has a single child, itself the root of a full subtree
+        *up = -1; *d0 = -1;
+        *d1 = (n > 1) ? bit >> 1 : -1;
+        return;
+    }
+
+    *up = (rank ^ bit) | (bit << 1);
+    if (*up >= n) *up = rank ^ bit;
+
+    int lowbit = bit >> 1;
+    *d0 = (lowbit == 0) ? -1 : rank - lowbit;
+    *d1 = (lowbit == 0) ? -1 : rank + lowbit;
+    while (*d1 >= n) {          // shrink the right child back into range
+        lowbit >>= 1;
+        *d1 = (lowbit == 0) ? -1 : rank + lowbit;
+    }
+}
+
+static void dbt_tree_links(int n, int rank, int which, int *up, int *d0, int *d1) {
+    if (which == 0) { btree_links(n, rank, up, d0, d1); return; }
+
+    int u, c0, c1;
+    if (n % 2 == 1) {           // shift by one
+        btree_links(n, (rank - 1 + n) % n, &u, &c0, &c1);
+        *up = (u  < 0) ? -1 : (u  + 1) % n;
+        *d0 = (c0 < 0) ? -1 : (c0 + 1) % n;
+        *d1 = (c1 < 0) ? -1 : (c1 + 1) % n;
+    } else {                    // mirror
+        btree_links(n, n - 1 - rank, &u, &c0, &c1);
+        *up = (u  < 0) ? -1 : n - 1 - u;
+        *d0 = (c0 < 0) ? -1 : n - 1 - c0;
+        *d1 = (c1 < 0) ? -1 : n - 1 - c1;
+    }
+}
+
+/* A forest: several trees, tree t reducing+broadcasting its own slice
+   [off[t], off[t] + t[t].count) of the vector.  All trees run the segmented
+   pipeline (one segment per slice at minimum) so they can be interleaved. */
+typedef struct {
+    int ntrees;
+    TreePlan *t;
+    size_t   *off;
+} TreeForest;
+
+static void forest_alloc(TreeForest *f, int ntrees, MPI_Comm comm) {
+    memset(f, 0, sizeof(*f));
+    f->ntrees = ntrees;
+    f->t   = (TreePlan*)calloc((size_t)ntrees, sizeof(TreePlan));
+    f->off = (size_t*)calloc((size_t)ntrees, sizeof(size_t));
+    if (!f->t || !f->off) { perror("malloc forest"); MPI_Abort(comm, 2); }
+}
+
+/* Tags and scratch for tree t once its topology is set. */
+static void forest_setup_tree(TreeForest *f, int t, size_t off, int count, int segment,
+                              const RedSpec *red, MPI_Comm comm)
+{
+    TreePlan *tp = &f->t[t];
+    f->off[t]    = off;
+    tp->tag_up   = TAG_FOREST + 2 * t;
+    tp->tag_down = TAG_FOREST + 2 * t + 1;
+    tree_plan_setup(tp, count, (segment > 0 && segment < count) ? segment : count, red, comm);
+}
+
+static void forest_free(TreeForest *f) {
+    for (int t = 0; t < f->ntrees; ++t) tree_plan_free(&f->t[t]);
+    free(f->off);
+    free(f->t);
+    memset(f, 0, sizeof(*f));
+}
+
+/* Slice of a sendbuf that may be MPI_IN_PLACE. */
+static inline const void *sub_sendbuf(const void *sendbuf, size_t off, size_t es) {
+    return (sendbuf == MPI_IN_PLACE) ? MPI_IN_PLACE : cbuf_at(sendbuf, off, es);
+}
+
+static void forest_allreduce(
+    const void *sendbuf, void *recvbuf, const TreeForest *f, MPI_Comm comm)
+{
+    const size_t es = f->t[0].red->k.esize;
+    TreeSegCursor cur[f->ntrees];
+    int max_segs = 0;
+
+    for (int t = 0; t < f->ntrees; ++t) {
+        tree_seg_begin(&f->t[t], sub_sendbuf(sendbuf, f->off[t], es), buf_at(recvbuf, f->off[t], es), &cur[t], comm);
+        if (f->t[t].num_segs > max_segs) max_segs = f->t[t].num_segs;
+    }
+
+    // Every rank visits (segment, tree) in the same order, so waits never cycle
+    for (int s = 0; s < max_segs; ++s)
+        for (int t = 0; t < f->ntrees; ++t)
+            if (s < f->t[t].num_segs)
+                tree_seg_up_step(&f->t[t], sub_sendbuf(sendbuf, f->off[t], es), buf_at(recvbuf, f->off[t], es), s, &cur[t], comm);
+
+    for (int t = 0; t < f->ntrees; ++t)
+        tree_seg_finish(&f->t[t], buf_at(recvbuf, f->off[t], es), &cur[t], comm);
+}
+
+/* Double binary tree: tree 0 owns [0, ceil(count/2)), tree 1 the rest
+   (a single tree when count is too small to split). */
+static void dbt_plan_init(TreeForest *f, int count, int segment, const RedSpec *red, MPI_Comm comm) {
+    const int split  = (count + 1) / 2;
+    const int ntrees = (count - split > 0) ? 2 : 1;
+
+    forest_alloc(f, ntrees, comm);
+    for (int t = 0; t < ntrees; ++t) {
+        TreePlan *tp = &f->t[t];
+        int up, d0, d1;
+        MPI_Comm_rank(comm, &tp->me);
+        MPI_Comm_size(comm, &tp->np);
+        dbt_tree_links(tp->np, tp->me, t, &up, &d0, &d1);
+
+        tp->fanout = 2;
+        tp->parent = up;
+        tp->children = (int*)malloc(2 * sizeof(int));
+        if (!tp->children) { perror("malloc dbt children"); MPI_Abort(comm, 2); }
+        if (d0 >= 0) tp->children[tp->num_children++] = d0;
+        if (d1 >= 0) tp->children[tp->num_children++] = d1;
+
+        forest_setup_tree(f, t, (t == 0) ? 0 : (size_t)split, (t == 0) ? split : count - split,
+                          segment, red, comm);
+    }
+}
+
+/* ---------- Multi-root split-vector tree ----------
+   The vector is cut into R slices; slice r is reduced and broadcast over its
+   own k-ary heap tree rooted at rank r*np/R, with the heap rotated so that
+   root is heap index 0.  The root-side combine and the root's links are then
+   shared by R ranks instead of all landing on rank 0.
+*/
+static void multiroot_plan_init(TreeForest *f, int roots, int fanout, int count, int segment,
+                                const RedSpec *red, MPI_Comm comm)
+{
+    int np;
+    MPI_Comm_size(comm, &np);
+    if (roots > np)    roots = np;
+    if (roots > count) roots = count;   // no empty slices
+    if (roots < 1)     roots = 1;
+
+    forest_alloc(f, roots, comm);
+    size_t off = 0;
+    for (int r = 0; r < roots; ++r) {
+        const int len  = count / roots + (r < count % roots ? 1 : 0);
+        const int root = (int)((long)r * np / roots);
+        tree_plan_heap_topology(&f->t[r], fanout, root, comm);
+        forest_setup_tree(f, r, off, len, segment, red, comm);
+        off += (size_t)len;
+    }
+}
+
+/* ---------- Rabenseifner: reduce-scatter (recursive halving) + allgather (recursive doubling) ----------
+   Bandwidth term ~2*count regardless of n, and no rank handles the whole vector
+   more than once.  Non-power-of-two: the first 2*rem ranks pair up, the even one
+   folds its vector into its odd neighbour and sits out; it gets the result back
+   at the end.  The vector is cut into pof2 blocks (first count%pof2 blocks one
+   element larger), addressed through cnts/disps.
+   The fold and tmp are shared with recursive doubling (below).
+*/
+typedef struct {
+    int me, np;
+    int count;
+    int pof2, rem;
+    int newrank;                // rank among the pof2 participants, -1 if folded out
+    int *cnts, *disps;          // block layout (size=pof2)
+    void *tmp;                  // receive scratch (size=count)
+    const RedSpec *red;
+} RsagPlan;
+
+static inline int rsag_real_rank(const RsagPlan *pl, int newrank) {
+    return (newrank < pl->rem) ? newrank * 2 + 1 : newrank + pl->rem;
+}
+
+static void rsag_plan_init(RsagPlan *pl, int count, const RedSpec *red, MPI_Comm comm) {
+    memset(pl, 0, sizeof(*pl));
+    MPI_Comm_rank(comm, &pl->me);
+    MPI_Comm_size(comm, &pl->np);
+    pl->count = count;
+    pl->red   = red;
+
+    pl->pof2 = 1;
+    while (pl->pof2 * 2 <= pl->np) pl->pof2 *= 2;
+    pl->rem = pl->np - pl->pof2;
+
+    if (pl->me < 2 * pl->rem) pl->newrank = (pl->me % 2 == 0) ? -1 : pl->me / 2;
+    else                      pl->newrank = pl->me - pl->rem;
+
+    pl->cnts  = (int*)malloc((size_t)pl->pof2 * sizeof(int));
+    pl->disps = (int*)malloc((size_t)pl->pof2 * sizeof(int));
+    pl->tmp   = malloc((size_t)count * red->k.esize);
+    if (!pl->cnts || !pl->disps || !pl->tmp) { perror("malloc rsag"); MPI_Abort(comm, 2); }
+
+    for (int i = 0; i < pl->pof2; ++i) pl->cnts[i] = count / pl->pof2 + (i < count % pl->pof2 ? 1 : 0);
+    pl->disps[0] = 0;
+    for (int i = 1; i < pl->pof2; ++i) pl->disps[i] = pl->disps[i - 1] + pl->cnts[i - 1];
+}
+
+static void rsag_plan_free(RsagPlan *pl) {
+    free(pl->tmp);
+    free(pl->disps);
+    free(pl->cnts);
+    memset(pl, 0, sizeof(*pl));
+}
+
+/* Non-power-of-two pre-step: even ranks below 2*rem hand their vector to the
+   odd neighbour and drop out.  tag distinguishes the algorithm using the fold. */
+static void pof2_fold_in(const RsagPlan *pl, void *acc, int tag, MPI_Comm comm) {
+    const int count = pl->count;
+    if (pl->me >= 2 * pl->rem) return;
+    if (pl->newrank < 0) {
+        MPI_Send(acc, count, pl->red->type, pl->me + 1, tag, comm);
+    } else {
+        MPI_Recv(pl->tmp, count, pl->red->type, pl->me - 1, tag, comm, MPI_STATUS_IGNORE);
+        combine_1(&pl->red->k, acc, pl->tmp, (size_t)count);
+    }
+}
+
+/* Matching post-step: hand the result back to the folded-out ranks. */
+static void pof2_fold_out(const RsagPlan *pl, void *acc, int tag, MPI_Comm comm) {
+    if (pl->me >= 2 * pl->rem) return;
+    if (pl->newrank < 0)
+        MPI_Recv(acc, pl->count, pl->red->type, pl->me + 1, tag, comm, MPI_STATUS_IGNORE);
+    else
+        MPI_Send(acc, pl->count, pl->red->type, pl->me - 1, tag, comm);
+}
+
+static inline int rsag_span(const RsagPlan *pl, int lo, int hi) {
+    int n = 0;
+    for (int i = lo; i < hi; ++i) n += pl->cnts[i];
+    return n;
+}
+
+static void rabenseifner_allreduce(
+    const void *sendbuf, void *recvbuf, const RsagPlan *pl, MPI_Comm comm)
+{
+    const int count = pl->count;
+    const int pof2  = pl->pof2;
+    const size_t es = pl->red->k.esize;
+    const MPI_Datatype dt = pl->red->type;
+    void *acc = recvbuf;
+
+    if (sendbuf != MPI_IN_PLACE) memcpy(acc, sendbuf, (size_t)count * es);
+
+    // Pre-step: fold the surplus ranks into their odd neighbours
+    pof2_fold_in(pl, acc, TAG_RSAG, comm);
+
+    if (pl->newrank >= 0) {
+        const int nr = pl->newrank;
+        int send_idx = 0, recv_idx = 0, last_idx = pof2;
+        int mask = 1;
+
+        // Reduce-scatter by recursive halving: keep half, ship the other half
+        while (mask < pof2) {
+            const int newdst = nr ^ mask;
+            const int dst = rsag_real_rank(pl, newdst);
+            int send_cnt, recv_cnt;
+            if (nr < newdst) {
+                send_idx = recv_idx + pof2 / (mask * 2);
+                send_cnt = rsag_span(pl, send_idx, last_idx);
+                recv_cnt = rsag_span(pl, recv_idx, send_idx);
+            } else {
+                recv_idx = send_idx + pof2 / (mask * 2);
+                send_cnt = rsag_span(pl, send_idx, recv_idx);
+                recv_cnt = rsag_span(pl, recv_idx, last_idx);
+            }
+            MPI_Sendrecv(buf_at(acc, (size_t)pl->disps[send_idx], es), send_cnt, dt, dst, TAG_RSAG,
+                         pl->tmp, recv_cnt, dt, dst, TAG_RSAG, comm, MPI_STATUS_IGNORE);
+            combine_1(&pl->red->k, buf_at(acc, (size_t)pl->disps[recv_idx], es), pl->tmp, (size_t)recv_cnt);
+
+            send_idx = recv_idx;
+            mask <<= 1;
+            if (mask < pof2) last_idx = recv_idx + pof2 / mask;
+        }
+
+        // Allgather by recursive doubling: retrace the halving steps in reverse
+        mask >>= 1;
+        while (mask > 0) {
+            const int newdst = nr ^ mask;
+            const int dst = rsag_real_rank(pl, newdst);
+            int send_cnt, recv_cnt;
+            if (nr < newdst) {
+                if (mask != pof2 / 2) last_idx += pof2 / (mask * 2);
+                recv_idx = send_idx + pof2 / (mask * 2);
+                send_cnt = rsag_span(pl, send_idx, recv_idx);
+                recv_cnt = rsag_span(pl, recv_idx, last_idx);
+            } else {
+                recv_idx = send_idx - pof2 / (mask * 2);
+                send_cnt = rsag_span(pl, send_idx, last_idx);
+                recv_cnt = rsag_span(pl, recv_idx, send_idx);
+            }
+            MPI_Sendrecv(buf_at(acc, (size_t)pl->disps[send_idx], es), send_cnt, dt, dst, TAG_RSAG,
+                         buf_at(acc, (size_t)pl->disps[recv_idx], es), recv_cnt, dt, dst, TAG_RSAG,
+                         comm, MPI_STATUS_IGNORE);
+            if (nr > newdst) send_idx = recv_idx;
+            mask >>= 1;
+        }
+    }
+
+    // Post-step: hand the result back to the folded-out ranks
+    pof2_fold_out(pl, acc, TAG_RSAG, comm);
+}
+
+/* ---------- Recursive doubling (butterfly) ----------
+   Latency-optimal for small counts: log2(pof2) full-vector exchanges and every
+   participant ends with the sum, so there is no separate broadcast phase
+   (vs 2*log_k(n) hops up and down the k-ary tree).  Non-power-of-two ranks
+   use the same pre/post fold as Rabenseifner (two extra hops for those ranks).
+*/
+static void recursive_doubling_allreduce(
+    const void *sendbuf, void *recvbuf, const RsagPlan *pl, MPI_Comm comm)
+{
+    const int count = pl->count;
+    const MPI_Datatype dt = pl->red->type;
+    void *acc = recvbuf;
+
+    if (sendbuf != MPI_IN_PLACE) memcpy(acc, sendbuf, (size_t)count * pl->red->k.esize);
+    pof2_fold_in(pl, acc, TAG_RDBL, comm);
+
+    if (pl->newrank >= 0) {
+        for (int mask = 1; mask < pl->pof2; mask <<= 1) {
+            const int dst = rsag_real_rank(pl, pl->newrank ^ mask);
+            MPI_Sendrecv(acc, count, dt, dst, TAG_RDBL,
+                         pl->tmp, count, dt, dst, TAG_RDBL, comm, MPI_STATUS_IGNORE);
+            combine_1(&pl->red->k, acc, pl->tmp, (size_t)count);
+        }
+    }
+
+    pof2_fold_out(pl, acc, TAG_RDBL, comm);
+}
+
+/* ---------- Ring: reduce-scatter ring + allgather ring ----------
+   Bandwidth-optimal for large counts: each rank sends and receives
+   2*(n-1)/n * count elements, always to/from its ring neighbours.  Each of the
+   n blocks moves in chunks of pl->chunk elements; reduce-scatter chunks land in
+   two alternating tmp buffers, so chunk c+1 is in flight while chunk c is
+   being combined.  Allgather chunks are received straight into place.
+*/
+#define RING_DEFAULT_CHUNK 32768   // elements (256 KiB of int64)
+
+typedef struct {
+    int me, np;
+    int count;
+    int chunk;                  // elements per message
+    int left, right;
+    int max_chunks;             // chunks in the largest block
+    int *cnts, *disps;          // block layout (size=np)
+    void *tmp;                  // 2*chunk double-buffered receive slots
+    MPI_Request *sends, *recvs; // per-chunk handles (size=max_chunks)
+    const RedSpec *red;
+} RingPlan;
+
+static void ring_plan_init(RingPlan *pl, int count, int chunk, const RedSpec *red, MPI_Comm comm) {
+    memset(pl, 0, sizeof(*pl));
+    MPI_Comm_rank(comm, &pl->me);
+    MPI_Comm_size(comm, &pl->np);
+    pl->count = count;
+    pl->red   = red;
+    pl->left  = (pl->me - 1 + pl->np) % pl->np;
+    pl->right = (pl->me + 1) % pl->np;
+
+    pl->cnts  = (int*)malloc((size_t)pl->np * sizeof(int));
+    pl->disps = (int*)malloc((size_t)pl->np * sizeof(int));
+    if (!pl->cnts || !pl->disps) { perror("malloc ring"); MPI_Abort(comm, 2); }
+    for (int i = 0; i < pl->np; ++i) pl->cnts[i] = count / pl->np + (i < count % pl->np ? 1 : 0);
+    pl->disps[0] = 0;
+    for (int i = 1; i < pl->np; ++i) pl->disps[i] = pl->disps[i - 1] + pl->cnts[i - 1];
+
+    int max_blk = pl->cnts[0];
+    pl->chunk = (chunk > 0 && chunk < max_blk) ? chunk : (max_blk > 0 ? max_blk : 1);
+    pl->max_chunks = (max_blk + pl->chunk - 1) / pl->chunk;
+    if (pl->max_chunks < 1) pl->max_chunks = 1;
+
+    pl->tmp   = malloc(2 * (size_t)pl->chunk * red->k.esize);
+    pl->sends = (MPI_Request*)malloc((size_t)pl->max_chunks * sizeof(MPI_Request));
+    pl->recvs = (MPI_Request*)malloc((size_t)pl->max_chunks * sizeof(MPI_Request));
+    if (!pl->tmp || !pl->sends || !pl->recvs) { perror("malloc ring"); MPI_Abort(comm, 2); }
+}
+
+static void ring_plan_free(RingPlan *pl) {
+    free(pl->recvs);
+    free(pl->sends);
+    free(pl->tmp);
+    free(pl->disps);
+    free(pl->cnts);
+    memset(pl, 0, sizeof(*pl));
+}
+
+static inline int ring_nchunks(const RingPlan *pl, int blk) {
+    return (pl->cnts[blk] + pl->chunk - 1) / pl->chunk;
+}
+
+static inline int ring_chunk_len(const RingPlan *pl, int blk, int c) {
+    int rest = pl->cnts[blk] - c * pl->chunk;
+    return rest < pl->chunk ? rest : pl->chunk;
+}
+
+static inline void ring_send_block(const RingPlan *pl, const void *acc, int blk, MPI_Comm comm) {
+    const size_t es = pl->red->k.esize;
+    for (int c = 0; c < ring_nchunks(pl, blk); ++c)
+        MPI_Isend(cbuf_at(acc, (size_t)pl->disps[blk] + (size_t)c * pl->chunk, es),
+                  ring_chunk_len(pl, blk, c), pl->red->type,
+                  pl->right, TAG_RING, comm, &pl->sends[c]);
+}
+
+static void ring_allreduce(
+    const void *sendbuf, void *recvbuf, const RingPlan *pl, MPI_Comm comm)
+{
+    const int n = pl->np;
+    const size_t es = pl->red->k.esize;
+    const MPI_Datatype dt = pl->red->type;
+    void *acc = recvbuf;
+
+    if (sendbuf != MPI_IN_PLACE) memcpy(acc, sendbuf, (size_t)pl->count * es);
+    if (n == 1) return;
+
+    // Reduce-scatter: after step s, block (me-s-1) holds s+2 contributions
+    for (int s = 0; s < n - 1; ++s) {
+        const int send_blk = (pl->me - s + n) % n;
+        const int recv_blk = (pl->me - s - 1 + n) % n;
+        const int nsend = ring_nchunks(pl, send_blk);
+        const int nrecv = ring_nchunks(pl, recv_blk);
+        void *dst = buf_at(acc, (size_t)pl->disps[recv_blk], es);
+
+        if (nrecv > 0)
+            MPI_Irecv(pl->tmp, ring_chunk_len(pl, recv_blk, 0), dt,
+                      pl->left, TAG_RING, comm, &pl->recvs[0]);
+        ring_send_block(pl, acc, send_blk, comm);
+
+        for (int c = 0; c < nrecv; ++c) {
+            const void *slot = cbuf_at(pl->tmp, (size_t)(c % 2) * pl->chunk, es);
+            MPI_Wait(&pl->recvs[c], MPI_STATUS_IGNORE);
+            if (c + 1 < nrecv)
+                MPI_Irecv(buf_at(pl->tmp, (size_t)((c + 1) % 2) * pl->chunk, es),
+                          ring_chunk_len(pl, recv_blk, c + 1), dt,
+                          pl->left, TAG_RING, comm, &pl->recvs[c + 1]);
+            const int len = ring_chunk_len(pl, recv_blk, c);
+            combine_1(&pl->red->k, buf_at(dst, (size_t)c * pl->chunk, es), slot, (size_t)len);
+        }
+        MPI_Waitall(nsend, pl->sends, MPI_STATUSES_IGNORE);
+    }
+
+    // Allgather: circulate the finished blocks, received straight into place
+    for (int s = 0; s < n - 1; ++s) {
+        const int send_blk = (pl->me + 1 - s + n) % n;
+        const int recv_blk = (pl->me - s + n) % n;
+        const int nrecv = ring_nchunks(pl, recv_blk);
+        void *dst = buf_at(acc, (size_t)pl->disps[recv_blk], es);
+
+        for (int c = 0; c < nrecv; ++c)
+            MPI_Irecv(buf_at(dst, (size_t)c * pl->chunk, es), ring_chunk_len(pl, recv_blk, c), dt,
+                      pl->left, TAG_RING, comm, &pl->recvs[c]);
+        ring_send_block(pl, acc, send_blk, comm);
+        MPI_Waitall(nrecv, pl->recvs, MPI_STATUSES_IGNORE);
+        MPI_Waitall(ring_nchunks(pl, send_blk), pl->sends, MPI_STATUSES_IGNORE);
+    }
+}
+
+/* ---------- Reduced-precision wire formats (--wire) ----------
+   For bandwidth-bound float sums: the tree and the ring ship each message as
+   bf16, fp16 or blockwise int8 (one float scale per WIRE_INT8_BLOCK elements)
+   and every rank accumulates in fp32.  The final result is encoded once (by
+   the root, or by each ring block's owner), forwarded as-is and decoded by
+   every rank, owner included, so all ranks hold the same bits.
+   Error feedback (optional): the sender adds what its previous encode of the
+   same message lost and remembers what this one loses, so the quantization
+   error does not accumulate across calls.
+*/
+enum { WIRE_FP32, WIRE_BF16, WIRE_FP16, WIRE_INT8, WIRE_NFMTS };
+static const char *wire_names[WIRE_NFMTS] = { "fp32", "bf16", "fp16", "int8" };
+#define WIRE_INT8_BLOCK 256
+
+static size_t wire_bytes(int fmt, size_t n) {
+    switch (fmt) {
+    case WIRE_BF16: case WIRE_FP16: return 2 * n;
+    case WIRE_INT8: return n + sizeof(float) * ((n + WIRE_INT8_BLOCK - 1) / WIRE_INT8_BLOCK);
+    default:        return sizeof(float) * n;
+    }
+}
+
+static inline uint32_t f32_bits(float f) { uint32_t u; memcpy(&u, &f, sizeof(u)); return u; }
+static inline float bits_f32(uint32_t u) { float f; memcpy(&f, &u, sizeof(f)); return f; }
+
+/* Round to nearest even; NaN stays NaN. */
+static inline uint16_t f32_to_bf16(float f) {
+    uint32_t u = f32_bits(f);
+    if ((u & 0x7fffffffu) > 0x7f800000u) return (uint16_t)((u >> 16) | 0x40);
+    u += 0x7fffu + ((u >> 16) & 1u);
+    return (uint16_t)(u >> 16);
+}
+static inline float bf16_to_f32(uint16_t h) { return bits_f32((uint32_t)h << 16); }
+
+/* IEEE half, round to nearest even, with subnormals and inf/NaN. */
+static inline uint16_t f32_to_f16(float f) {
+    const uint32_t f16max = (127u + 16u) << 23, denorm_magic = ((127u - 15u) + (23u - 10u) + 1u) << 23;
+    uint32_t u = f32_bits(f);
+    const uint32_t sign = u & 0x80000000u;
+    uint16_t o;
+    u ^= sign;
+    if (u >= f16max) {
+        o = (u > 0x7f800000u) ? 0x7e00 : 0x7c00;
+    } else if (u < (113u << 23)) {
+        o = (uint16_t)(f32_bits(bits_f32(u) + bits_f32(denorm_magic)) - denorm_magic);
+    } else {
+        const uint32_t mant_odd = (u >> 13) & 1u;
+        u += ((uint32_t)(15 - 127) << 23) + 0xfffu + mant_odd;
+        o = (uint16_t)(u >> 13);
+    }
+    return (uint16_t)(o | (sign >> 16));
+}
+
+static inline float f16_to_f32(uint16_t h) {
+    const uint32_t shifted_exp = 0x7c00u << 13;
+    uint32_t o = ((uint32_t)h & 0x7fffu) << 13;
+    const uint32_t exp = shifted_exp & o;
+    o += (127u - 15u) << 23;
+    if (exp == shifted_exp) {
+        o += (128u - 16u) << 23;                            // inf / NaN
+    } else if (exp == 0) {
+        o += 1u << 23;                                      // subnormal: renormalise
+        o = f32_bits(bits_f32(o) - bits_f32(113u << 23));
+    }
+    return bits_f32(o | (((uint32_t)h & 0x8000u) << 16));
+}
+
+/* fp16 in hardware: F16C comes with every AVX2 part.  n8 = n rounded down to 8.
+   Callers only enter these with n8 > 0, i.e. after wire_f16c_prefix found F16C. */
+__attribute__((target("avx2,f16c")))
+static void f16_encode_f16c(const float *x, size_t n8, uint16_t *h) {
+    for (size_t i = 0; i < n8; i += 8)
+        _mm_storeu_si128((__m128i*)(h + i),
+                         _mm256_cvtps_ph(_mm256_loadu_ps(x + i), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+}
+
+__attribute__((target("avx2,f16c")))
+static void f16_decode_f16c(const uint16_t *h, size_t n8, float *out, int accumulate) {
+    for (size_t i = 0; i < n8; i += 8) {
+        __m256 v = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(h + i)));
+        if (accumulate) v = _mm256_add_ps(v, _mm256_loadu_ps(out + i));
+        _mm256_storeu_ps(out + i, v);
+    }
+}
+
+static int wire_f16c = -1;      // resolved on first use
+static inline size_t wire_f16c_prefix(size_t n) {
+    if (wire_f16c < 0) wire_f16c = (ck_detect_isa() >= ISA_AVX2);
+    return wire_f16c ? (n & ~(size_t)7) : 0;
+}
+
+/* dst := encode(x + resid); resid := what the encode lost (resid may be NULL). */
+static void wire_encode(int fmt, const float *x, size_t n, void *dst, float *resid) {
+    // One branch-free loop per case, so each vectorises
+    uint16_t *h = (uint16_t*)dst;
+    if (fmt == WIRE_BF16 && !resid) {
+        for (size_t i = 0; i < n; ++i) h[i] = f32_to_bf16(x[i]);
+        return;
+    }
+    if (fmt == WIRE_BF16) {
+        for (size_t i = 0; i < n; ++i) {
+            const float v = x[i] + resid[i];
+            h[i] = f32_to_bf16(v);
+            resid[i] = v - bf16_to_f32(h[i]);
+        }
+        return;
+    }
+    if (fmt == WIRE_FP16) {
+        if (resid) for (size_t i = 0; i < n; ++i) resid[i] += x[i];   // resid holds v until re-derived
+        const float *v = resid ? resid : x;
+        const size_t hw = wire_f16c_prefix(n);
+        if (hw) f16_encode_f16c(v, hw, h);
+        for (size_t i = hw; i < n; ++i) h[i] = f32_to_f16(v[i]);
+        if (resid) {
+            float back[WIRE_INT8_BLOCK];
+            for (size_t b = 0; b < n; b += WIRE_INT8_BLOCK) {
+                const size_t len = (n - b < WIRE_INT8_BLOCK) ? n - b : WIRE_INT8_BLOCK;
+                const size_t bw = wire_f16c ? (len & ~(size_t)7) : 0;
+                if (bw) f16_decode_f16c(h + b, bw, back, 0);
+                for (size_t i = bw; i < len; ++i) back[i] = f16_to_f32(h[b + i]);
+                for (size_t i = 0; i < len; ++i) resid[b + i] -= back[i];
+            }
+        }
+        return;
+    }
+    if (fmt != WIRE_INT8) { memcpy(dst, x, n * sizeof(float)); return; }
+
+    char *p = (char*)dst;
+    float v[WIRE_INT8_BLOCK];
+    for (size_t b = 0; b < n; b += WIRE_INT8_BLOCK) {
+        const size_t len = (n - b < WIRE_INT8_BLOCK) ? n - b : WIRE_INT8_BLOCK;
+        if (resid) for (size_t i = 0; i < len; ++i) v[i] = x[b + i] + resid[b + i];
+        else       memcpy(v, x + b, len * sizeof(float));
+        // max |v| on the bit patterns: ordered like the values for non-NaN
+        // magnitudes, and an integer max reduction vectorises
+        uint32_t abits = 0;
+        for (size_t i = 0; i < len; ++i) {
+            const uint32_t a = f32_bits(v[i]) & 0x7fffffffu;
+            abits = a > abits ? a : abits;
+        }
+        const float amax = bits_f32(abits);
+        const float scale = amax / 127.0f, inv = (amax > 0.0f) ? 127.0f / amax : 0.0f;
+        memcpy(p, &scale, sizeof(scale));
+        int8_t *q = (int8_t*)(p + sizeof(scale));
+        for (size_t i = 0; i < len; ++i) {
+            // |v * inv| <= 127, so rounding half away from zero cannot overflow
+            const float r = v[i] * inv;
+            q[i] = (int8_t)(int)(r + copysignf(0.5f, r));
+        }
+        if (resid) for (size_t i = 0; i < len; ++i) resid[b + i] = v[i] - (float)q[i] * scale;
+        p += sizeof(scale) + len;
+    }
+}
+
+/* out (+)= decode(src); accumulate selects += over =. */
+static void wire_decode(int fmt, const void *src, size_t n, float *out, int accumulate) {
+    const uint16_t *h = (const uint16_t*)src;
+    if (fmt == WIRE_BF16) {
+        if (accumulate) for (size_t i = 0; i < n; ++i) out[i] += bf16_to_f32(h[i]);
+        else            for (size_t i = 0; i < n; ++i) out[i]  = bf16_to_f32(h[i]);
+        return;
+    }
+    if (fmt == WIRE_FP16) {
+        const size_t hw = wire_f16c_prefix(n);
+        if (hw) f16_decode_f16c(h, hw, out, accumulate);
+        if (accumulate) for (size_t i = hw; i < n; ++i) out[i] += f16_to_f32(h[i]);
+        else            for (size_t i = hw; i < n; ++i) out[i]  = f16_to_f32(h[i]);
+        return;
+    }
+    if (fmt != WIRE_INT8) {
+        const float *f = (const float*)src;
+        if (accumulate) for (size_t i = 0; i < n; ++i) out[i] += f[i];
+        else            memcpy(out, f, n * sizeof(float));
+        return;
+    }
+    const char *p = (const char*)src;
+    for (size_t b = 0; b < n; b += WIRE_INT8_BLOCK) {
+        const size_t len = (n - b < WIRE_INT8_BLOCK) ? n - b : WIRE_INT8_BLOCK;
+        float scale;
+        memcpy(&scale, p, sizeof(scale));
+        const int8_t *q = (const int8_t*)(p + sizeof(scale));
+        if (accumulate) for (size_t i = 0; i < len; ++i) out[b + i] += (float)q[i] * scale;
+        else            for (size_t i = 0; i < len; ++i) out[b + i]  = (float)q[i] * scale;
+        p += sizeof(scale) + len;
+    }
+}
+
+/* Store-and-forward heap tree (topology from a TreePlan) with encoded edges. */
+typedef struct {
+    const TreePlan *t;
+    int     fmt;
+    size_t  msg_bytes;
+    void   *msg;                // encoded partial up, then the encoded result
+    void   *child_msgs;         // num_children * msg_bytes
+    float  *resid;              // error feedback for my encode (NULL: off)
+    MPI_Request *reqs;
+    int    *ready_idx;
+} WireTree;
+
+static void wire_tree_init(WireTree *w, const TreePlan *t, int fmt, int error_feedback, MPI_Comm comm) {
+    memset(w, 0, sizeof(*w));
+    const int nch = t->num_children ? t->num_children : 1;
+    w->t = t;
+    w->fmt = fmt;
+    w->msg_bytes  = wire_bytes(fmt, (size_t)t->count);
+    w->msg        = malloc(w->msg_bytes);
+    w->child_msgs = malloc((size_t)nch * w->msg_bytes);
+    w->reqs       = (MPI_Request*)malloc((size_t)nch * sizeof(MPI_Request));
+    w->ready_idx  = (int*)malloc((size_t)nch * sizeof(int));
+    if (error_feedback) w->resid = (float*)calloc((size_t)t->count, sizeof(float));
+    if (!w->msg || !w->child_msgs || !w->reqs || !w->ready_idx || (error_feedback && !w->resid)) {
+        perror("malloc wire tree");
+        MPI_Abort(comm, 2);
+    }
+}
+
+static void wire_tree_free(WireTree *w) {
+    free(w->resid);
+    free(w->ready_idx);
+    free(w->reqs);
+    free(w->child_msgs);
+    free(w->msg);
+    memset(w, 0, sizeof(*w));
+}
+
+/* float sum; sendbuf may be MPI_IN_PLACE. */
+static void wire_tree_allreduce(WireTree *w, const float *sendbuf, float *recvbuf, MPI_Comm comm) {
+    const TreePlan *t = w->t;
+    const int nch = t->num_children, mb = (int)w->msg_bytes;
+    const size_t n = (size_t)t->count;
+
+    for (int i = 0; i < nch; ++i)
+        MPI_Irecv((char*)w->child_msgs + (size_t)i * w->msg_bytes, mb, MPI_BYTE, t->children[i],
+                  t->tag_up, comm, &w->reqs[i]);
+    if ((const void*)sendbuf != MPI_IN_PLACE) memcpy(recvbuf, sendbuf, n * sizeof(float));
+    for (int remaining = nch; remaining > 0; ) {
+        int outcount = 0;
+        MPI_Waitsome(nch, w->reqs, &outcount, w->ready_idx, MPI_STATUSES_IGNORE);
+        for (int r = 0; r < outcount; ++r)
+            wire_decode(w->fmt, (char*)w->child_msgs + (size_t)w->ready_idx[r] * w->msg_bytes, n, recvbuf, 1);
+        remaining -= outcount;
+    }
+
+    wire_encode(w->fmt, recvbuf, n, w->msg, w->resid);   // partial up, or the root's result
+    if (t->parent >= 0) {
+        MPI_Send(w->msg, mb, MPI_BYTE, t->parent, t->tag_up, comm);
+        MPI_Recv(w->msg, mb, MPI_BYTE, t->parent, t->tag_down, comm, MPI_STATUS_IGNORE);
+    }
+    for (int i = 0; i < nch; ++i)
+        MPI_Isend(w->msg, mb, MPI_BYTE, t->children[i], t->tag_down, comm, &w->reqs[i]);
+    wire_decode(w->fmt, w->msg, n, recvbuf, 0);
+    MPI_Waitall(nch, w->reqs, MPI_STATUSES_IGNORE);
+}
+
+/* Unchunked ring (block layout from a RingPlan) with encoded blocks. */
+typedef struct {
+    const RingPlan *r;
+    int     fmt;
+    size_t  blk_bytes;          // encoded size of the largest block
+    void   *sbuf, *rbuf;
+    float  *resid;              // per element: each position is encoded by me at most once per call
+} WireRing;
+
+static void wire_ring_init(WireRing *w, const RingPlan *r, int fmt, int error_feedback, MPI_Comm comm) {
+    memset(w, 0, sizeof(*w));
+    w->r = r;
+    w->fmt = fmt;
+    w->blk_bytes = wire_bytes(fmt, (size_t)r->cnts[0]);
+    w->sbuf = malloc(w->blk_bytes ? w->blk_bytes : 1);
+    w->rbuf = malloc(w->blk_bytes ? w->blk_bytes : 1);
+    if (error_feedback) w->resid = (float*)calloc((size_t)r->count, sizeof(float));
+    if (!w->sbuf || !w->rbuf || (error_feedback && !w->resid)) { perror("malloc wire ring"); MPI_Abort(comm, 2); }
+}
+
+static void wire_ring_free(WireRing *w) {
+    free(w->resid);
+    free(w->rbuf);
+    free(w->sbuf);
+    memset(w, 0, sizeof(*w));
+}
+
+static void wire_ring_allreduce(WireRing *w, const float *sendbuf, float *recvbuf, MPI_Comm comm) {
+    const RingPlan *r = w->r;
+    const int n = r->np;
+    if ((const void*)sendbuf != MPI_IN_PLACE) memcpy(recvbuf, sendbuf, (size_t)r->count * sizeof(float));
+    if (n == 1) return;
+
+    // Reduce-scatter: decode each incoming block into my fp32 partial
+    for (int s = 0; s < n - 1; ++s) {
+        const int sb = (r->me - s + n) % n, rb = (r->me - s - 1 + n) % n;
+        wire_encode(w->fmt, recvbuf + r->disps[sb], (size_t)r->cnts[sb], w->sbuf,
+                    w->resid ? w->resid + r->disps[sb] : NULL);
+        MPI_Sendrecv(w->sbuf, (int)wire_bytes(w->fmt, (size_t)r->cnts[sb]), MPI_BYTE, r->right, TAG_RING,
+                     w->rbuf, (int)wire_bytes(w->fmt, (size_t)r->cnts[rb]), MPI_BYTE, r->left, TAG_RING,
+                     comm, MPI_STATUS_IGNORE);
+        wire_decode(w->fmt, w->rbuf, (size_t)r->cnts[rb], recvbuf + r->disps[rb], 1);
+    }
+
+    // Allgather: the owner encodes its block once, the bytes travel unchanged
+    const int own = (r->me + 1) % n;
+    wire_encode(w->fmt, recvbuf + r->disps[own], (size_t)r->cnts[own], w->sbuf,
+                w->resid ? w->resid + r->disps[own] : NULL);
+    wire_decode(w->fmt, w->sbuf, (size_t)r->cnts[own], recvbuf + r->disps[own], 0);
+    for (int s = 0; s < n - 1; ++s) {
+        const int sb = (r->me + 1 - s + n) % n, rb = (r->me - s + n) % n;
+        MPI_Sendrecv(w->sbuf, (int)wire_bytes(w->fmt, (size_t)r->cnts[sb]), MPI_BYTE, r->right, TAG_RING,
+                     w->rbuf, (int)wire_bytes(w->fmt, (size_t)r->cnts[rb]), MPI_BYTE, r->left, TAG_RING,
+                     comm, MPI_STATUS_IGNORE);
+        wire_decode(w->fmt, w->rbuf, (size_t)r->cnts[rb], recvbuf + r->disps[rb], 0);
+        void *t = w->sbuf; w->sbuf = w->rbuf; w->rbuf = t;
+    }
+}
+
+/* ---------- Node-aware hierarchical allreduce over a shared-memory window ----------
+   Ranks on one node share a window laid out as
+       [ slot_0 | slot_1 | ... | slot_{L-1} | partial | result ]   (each count elements)
+   1) every local rank stores its input into its own slot;
+   2) local rank l combines slice l of all L slots into partial in one
+      multi-source pass (direct loads/stores);
+   3) the node leader runs the inter-node allreduce (k-ary tree or ring) on
+      partial -> result among the leaders;
+   4) every local rank copies result into its recvbuf.
+   The window stays under MPI_Win_lock_all for the plan's lifetime; each phase
+   boundary is MPI_Win_sync + node barrier.
+   MPI_BENCH_RANKS_PER_NODE=N fakes node boundaries (ranks [iN, iN+N) form a
+   "node") so the scheme can be exercised on a single machine.
+*/
+enum { HIER_INTER_TREE, HIER_INTER_RING };
+
+typedef struct {
+    int me, np;
+    int count;
+    MPI_Comm node_comm;         // ranks sharing the window
+    MPI_Comm leader_comm;       // local rank 0 of every node, MPI_COMM_NULL elsewhere
+    int local_rank, local_n;
+    int num_nodes;
+    int inter;                  // HIER_INTER_*
+    MPI_Win win;
+    void *slots, *partial, *result;
+    int slice_off, slice_len;   // my share of step 2
+    const void **srcs;          // slot slices handed to combine_n (size=local_n-1)
+    const RedSpec *red;
+    TreePlan tree;              // inter-node plans (leaders only)
+    RingPlan ring;
+} HierPlan;
+
+static int env_ranks_per_node(void) {
+    const char *e = getenv("MPI_BENCH_RANKS_PER_NODE");
+    if (!e || e[0] == '\0') return 0;
+    int v = atoi(e);
+    return (v >= 1) ? v : 0;
+}
+
+static void hier_plan_init(HierPlan *pl, int count, int inter, int fanout, int segment, int ring_chunk,
+                           const RedSpec *red, MPI_Comm comm)
+{
+    const size_t es = red->k.esize;
+    memset(pl, 0, sizeof(*pl));
+    MPI_Comm_rank(comm, &pl->me);
+    MPI_Comm_size(comm, &pl->np);
+    pl->count = count;
+    pl->inter = inter;
+    pl->red   = red;
+
+    const int fake_ppn = env_ranks_per_node();
+    if (fake_ppn > 0) MPI_Comm_split(comm, pl->me / fake_ppn, pl->me, &pl->node_comm);
+    else              MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, pl->me, MPI_INFO_NULL, &pl->node_comm);
+    MPI_Comm_rank(pl->node_comm, &pl->local_rank);
+    MPI_Comm_size(pl->node_comm, &pl->local_n);
+
+    MPI_Comm_split(comm, pl->local_rank == 0 ? 0 : MPI_UNDEFINED, pl->me, &pl->leader_comm);
+    int is_leader = (pl->local_rank == 0);
+    MPI_Allreduce(MPI_IN_PLACE, &is_leader, 1, MPI_INT, MPI_SUM, comm);
+    pl->num_nodes = is_leader;
+
+    // One contiguous segment owned by the leader; everyone maps it via shared_query
+    const size_t nelems = ((size_t)pl->local_n + 2) * (size_t)count;
+    MPI_Aint bytes = (pl->local_rank == 0) ? (MPI_Aint)(nelems * es) : 0;
+    void *base = NULL;
+    MPI_Win_allocate_shared(bytes, (int)es, MPI_INFO_NULL, pl->node_comm, &base, &pl->win);
+    MPI_Aint qsize; int qdisp;
+    MPI_Win_shared_query(pl->win, 0, &qsize, &qdisp, &base);
+    pl->slots   = base;
+    pl->partial = buf_at(base, (size_t)pl->local_n * (size_t)count, es);
+    pl->result  = buf_at(pl->partial, (size_t)count, es);
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, pl->win);
+
+    pl->slice_len = count / pl->local_n + (pl->local_rank < count % pl->local_n ? 1 : 0);
+    pl->slice_off = pl->local_rank * (count / pl->local_n)
+                  + (pl->local_rank < count % pl->local_n ? pl->local_rank : count % pl->local_n);
+    pl->srcs = (const void**)malloc((size_t)pl->local_n * sizeof(*pl->srcs));
+    if (!pl->srcs) { perror("malloc hier"); MPI_Abort(comm, 2); }
+
+    if (pl->leader_comm != MPI_COMM_NULL) {
+        if (inter == HIER_INTER_RING) ring_plan_init(&pl->ring, count, ring_chunk, red, pl->leader_comm);
+        else                          tree_plan_init(&pl->tree, fanout, count, segment, red, pl->leader_comm);
+    }
+}
+
+static void hier_plan_free(HierPlan *pl) {
+    if (pl->leader_comm != MPI_COMM_NULL) {
+        if (pl->inter == HIER_INTER_RING) ring_plan_free(&pl->ring);
+        else                              tree_plan_free(&pl->tree);
+        MPI_Comm_free(&pl->leader_comm);
+    }
+    MPI_Win_unlock_all(pl->win);
+    MPI_Win_free(&pl->win);
+    MPI_Comm_free(&pl->node_comm);
+    free(pl->srcs);
+    memset(pl, 0, sizeof(*pl));
+}
+
+/* Make this rank's stores visible node-wide and pick up everyone else's. */
+static inline void hier_sync(const HierPlan *pl) {
+    MPI_Win_sync(pl->win);
+    MPI_Barrier(pl->node_comm);
+    MPI_Win_sync(pl->win);
+}
+
+static void hier_allreduce(
+    const void *sendbuf, void *recvbuf, const HierPlan *pl, MPI_Comm comm)
+{
+    (void)comm;
+    const int count = pl->count;
+    const int L = pl->local_n;
+    const size_t es = pl->red->k.esize;
+
+    const void *in = (sendbuf == MPI_IN_PLACE) ? recvbuf : sendbuf;
+    memcpy(buf_at(pl->slots, (size_t)pl->local_rank * (size_t)count, es), in, (size_t)count * es);
+    hier_sync(pl);
+
+    // Intra-node reduce: my slice across every local slot, one pass
+    void *dst = buf_at(pl->partial, (size_t)pl->slice_off, es);
+    const void *s0 = cbuf_at(pl->slots, (size_t)pl->slice_off, es);
+    memcpy(dst, s0, (size_t)pl->slice_len * es);
+    for (int l = 1; l < L; ++l) pl->srcs[l - 1] = cbuf_at(s0, (size_t)l * (size_t)count, es);
+    if (L > 1) pl->red->k.combine_n(dst, pl->srcs, L - 1, (size_t)pl->slice_len);
+    hier_sync(pl);
+
+    // Inter-node among leaders
+    if (pl->leader_comm != MPI_COMM_NULL) {
+        if (pl->inter == HIER_INTER_RING) ring_allreduce(pl->partial, pl->result, &pl->ring, pl->leader_comm);
+        else                              tree_reduce_bcast(pl->partial, pl->result, &pl->tree, pl->leader_comm);
+    }
+    hier_sync(pl);
+
+    // Intra-node broadcast: read the result straight out of the window
+    memcpy(recvbuf, pl->result, (size_t)count * es);
+}
+
+/* ---------- compute kernel for overlap windows ---------- */
+
+static double overlap_scratch[256];
+
+/* Busy arithmetic for about `us` microseconds, with no MPI calls inside, so
+   the only progress a nonblocking collective gets is what the library makes
+   on its own. */
+static void compute_for_us(double us) {
+    if (us <= 0.0) return;
+    const double t_end = MPI_Wtime() + us * 1e-6;
+    do {
+        for (int i = 0; i < 256; ++i) overlap_scratch[i] = overlap_scratch[i] * 0.999 + 1.0;
+    } while (MPI_Wtime() < t_end);
+}
+
+/* ---------- bench driver ---------- */
+
+enum { ALGO_ALLREDUCE, ALGO_IALLREDUCE, ALGO_ALLREDUCE_INIT, ALGO_REDUCE_BCAST,
+       ALGO_TREE, ALGO_TREE_PERSIST, ALGO_TREE_NB, ALGO_TREE_ASYNC, ALGO_TREE_RMA, ALGO_RABENSEIFNER, ALGO_RECDBL, ALGO_RING,
+       ALGO_DBTREE, ALGO_MULTIROOT, ALGO_HIER, NUM_ALGOS };
+static const char *algo_names[NUM_ALGOS] = {
+    "allreduce", "iallreduce", "allreduce-init", "reduce-bcast",
+    "tree", "tree-persist", "tree-nb", "tree-async", "tree-rma", "rabenseifner", "recdbl", "ring", "dbtree", "multiroot", "hier" };
+
+/* Every algorithm's preallocated state; only the selected ones are initialised. */
+typedef struct {
+    TreePlan   tree;
+    TreePlan   tree_persist;    // bound to the bench buffers at init
+    TreePlan   tree_nb;         // tree_start/tree_test/tree_wait
+    TreePlan   tree_async;      // owned by engine's thread
+    TreeEngine engine;
+    RmaTreePlan tree_rma;
+    RsagPlan   rsag;            // also used by recursive doubling
+    RingPlan   ring;
+    TreeForest dbt;
+    TreeForest mroot;           // rebuilt for each --roots value
+    HierPlan   hier;
+    const RedSpec *red;         // element type/op shared by every plan (and the baseline)
+    int    me;
+    double overlap_us;          // iallreduce/tree-nb/tree-async: compute between start and wait
+#if MPI_VERSION >= 4
+    MPI_Request allreduce_init; // persistent collective, bound to the bench buffers
+#endif
+} AlgoPlans;
+
+/* --latency: per-iteration samples of the timed loop, reused by every row. */
+typedef struct {
+    double *mine;               // iters seconds on this rank
+    double *all;                // rank 0: np x iters, rank-major
+    double *worst;              // rank 0: per-iteration max over ranks
+    FILE   *dump;               // rank 0, --lat-dump (else NULL)
+} LatRec;
+
+typedef struct {
+    int  me, np;
+    int  count;
+    long iters, warmup;
+    int  checks;
+    int  inplace;               // call every algorithm with sendbuf = MPI_IN_PLACE
+    LatRec *lat;                // NULL unless --latency
+} BenchCfg;
+
+/* One line of the results table. */
+typedef struct {
+    char   label[128];
+    double secs;
+    long   sink;
+    lat_summary_t lat;          // rank 0, --latency
+} BenchRow;
+
+#define MAX_ROWS 64
+#define MAX_ROOTS_LIST 16
+#define MAX_DENSITIES 16
+
+/* sendbuf may be MPI_IN_PLACE for every algorithm. */
+static void run_algo(int algo, const void *sendbuf, void *recvbuf, AlgoPlans *ap, int count, MPI_Comm comm) {
+    switch (algo) {
+    case ALGO_TREE:         tree_reduce_bcast(sendbuf, recvbuf, &ap->tree, comm); break;
+    case ALGO_TREE_PERSIST: kary_tree_reduce_bcast_persistent(&ap->tree_persist); break;
+    case ALGO_TREE_NB:
+        tree_start(&ap->tree_nb, sendbuf, recvbuf, comm);
+        compute_for_us(ap->overlap_us);
+        tree_wait(&ap->tree_nb);
+        break;
+    case ALGO_TREE_RMA:     rma_tree_allreduce(sendbuf, recvbuf, &ap->tree_rma); break;
+    case ALGO_TREE_ASYNC:
+        tree_engine_post(&ap->engine, sendbuf, recvbuf);
+        compute_for_us(ap->overlap_us);
+        tree_engine_wait(&ap->engine);
+        break;
+    case ALGO_RABENSEIFNER: rabenseifner_allreduce(sendbuf, recvbuf, &ap->rsag, comm); break;
+    case ALGO_RECDBL:       recursive_doubling_allreduce(sendbuf, recvbuf, &ap->rsag, comm); break;
+    case ALGO_RING:         ring_allreduce(sendbuf, recvbuf, &ap->ring, comm); break;
+    case ALGO_DBTREE:       forest_allreduce(sendbuf, recvbuf, &ap->dbt, comm); break;
+    case ALGO_MULTIROOT:    forest_allreduce(sendbuf, recvbuf, &ap->mroot, comm); break;
+    case ALGO_HIER:         hier_allreduce(sendbuf, recvbuf, &ap->hier, comm); break;
+    case ALGO_IALLREDUCE: {
+        MPI_Request req;
+        MPI_Iallreduce(sendbuf, recvbuf, count, ap->red->type, ap->red->op, comm, &req);
+        compute_for_us(ap->overlap_us);
+        MPI_Wait(&req, MPI_STATUS_IGNORE);
+        break;
+    }
+#if MPI_VERSION >= 4
+    case ALGO_ALLREDUCE_INIT:
+        MPI_Start(&ap->allreduce_init);
+        MPI_Wait(&ap->allreduce_init, MPI_STATUS_IGNORE);
+        break;
+#endif
+    case ALGO_REDUCE_BCAST:
+        // In place is only legal at the root of MPI_Reduce; elsewhere the
+        // input is simply recvbuf (and the receive buffer is not significant).
+        if (sendbuf == MPI_IN_PLACE && ap->me != 0)
+            MPI_Reduce(recvbuf, NULL, count, ap->red->type, ap->red->op, 0, comm);
+        else
+            MPI_Reduce(sendbuf, recvbuf, count, ap->red->type, ap->red->op, 0, comm);
+        MPI_Bcast(recvbuf, count, ap->red->type, 0, comm);
+        break;
+    default:                MPI_Allreduce(sendbuf, recvbuf, count, ap->red->type, ap->red->op, comm); break;
+    }
+}
+
+static void algo_label(int algo, const AlgoPlans *ap, char *buf, size_t len) {
+    switch (algo) {
+    case ALGO_TREE:
+        if (ap->tree.segment)
+            snprintf(buf, len, "TreeReduce (k=%d%s, seg=%d x %d) + Bcast",
+                     ap->tree.fanout, tree_shape_suffix(&ap->tree), ap->tree.segment, ap->tree.num_segs);
+        else
+            snprintf(buf, len, "TreeReduce (k=%d%s) + Bcast", ap->tree.fanout, tree_shape_suffix(&ap->tree));
+        break;
+    case ALGO_TREE_PERSIST:
+        snprintf(buf, len, "TreeReduce persistent (k=%d%s) + Bcast", ap->tree_persist.fanout,
+                 tree_shape_suffix(&ap->tree_persist));
+        break;
+    case ALGO_TREE_NB:
+        if (ap->overlap_us > 0.0)
+            snprintf(buf, len, "Tree nonblocking (k=%d%s, +%.0f us compute)", ap->tree_nb.fanout,
+                     tree_shape_suffix(&ap->tree_nb), ap->overlap_us);
+        else
+            snprintf(buf, len, "TreeReduce nonblocking (k=%d%s) start+wait", ap->tree_nb.fanout,
+                     tree_shape_suffix(&ap->tree_nb));
+        break;
+    case ALGO_TREE_RMA:
+        snprintf(buf, len, "TreeReduce one-sided (k=%d, put+flag)", ap->tree_rma.t.fanout);
+        break;
+    case ALGO_TREE_ASYNC:
+        if (ap->overlap_us > 0.0)
+            snprintf(buf, len, "Tree async thread (k=%d%s, +%.0f us compute)", ap->tree_async.fanout,
+                     tree_shape_suffix(&ap->tree_async), ap->overlap_us);
+        else
+            snprintf(buf, len, "Tree async thread (k=%d%s) post+wait", ap->tree_async.fanout,
+                     tree_shape_suffix(&ap->tree_async));
+        break;
+    case ALGO_RABENSEIFNER: snprintf(buf, len, "Rabenseifner (RS+AG)"); break;
+    case ALGO_RECDBL:       snprintf(buf, len, "Recursive doubling"); break;
+    case ALGO_RING:         snprintf(buf, len, "Ring (RS+AG, chunk=%d)", ap->ring.chunk); break;
+    case ALGO_DBTREE:
+        snprintf(buf, len, "Double binary tree (seg=%d x %d)", ap->dbt.t[0].segment, ap->dbt.t[0].num_segs);
+        break;
+    case ALGO_MULTIROOT:
+        snprintf(buf, len, "Multi-root tree (R=%d, k=%d, seg=%d x %d)", ap->mroot.ntrees,
+                 ap->mroot.t[0].fanout, ap->mroot.t[0].segment, ap->mroot.t[0].num_segs);
+        break;
+    case ALGO_HIER:
+        snprintf(buf, len, "Hierarchical shm (nodes=%d, inter=%s)", ap->hier.num_nodes,
+                 ap->hier.inter == HIER_INTER_RING ? "ring" : "tree");
+        break;
+    case ALGO_IALLREDUCE:
+        if (ap->overlap_us > 0.0) snprintf(buf, len, "MPI_Iallreduce (+%.0f us compute)", ap->overlap_us);
+        else                      snprintf(buf, len, "MPI_Iallreduce + Wait");
+        break;
+    case ALGO_ALLREDUCE_INIT: snprintf(buf, len, "MPI_Allreduce_init + Start/Wait"); break;
+    case ALGO_REDUCE_BCAST:   snprintf(buf, len, "MPI_Reduce + MPI_Bcast"); break;
+    default:                snprintf(buf, len, "MPI_Allreduce"); break;
+    }
+}
+
+/* Comma-separated algorithm names -> bitmask (0 on unknown name). */
+static unsigned parse_algo_list(const char *list) {
+    unsigned mask = 0;
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", list);
+    for (char *tok = strtok(buf, ","); tok; tok = strtok(NULL, ",")) {
+        int found = 0;
+        for (int a = 0; a < NUM_ALGOS; ++a)
+            if (!strcmp(tok, algo_names[a])) { mask |= 1u << a; found = 1; }
+        if (!found) return 0;
+    }
+    return mask;
+}
+
+/* Comma-separated positive ints -> out[]; returns how many, or 0 on a bad
+   entry (not all digits, <= 0, > INT_MAX), more than max entries, or a list
+   too long for buf -- never a silently shortened list. */
+static int parse_int_list(const char *list, int *out, int max) {
+    int n = 0;
+    char buf[256];
+    if (snprintf(buf, sizeof(buf), "%s", list) >= (int)sizeof(buf)) return 0;
+    for (char *tok = strtok(buf, ","); tok; tok = strtok(NULL, ",")) {
+        char *end;
+        long v = strtol(tok, &end, 10);
+        if (n == max || *end != '\0' || v <= 0 || v > INT_MAX) return 0;
+        out[n++] = (int)v;
+    }
+    return n;
+}
+
+static int parse_double_list(const char *list, double *out, int max) {
+    int n = 0;
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", list);
+    for (char *tok = strtok(buf, ","); tok && n < max; tok = strtok(NULL, ",")) {
+        double v = strtod(tok, NULL);
+        if (v <= 0.0 || v > 100.0) return 0;
+        out[n++] = v;
+    }
+    return n;
+}
+
+/* bf16,fp16,int8 -> WIRE_*; 0 on an unknown name. */
+static int parse_wire_list(const char *list, int *out, int max) {
+    int n = 0;
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", list);
+    for (char *tok = strtok(buf, ","); tok && n < max; tok = strtok(NULL, ",")) {
+        int f = WIRE_BF16;
+        while (f < WIRE_NFMTS && strcmp(tok, wire_names[f])) ++f;
+        if (f == WIRE_NFMTS) return 0;
+        out[n++] = f;
+    }
+    return n;
+}
+
+/* Iteration k's input.  int64 is value_for_iter(k, me) + j as always; the other
+   types wrap it into a small range so float sums stay exact (and therefore
+   order-independent) and int32 sums cannot overflow. */
+static void fill_input(void *buf, int count, long k, int me, ck_dtype_t dt) {
+    const long v0 = value_for_iter(k, me);
+    switch (dt) {
+    case DT_INT32:  for (int j = 0; j < count; ++j) ((int32_t*)buf)[j] = (int32_t)((v0 + j) & 0xffff); break;
+    case DT_INT64:  for (int j = 0; j < count; ++j) ((int64_t*)buf)[j] = v0 + j; break;
+    case DT_FLOAT:  for (int j = 0; j < count; ++j) ((float*)buf)[j]   = (float)((v0 + j) & 0x3ff); break;
+    default:        for (int j = 0; j < count; ++j) ((double*)buf)[j]  = (double)((v0 + j) & 0x3ff); break;
+    }
+}
+
+static double elem_as_double(const void *buf, int j, ck_dtype_t dt) {
+    switch (dt) {
+    case DT_INT32:  return (double)((const int32_t*)buf)[j];
+    case DT_INT64:  return (double)((const int64_t*)buf)[j];
+    case DT_FLOAT:  return (double)((const float*)buf)[j];
+    default:        return ((const double*)buf)[j];
+    }
+}
+
+/* Folded into the sink so the result is consumed. */
+static long checksum(const void *buf, int count, ck_dtype_t dt) {
+    long s = 0;
+    for (int j = 0; j < count; ++j) s += (long)elem_as_double(buf, j, dt);
+    return s;
+}
+
+/* Bitwise compare: every op here is exact on the bench inputs. */
+static void check_against_allreduce(int algo, const void *out, const void *ref, int count, const RedSpec *red,
+                                    int me, const char *when)
+{
+    const size_t es = red->k.esize;
+    if (!memcmp(out, ref, (size_t)count * es)) return;
+    for (int j = 0; j < count; ++j) {
+        if (memcmp(cbuf_at(out, (size_t)j, es), cbuf_at(ref, (size_t)j, es), es)) {
+            fprintf(stderr, "%s mismatch rank %d at elem %d: %s=%g allreduce=%g\n",
+                    when, me, j, algo_names[algo],
+                    elem_as_double(out, j, red->k.dtype), elem_as_double(ref, j, red->k.dtype));
+            break;
+        }
+    }
+    MPI_Abort(MPI_COMM_WORLD, 4);
+}
+
+/* One call on iteration k's input.  In-place runs generate the input
+   directly in out, as an application reducing its own buffer would. */
+static inline void run_iter(int algo, AlgoPlans *ap, const BenchCfg *cfg, void *my, void *out,
+                            long k, MPI_Comm comm)
+{
+    if (cfg->inplace) {
+        fill_input(out, cfg->count, k, cfg->me, ap->red->k.dtype);
+        run_algo(algo, MPI_IN_PLACE, out, ap, cfg->count, comm);
+    } else {
+        fill_input(my, cfg->count, k, cfg->me, ap->red->k.dtype);
+        run_algo(algo, my, out, ap, cfg->count, comm);
+    }
+}
+
+/* Timed loop of one algorithm; returns elapsed seconds on this rank.  With
+   --latency each iteration's duration goes to cfg->lat->mine as well; the
+   iterations are back to back, so the stamps cost one MPI_Wtime each. */
+static double time_algo_loop(int algo, AlgoPlans *ap, const BenchCfg *cfg, void *my, void *out,
+                             volatile long *sink, MPI_Comm comm)
+{
+    double *lat = cfg->lat ? cfg->lat->mine : NULL;
+    MPI_Barrier(comm);
+    double t0 = MPI_Wtime(), prev = t0;
+    for (long k = 0; k < cfg->iters; ++k) {
+        run_iter(algo, ap, cfg, my, out, k, comm);
+        *sink += checksum(out, cfg->count, ap->red->k.dtype); // prevent over-optimization
+        if (lat) {
+            double t = MPI_Wtime();
+            lat[k] = t - prev;
+            prev = t;
+        }
+    }
+    return (lat ? prev : MPI_Wtime()) - t0;
+}
+
+/* Gather every rank's samples to rank 0, summarise the per-iteration
+   worst rank into row->lat and append the raw samples to --lat-dump. */
+static void lat_collect(const BenchCfg *cfg, BenchRow *row, MPI_Comm comm) {
+    LatRec *lr = cfg->lat;
+    MPI_Gather(lr->mine, (int)cfg->iters, MPI_DOUBLE, lr->all, (int)cfg->iters, MPI_DOUBLE, 0, comm);
+    if (cfg->me != 0) return;
+    lat_worst(lr->all, cfg->np, cfg->iters, lr->worst);
+    if (lat_summarize(lr->worst, cfg->iters, &row->lat) != 0) {
+        perror("malloc latency sort");
+        MPI_Abort(comm, 3);
+    }
+    if (lr->dump && lat_dump(lr->dump, row->label, cfg->np, cfg->iters, lr->all) != 0) {
+        perror("write --lat-dump");
+        MPI_Abort(comm, 3);
+    }
+}
+
+/* Warmup (+ optional check vs MPI_Allreduce), timed loop, final spot-check.
+   A label already in row (a variant of algo) is kept. */
+static void bench_algo(int algo, AlgoPlans *ap, const BenchCfg *cfg,
+                       void *my, void *out, void *ref, BenchRow *row, MPI_Comm comm)
+{
+    const int count = cfg->count;
+    const RedSpec *red = ap->red;
+
+    for (long k = 0; k < cfg->warmup; ++k) {
+        run_iter(algo, ap, cfg, my, out, k, comm);
+
+        if (cfg->checks && algo != ALGO_ALLREDUCE) {
+            fill_input(my, count, k, cfg->me, red->k.dtype);
+            MPI_Allreduce(my, ref, count, red->type, red->op, comm);
+            check_against_allreduce(algo, out, ref, count, red, cfg->me, "Warmup");
+        }
+    }
+
+    volatile long sink = 0;
+    row->secs = time_algo_loop(algo, ap, cfg, my, out, &sink, comm);
+    row->sink = sink;
+    if (!row->label[0]) algo_label(algo, ap, row->label, sizeof(row->label));
+    if (cfg->lat) lat_collect(cfg, row, comm);
+
+    // Final correctness spot-check (cheap scalar compare)
+    if (cfg->checks && algo != ALGO_ALLREDUCE) {
+        run_iter(algo, ap, cfg, my, out, cfg->iters, comm);
+        fill_input(my, count, cfg->iters, cfg->me, red->k.dtype);
+        MPI_Allreduce(my, ref, count, red->type, red->op, comm);
+
+        long t_scalar = checksum(out, count, red->k.dtype), a_scalar = checksum(ref, count, red->k.dtype);
+        if (cfg->me == 0 && t_scalar != a_scalar) {
+            fprintf(stderr, "[CHECK] mismatch: %s=%ld allreduce=%ld\n", algo_names[algo], t_scalar, a_scalar);
+        }
+    }
+}
+
+/* ---------- overlap study (--overlap-us) ----------
+   For a nonblocking allreduce (tree-nb, tree-async or iallreduce), time per iteration:
+     comm:      start; wait
+     plain:     start; compute U us; wait
+     progress:  start; compute U us in --progress-us slices, testing after each; wait
+   and report the fraction of the communication hidden behind the compute,
+   (comm + U - overlapped) / comm, clamped to [0, 1].  For tree-async the
+   progress thread's CPU time over the overlapped runs is reported too.
+*/
+typedef struct {
+    int algo;                   // ALGO_TREE_NB, ALGO_TREE_ASYNC or ALGO_IALLREDUCE
+    AlgoPlans *ap;
+    MPI_Request req;            // iallreduce
+} NbOp;
+
+static void nb_start(NbOp *op, const void *sendbuf, void *recvbuf, int count, MPI_Comm comm) {
+    if (op->algo == ALGO_TREE_NB)         tree_start(&op->ap->tree_nb, sendbuf, recvbuf, comm);
+    else if (op->algo == ALGO_TREE_ASYNC) tree_engine_post(&op->ap->engine, sendbuf, recvbuf);
+    else MPI_Iallreduce(sendbuf, recvbuf, count, op->ap->red->type, op->ap->red->op, comm, &op->req);
+}
+
+static int nb_test(NbOp *op) {
+    if (op->algo == ALGO_TREE_NB)    return tree_test(&op->ap->tree_nb);
+    if (op->algo == ALGO_TREE_ASYNC) return tree_engine_done(&op->ap->engine);
+    int done = 0;
+    MPI_Test(&op->req, &done, MPI_STATUS_IGNORE);
+    return done;
+}
+
+static void nb_wait(NbOp *op) {
+    if (op->algo == ALGO_TREE_NB)         tree_wait(&op->ap->tree_nb);
+    else if (op->algo == ALGO_TREE_ASYNC) tree_engine_wait(&op->ap->engine);
+    else MPI_Wait(&op->req, MPI_STATUS_IGNORE);
+}
+
+enum { OVL_COMM_ONLY, OVL_PLAIN, OVL_PROGRESS };
+
+/* Average seconds per iteration on this rank. */
+static double time_overlap(NbOp *op, const BenchCfg *cfg, void *my, void *out, int mode,
+                           double compute_us, double progress_us, MPI_Comm comm)
+{
+    const ck_dtype_t dt = op->ap->red->k.dtype;
+    MPI_Barrier(comm);
+    double t0 = MPI_Wtime();
+    for (long k = 0; k < cfg->iters; ++k) {
+        fill_input(cfg->inplace ? out : my, cfg->count, k, cfg->me, dt);
+        nb_start(op, cfg->inplace ? MPI_IN_PLACE : my, out, cfg->count, comm);
+        if (mode == OVL_PLAIN) {
+            compute_for_us(compute_us);
+        } else if (mode == OVL_PROGRESS) {
+            for (double left = compute_us; left > 0.0; left -= progress_us) {
+                compute_for_us(left < progress_us ? left : progress_us);
+                nb_test(op);
+            }
+        }
+        nb_wait(op);
+    }
+    return (MPI_Wtime() - t0) / (double)cfg->iters;
+}
+
+static double hidden_fraction(double comm_s, double comp_s, double total_s) {
+    if (comm_s <= 0.0) return 0.0;
+    double h = (comm_s + comp_s - total_s) / comm_s;
+    return h < 0.0 ? 0.0 : (h > 1.0 ? 1.0 : h);
+}
+
+static void overlap_study(int algo, AlgoPlans *ap, const BenchCfg *cfg, void *my, void *out,
+                          double compute_us, double progress_us, MPI_Comm comm)
+{
+    NbOp op = { algo, ap, MPI_REQUEST_NULL };
+    char label[128];
+
+    double comp = MPI_Wtime();
+    for (long k = 0; k < cfg->iters; ++k) compute_for_us(compute_us);
+    comp = (MPI_Wtime() - comp) / (double)cfg->iters;
+
+    const double t_comm  = time_overlap(&op, cfg, my, out, OVL_COMM_ONLY, compute_us, progress_us, comm);
+    const double cpu0    = (algo == ALGO_TREE_ASYNC) ? tree_engine_cpu_sec(&ap->engine) : 0.0;
+    const double t_plain = time_overlap(&op, cfg, my, out, OVL_PLAIN, compute_us, progress_us, comm);
+    const double cpu1    = (algo == ALGO_TREE_ASYNC) ? tree_engine_cpu_sec(&ap->engine) : 0.0;
+    const double t_prog  = time_overlap(&op, cfg, my, out, OVL_PROGRESS, compute_us, progress_us, comm);
+
+    if (cfg->me == 0) {
+        if (algo == ALGO_TREE_NB)         snprintf(label, sizeof(label), "TreeReduce nonblocking (k=%d)", ap->tree_nb.fanout);
+        else if (algo == ALGO_TREE_ASYNC) snprintf(label, sizeof(label), "Tree async thread (k=%d)", ap->tree_async.fanout);
+        else                              snprintf(label, sizeof(label), "MPI_Iallreduce");
+        printf("  %-32s : comm %.2f us, compute %.2f us | overlapped %.2f us, hidden %.1f%%"
+               " | with progress %.2f us, hidden %.1f%%\n",
+               label, 1e6 * t_comm, 1e6 * comp,
+               1e6 * t_plain, 100.0 * hidden_fraction(t_comm, comp, t_plain),
+               1e6 * t_prog,  100.0 * hidden_fraction(t_comm, comp, t_prog));
+        if (algo == ALGO_TREE_ASYNC)
+            printf("  %-32s   progress thread CPU %.2f us/iter while overlapped (the extra core)\n", "",
+                   1e6 * (cpu1 - cpu0) / (double)cfg->iters);
+    }
+}
+
+/* ---------- fusion study (--fuse N) ----------
+   Each step issues N independent allreduces of --count elements: reduction i
+   runs --op for even i and max for odd i, so a fused message carries two
+   typed runs.  Timed per step: N x MPI_Allreduce, N x the tree (unfused),
+   and N fuse_enqueue + one fuse_flush (more if --fuse-bytes is exceeded).
+*/
+enum { FUSE_ALLREDUCE, FUSE_TREE, FUSE_FUSED, FUSE_NMODES };
+
+typedef struct {
+    int      n;                 // reductions per step
+    RedSpec  red[2];            // even / odd reductions
+    TreePlan tree[2];           // unfused tree, one plan per op
+    FuseQueue q;
+    void    *in, *out, *ref;    // n * count elements each
+} FuseStudy;
+
+static void fusion_step(int mode, FuseStudy *fs, const BenchCfg *cfg, long k, MPI_Comm comm) {
+    const size_t es = fs->red[0].k.esize;
+    const size_t stride = (size_t)cfg->count * es;
+    for (int i = 0; i < fs->n; ++i)
+        fill_input((char*)(cfg->inplace ? fs->out : fs->in) + (size_t)i * stride, cfg->count, k + i, cfg->me,
+                   fs->red[0].k.dtype);
+
+    for (int i = 0; i < fs->n; ++i) {
+        const RedSpec *r = &fs->red[i & 1];
+        const void *send = cfg->inplace ? MPI_IN_PLACE : (const char*)fs->in + (size_t)i * stride;
+        void *recv = (char*)fs->out + (size_t)i * stride;
+        switch (mode) {
+        case FUSE_ALLREDUCE: MPI_Allreduce(send, recv, cfg->count, r->type, r->op, comm); break;
+        case FUSE_TREE:      tree_reduce_bcast(send, recv, &fs->tree[i & 1], comm); break;
+        default:
+            if (fuse_enqueue(&fs->q, send, recv, cfg->count, r->k.dtype, r->k.op) != 0)
+                tree_reduce_bcast(send, recv, &fs->tree[i & 1], comm);   // too big to fuse
+            break;
+        }
+    }
+    if (mode == FUSE_FUSED) fuse_flush(&fs->q);
+}
+
+static void fusion_check(FuseStudy *fs, const BenchCfg *cfg, long k, int mode, MPI_Comm comm) {
+    const size_t es = fs->red[0].k.esize;
+    const size_t stride = (size_t)cfg->count * es;
+    for (int i = 0; i < fs->n; ++i) {
+        const RedSpec *r = &fs->red[i & 1];
+        void *in = (char*)fs->in + (size_t)i * stride, *ref = (char*)fs->ref + (size_t)i * stride;
+        fill_input(in, cfg->count, k + i, cfg->me, r->k.dtype);
+        MPI_Allreduce(in, ref, cfg->count, r->type, r->op, comm);
+    }
+    if (!memcmp(fs->out, fs->ref, (size_t)fs->n * stride)) return;
+    for (int i = 0; i < fs->n; ++i) {
+        if (memcmp((char*)fs->out + (size_t)i * stride, (char*)fs->ref + (size_t)i * stride, stride)) {
+            fprintf(stderr, "Fusion mismatch rank %d, %s, reduction %d of step %ld\n",
+                    cfg->me, mode == FUSE_FUSED ? "fused" : "unfused tree", i, k);
+            break;
+        }
+    }
+    MPI_Abort(comm, 4);
+}
+
+static void fusion_study(int n, size_t capacity, int fanout, const RedSpec *red, const BenchCfg *cfg,
+                         MPI_Comm comm)
+{
+    FuseStudy fs;
+    memset(&fs, 0, sizeof(fs));
+    fs.n = n;
+    fs.red[0] = *red;
+    red_spec_init(&fs.red[1], red->k.dtype, OP_MAX);
+    for (int h = 0; h < 2; ++h) tree_plan_init(&fs.tree[h], fanout, cfg->count, 0, &fs.red[h], comm);
+    fuse_init(&fs.q, fanout, capacity, n, comm);
+    const size_t bytes = (size_t)n * (size_t)cfg->count * red->k.esize;
+    fs.in  = malloc(bytes);
+    fs.out = malloc(bytes);
+    fs.ref = malloc(bytes);
+    if (!fs.in || !fs.out || !fs.ref) { perror("malloc fusion buffers"); MPI_Abort(comm, 3); }
+
+    static const char *mode_labels[FUSE_NMODES] = { "N x MPI_Allreduce", "N x TreeReduce (unfused)", "Fused TreeReduce" };
+    double secs[FUSE_NMODES];
+    long sink[FUSE_NMODES];
+    long flushes = 0;
+    for (int mode = 0; mode < FUSE_NMODES; ++mode) {
+        for (long k = 0; k < cfg->warmup; ++k) {
+            fusion_step(mode, &fs, cfg, k, comm);
+            if (cfg->checks && mode != FUSE_ALLREDUCE) fusion_check(&fs, cfg, k, mode, comm);
+        }
+        sink[mode] = 0;
+        const long f0 = fs.q.flushes;
+        MPI_Barrier(comm);
+        double t0 = MPI_Wtime();
+        for (long k = 0; k < cfg->iters; ++k) {
+            fusion_step(mode, &fs, cfg, k, comm);
+            sink[mode] += checksum(fs.out, n * cfg->count, red->k.dtype);
+        }
+        secs[mode] = MPI_Wtime() - t0;
+        if (mode == FUSE_FUSED) flushes = fs.q.flushes - f0;
+    }
+
+    if (cfg->me == 0) {
+        printf("\nFusion (N=%d reductions of %d x %s per step, ops %s/max, flush at %zu bytes):\n",
+               n, cfg->count, ck_dtype_names[red->k.dtype], ck_op_names[red->k.op], fs.q.capacity);
+        for (int mode = 0; mode < FUSE_NMODES; ++mode) {
+            const double us = 1e6 * secs[mode] / (double)cfg->iters;
+            printf("  %-44s : %.2f us/step  %.3f us/reduction", mode_labels[mode], us, us / (double)n);
+            if (mode == FUSE_FUSED)
+                printf("  (%.2f flushes/step; unfused tree / this = %.2fx, Allreduce / this = %.2fx)",
+                       (double)flushes / (double)cfg->iters,
+                       (secs[mode] > 0.0) ? secs[FUSE_TREE] / secs[mode] : 0.0,
+                       (secs[mode] > 0.0) ? secs[FUSE_ALLREDUCE] / secs[mode] : 0.0);
+            printf("\n");
+        }
+        printf("  (accumulators) %ld %ld %ld\n", sink[0], sink[1], sink[2]);
+        fflush(stdout);
+    }
+
+    free(fs.ref); free(fs.out); free(fs.in);
+    fuse_free(&fs.q);
+    for (int h = 0; h < 2; ++h) tree_plan_free(&fs.tree[h]);
+}
+
+/* ---------- sparse study (--sparse) ----------
+   For each density d (percent of count), every rank contributes d*count
+   nonzeros at pseudo-random indices (SPARSE_VARIANTS input sets, rotated per
+   iteration and generated before timing).  Timed: the sparse tree on the
+   pair lists, the dense tree and MPI_Allreduce on the same vectors as dense
+   arrays.  Wire bytes are summed over ranks and compared with the dense
+   tree's 2*(np-1)*count elements.
+*/
+#define SPARSE_VARIANTS 2
+
+static inline uint64_t sparse_mix(uint64_t x) {
+    x ^= x >> 33; x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33; x *= 0xc4ceb9fe1a85ec53ULL;
+    return x ^ (x >> 33);
+}
+
+static void store_small(void *buf, size_t j, ck_dtype_t dt, long v) {
+    switch (dt) {
+    case DT_INT32:  ((int32_t*)buf)[j] = (int32_t)v; break;
+    case DT_INT64:  ((int64_t*)buf)[j] = v; break;
+    case DT_FLOAT:  ((float*)buf)[j]   = (float)v; break;
+    default:        ((double*)buf)[j]  = (double)v; break;
+    }
+}
+
+/* Variant v of this rank's input at the given density, as a pair list and
+   as the dense array.  Values are small nonzero integers (exact in float). */
+static void sparse_make_input(SparseVec *sv, void *dense, int count, double density_pct, int me, int v,
+                              ck_dtype_t dt)
+{
+    const size_t es = ck_dtype_size[dt];
+    const uint64_t cut = (density_pct >= 100.0) ? UINT64_MAX
+                       : (uint64_t)(density_pct / 100.0 * 18446744073709551615.0);
+    memset(dense, 0, (size_t)count * es);
+    sv->nnz = 0;
+    for (int j = 0; j < count; ++j) {
+        const uint64_t h = sparse_mix(((uint64_t)j << 24) ^ ((uint64_t)me << 4) ^ (uint64_t)v);
+        if (h >= cut) continue;
+        const long x = 1 + (long)(h & 0xff);
+        store_small(dense, (size_t)j, dt, x);
+        sv->idx[sv->nnz] = j;
+        store_small(sv->val, (size_t)sv->nnz, dt, x);
+        sv->nnz++;
+    }
+}
+
+enum { SPARSE_TREE, SPARSE_DENSE_TREE, SPARSE_ALLREDUCE, SPARSE_NMODES };
+
+static void sparse_study(const double *densities, int nd, double dense_at, int fanout, const RedSpec *red,
+                         const BenchCfg *cfg, MPI_Comm comm)
+{
+    if (red->k.op != OP_SUM && red->k.op != OP_BOR) {
+        if (cfg->me == 0) printf("\nSparse: needs an op with zero identity (sum, bor); skipped\n");
+        return;
+    }
+    const int count = cfg->count;
+    const size_t es = red->k.esize;
+    SparsePlan sp;
+    TreePlan dense_tree;
+    sparse_plan_init(&sp, fanout, count, dense_at, red, comm);
+    tree_plan_init(&dense_tree, fanout, count, 0, red, comm);
+
+    SparseVec sv[SPARSE_VARIANTS];
+    void *dense[SPARSE_VARIANTS];
+    void *out = malloc((size_t)count * es), *ref = malloc((size_t)count * es);
+    int ok = out && ref;
+    for (int v = 0; v < SPARSE_VARIANTS; ++v) {
+        sv[v].idx = (int32_t*)malloc((size_t)count * sizeof(int32_t));
+        sv[v].val = malloc((size_t)count * es);
+        dense[v]  = malloc((size_t)count * es);
+        ok = ok && sv[v].idx && sv[v].val && dense[v];
+    }
+    if (!ok) { perror("malloc sparse study"); MPI_Abort(comm, 3); }
+
+    if (cfg->me == 0)
+        printf("\nSparse (count=%d x %s, op=%s, fanout=%d, list goes dense above %.1f%% of count):\n",
+               count, ck_dtype_names[red->k.dtype], ck_op_names[red->k.op], sp.t.fanout, 100.0 * dense_at);
+
+    for (int d = 0; d < nd; ++d) {
+        for (int v = 0; v < SPARSE_VARIANTS; ++v)
+            sparse_make_input(&sv[v], dense[v], count, densities[d], cfg->me, v, red->k.dtype);
+
+        if (cfg->checks) {
+            for (int v = 0; v < SPARSE_VARIANTS; ++v) {
+                sparse_tree_allreduce(&sp, &sv[v], out, comm);
+                MPI_Allreduce(dense[v], ref, count, red->type, red->op, comm);
+                if (memcmp(out, ref, (size_t)count * es)) {
+                    fprintf(stderr, "Sparse mismatch rank %d, density %g%%, variant %d\n", cfg->me, densities[d], v);
+                    MPI_Abort(comm, 4);
+                }
+            }
+        }
+
+        double secs[SPARSE_NMODES];
+        long sink = 0, bytes = 0;
+        for (int mode = 0; mode < SPARSE_NMODES; ++mode) {
+            for (long k = -cfg->warmup; k < cfg->iters; ++k) {
+                if (k == 0) {
+                    MPI_Barrier(comm);
+                    secs[mode] = MPI_Wtime();
+                    sp.bytes_sent = 0;
+                }
+                const int v = (int)((k + cfg->warmup) % SPARSE_VARIANTS);
+                switch (mode) {
+                case SPARSE_TREE:       sparse_tree_allreduce(&sp, &sv[v], out, comm); break;
+                case SPARSE_DENSE_TREE: tree_reduce_bcast(dense[v], out, &dense_tree, comm); break;
+                default:                MPI_Allreduce(dense[v], out, count, red->type, red->op, comm); break;
+                }
+                sink += (long)elem_as_double(out, (int)(k & 0xff) % count, red->k.dtype);
+            }
+            secs[mode] = MPI_Wtime() - secs[mode];
+            if (mode == SPARSE_TREE) bytes = sp.bytes_sent;
+        }
+
+        long my_nnz = sv[0].nnz, nnz_sum = 0, bytes_sum = 0;
+        MPI_Reduce(&my_nnz, &nnz_sum, 1, MPI_LONG, MPI_SUM, 0, comm);
+        MPI_Reduce(&bytes, &bytes_sum, 1, MPI_LONG, MPI_SUM, 0, comm);
+        if (cfg->me == 0) {
+            const double it = (double)cfg->iters;
+            const double dense_wire = 2.0 * (double)(cfg->np - 1) * (double)count * (double)es;
+            const double wire_pct = dense_wire > 0.0 ? 100.0 * (double)bytes_sum / it / dense_wire : 0.0;
+            printf("  density %6.2f%% (nnz/rank %ld): sparse %.2f us (wire %.1f%% of dense) | dense tree %.2f us"
+                   " | MPI_Allreduce %.2f us | dense tree / sparse = %.2fx, Allreduce / sparse = %.2fx  (sink %ld)\n",
+                   densities[d], nnz_sum / cfg->np, 1e6 * secs[SPARSE_TREE] / it, wire_pct,
+                   1e6 * secs[SPARSE_DENSE_TREE] / it, 1e6 * secs[SPARSE_ALLREDUCE] / it,
+                   secs[SPARSE_TREE] > 0.0 ? secs[SPARSE_DENSE_TREE] / secs[SPARSE_TREE] : 0.0,
+                   secs[SPARSE_TREE] > 0.0 ? secs[SPARSE_ALLREDUCE] / secs[SPARSE_TREE] : 0.0, sink);
+            fflush(stdout);
+        }
+    }
+
+    for (int v = 0; v < SPARSE_VARIANTS; ++v) { free(dense[v]); free(sv[v].val); free(sv[v].idx); }
+    free(ref); free(out);
+    tree_plan_free(&dense_tree);
+    sparse_plan_free(&sp);
+}
+
+/* ---------- reproducibility study (--repro S) ----------
+   S global summands per element of a count-double vector, dealt round-robin
+   to the ranks (summand s lives on rank s mod np), with magnitudes spread
+   over 2^-32..2^31 and both signs so that grouping changes the rounding.
+   Plain: local sum, then the double-sum tree; repro: repro_sum.  Both run
+   at several fanouts; the result hash must not depend on the fanout (or on
+   np: compare the hashes of runs with different -np).
+*/
+static const int repro_fanouts[] = { 2, 3, 4, 8 };
+#define REPRO_NFANOUTS ((int)(sizeof(repro_fanouts) / sizeof(repro_fanouts[0])))
+
+static double repro_summand(int j, long s) {
+    const uint64_t h = sparse_mix(((uint64_t)j << 32) ^ (uint64_t)s ^ 0x5eedULL);
+    const double m = (double)(h >> 11) * 0x1p-53;
+    return ldexp((h & 0x400) ? -m : m, (int)(h & 0x3f) - 32);
+}
+
+static uint64_t fnv1a(const void *p, size_t n) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < n; ++i) { h ^= ((const unsigned char*)p)[i]; h *= 0x100000001b3ULL; }
+    return h;
+}
+
+static void repro_study(int nsum_global, const BenchCfg *cfg, MPI_Comm comm) {
+    const int count = cfg->count;
+    const int nloc = (nsum_global - cfg->me + cfg->np - 1) / cfg->np;   // my summands
+    double *summands = (double*)malloc(((size_t)(nloc ? nloc : 1)) * (size_t)count * sizeof(double));
+    double *out = (double*)malloc((size_t)count * sizeof(double));
+    if (!summands || !out) { perror("malloc repro study"); MPI_Abort(comm, 3); }
+    for (int s = 0; s < nloc; ++s)
+        for (int j = 0; j < count; ++j)
+            summands[(size_t)s * (size_t)count + j] = repro_summand(j, (long)cfg->me + (long)s * cfg->np);
+
+    RedSpec dsum;
+    red_spec_init(&dsum, DT_DOUBLE, OP_SUM);
+    if (cfg->me == 0)
+        printf("\nReproducible sum (count=%d doubles, %d summands per element over %d ranks, %d x %d-bit bins):\n",
+               count, nsum_global, cfg->np, REPRO_BINS, REPRO_BIN_BITS);
+
+    uint64_t hash[2][REPRO_NFANOUTS];
+    double secs[2][REPRO_NFANOUTS];
+    for (int f = 0; f < REPRO_NFANOUTS; ++f) {
+        TreePlan plain;
+        ReproPlan rp;
+        tree_plan_init(&plain, repro_fanouts[f], count, 0, &dsum, comm);
+        repro_plan_init(&rp, repro_fanouts[f], count, comm);
+        for (int mode = 0; mode < 2; ++mode) {
+            for (long k = -cfg->warmup; k < cfg->iters; ++k) {
+                if (k == 0) { MPI_Barrier(comm); secs[mode][f] = MPI_Wtime(); }
+                if (mode == 0) {
+                    memset(out, 0, (size_t)count * sizeof(double));
+                    for (int s = 0; s < nloc; ++s)
+                        for (int j = 0; j < count; ++j) out[j] += summands[(size_t)s * (size_t)count + j];
+                    tree_reduce_bcast(MPI_IN_PLACE, out, &plain, comm);
+                } else {
+                    repro_sum(&rp, summands, nloc, out, comm);
+                }
+            }
+            secs[mode][f] = MPI_Wtime() - secs[mode][f];
+            hash[mode][f] = fnv1a(out, (size_t)count * sizeof(double));
+            if (cfg->checks) {
+                // Every rank must hold the same bits
+                uint64_t h0 = hash[mode][f];
+                MPI_Bcast(&h0, 1, MPI_UINT64_T, 0, comm);
+                if (h0 != hash[mode][f]) {
+                    fprintf(stderr, "Repro mismatch rank %d: result differs from rank 0 (fanout %d)\n",
+                            cfg->me, repro_fanouts[f]);
+                    MPI_Abort(comm, 4);
+                }
+            }
+        }
+        repro_plan_free(&rp);
+        tree_plan_free(&plain);
+    }
+
+    if (cfg->me == 0) {
+        static const char *mode_names[2] = { "plain double tree", "reproducible tree" };
+        int distinct[2] = { 1, 1 };
+        for (int mode = 0; mode < 2; ++mode) {
+            for (int f = 0; f < REPRO_NFANOUTS; ++f) {
+                char label[64];
+                snprintf(label, sizeof(label), "%s (k=%d)", mode_names[mode], repro_fanouts[f]);
+                const double us = 1e6 * secs[mode][f] / (double)cfg->iters;
+                printf("  %-44s : %.2f us/iter  %.3f GB/s  hash %016llx\n", label, us,
+                       us > 0.0 ? (double)count * sizeof(double) / (us * 1e3) : 0.0,
+                       (unsigned long long)hash[mode][f]);
+                int seen = 0;
+                for (int g = 0; g < f; ++g) seen |= (hash[mode][g] == hash[mode][f]);
+                if (f > 0 && !seen) distinct[mode]++;
+            }
+        }
+        printf("  Distinct results across fanouts      : plain %d, reproducible %d (expect 1)\n",
+               distinct[0], distinct[1]);
+        char label[64];
+        snprintf(label, sizeof(label), "Reproducibility cost (k=%d)", repro_fanouts[0]);
+        printf("  %-37s: %.2fx the plain tree's time\n", label,
+               secs[0][0] > 0.0 ? secs[1][0] / secs[0][0] : 0.0);
+        fflush(stdout);
+        if (cfg->checks && distinct[1] != 1) {
+            fprintf(stderr, "Repro mismatch: %d distinct results across fanouts\n", distinct[1]);
+            MPI_Abort(comm, 4);
+        }
+    }
+    free(out);
+    free(summands);
+}
+
+/* ---------- wire-format study (--wire) ----------
+   float sum of count elements, fractional inputs in [-1, 1).  For the tree
+   and the ring: the fp32 algorithm, then each --wire format (with error
+   feedback under --wire-ef).  Errors are against an fp32 MPI_Allreduce of
+   the same input, per element |out - ref| / max(|ref|, mean |ref|): the sums
+   of signed inputs cancel to near zero in places, where a plain relative
+   error would only measure the cancellation; "16-call" is the mean error of the
+   average of 16 calls on one input, where error feedback pays off.
+*/
+#define WIRE_VARIANTS 2
+#define WIRE_AVG_CALLS 16
+
+static void wire_fill(float *x, int count, int me, int v) {
+    for (int j = 0; j < count; ++j) {
+        const uint64_t h = sparse_mix(((uint64_t)j << 20) ^ ((uint64_t)me << 4) ^ (uint64_t)v ^ 0xf1eeULL);
+        x[j] = (float)((double)(h >> 40) * 0x1p-23 - 1.0);
+    }
+}
+
+/* max and mean relative error of out vs ref (see above). */
+static void wire_error(const float *out, const float *ref, int count, double *emax, double *emean) {
+    double mabs = 0.0;
+    for (int j = 0; j < count; ++j) mabs += fabs((double)ref[j]);
+    const double floor_ = mabs / (double)count;
+    double mx = 0.0, sum = 0.0;
+    for (int j = 0; j < count; ++j) {
+        double d = fabs((double)out[j] - (double)ref[j]), a = fabs((double)ref[j]);
+        double e = d / (a > floor_ ? a : (floor_ > 0.0 ? floor_ : 1.0));
+        if (e > mx) mx = e;
+        sum += e;
+    }
+    *emax = mx;
+    *emean = sum / (double)count;
+}
+
+static void wire_study(const int *fmts, int nfmts, int error_feedback, int fanout, int ring_chunk,
+                       const BenchCfg *cfg, MPI_Comm comm)
+{
+    const int count = cfg->count;
+    RedSpec fsum;
+    red_spec_init(&fsum, DT_FLOAT, OP_SUM);
+    TreePlan tree;
+    RingPlan ring;
+    tree_plan_init(&tree, fanout, count, 0, &fsum, comm);
+    ring_plan_init(&ring, count, ring_chunk, &fsum, comm);
+
+    float *in[WIRE_VARIANTS];
+    float *out = (float*)malloc((size_t)count * sizeof(float));
+    float *ref = (float*)malloc((size_t)count * sizeof(float));
+    float *avg = (float*)malloc((size_t)count * sizeof(float));
+    int ok = out && ref && avg;
+    for (int v = 0; v < WIRE_VARIANTS; ++v) {
+        in[v] = (float*)malloc((size_t)count * sizeof(float));
+        ok = ok && in[v];
+        if (in[v]) wire_fill(in[v], count, cfg->me, v);
+    }
+    if (!ok) { perror("malloc wire study"); MPI_Abort(comm, 3); }
+    MPI_Allreduce(in[0], ref, count, MPI_FLOAT, MPI_SUM, comm);
+
+    if (cfg->me == 0)
+        printf("\nWire formats (count=%d floats, sum, fp32 accumulation%s; rel err vs fp32 MPI_Allreduce):\n",
+               count, error_feedback ? ", error feedback" : "");
+
+    for (int algo = 0; algo < 2; ++algo) {          // 0: tree, 1: ring
+        double base_secs = 0.0;
+        for (int f = -1; f < nfmts; ++f) {           // -1: the fp32 algorithm
+            const int fmt = (f < 0) ? WIRE_FP32 : fmts[f];
+            WireTree wt;
+            WireRing wr;
+            if (f >= 0) {
+                if (algo == 0) wire_tree_init(&wt, &tree, fmt, error_feedback, comm);
+                else           wire_ring_init(&wr, &ring, fmt, error_feedback, comm);
+            }
+            double secs = 0.0, emax = 0.0, emean = 0.0, amax = 0.0, amean = 0.0;
+            memset(avg, 0, (size_t)count * sizeof(float));
+            for (long k = -cfg->warmup; k < cfg->iters + 1 + WIRE_AVG_CALLS; ++k) {
+                if (k == 0) { MPI_Barrier(comm); secs = MPI_Wtime(); }
+                if (k == cfg->iters) secs = MPI_Wtime() - secs;
+                const float *x = (k >= cfg->iters) ? in[0] : in[(k + cfg->warmup) % WIRE_VARIANTS];
+                if (f < 0) {
+                    if (algo == 0) tree_reduce_bcast(x, out, &tree, comm);
+                    else           ring_allreduce(x, out, &ring, comm);
+                } else {
+                    if (algo == 0) wire_tree_allreduce(&wt, x, out, comm);
+                    else           wire_ring_allreduce(&wr, x, out, comm);
+                }
+                if (k == cfg->iters) wire_error(out, ref, count, &emax, &emean);
+                if (k > cfg->iters)
+                    for (int j = 0; j < count; ++j) avg[j] += out[j] / (float)WIRE_AVG_CALLS;
+            }
+            wire_error(avg, ref, count, &amax, &amean);
+            if (f >= 0) {
+                if (algo == 0) wire_tree_free(&wt);
+                else           wire_ring_free(&wr);
+            } else {
+                base_secs = secs;
+            }
+
+            if (cfg->me == 0) {
+                char label[64];
+                if (algo == 0) snprintf(label, sizeof(label), "TreeReduce (k=%d), %s wire", tree.fanout, wire_names[fmt]);
+                else           snprintf(label, sizeof(label), "Ring, %s wire", wire_names[fmt]);
+                const double us = 1e6 * secs / (double)cfg->iters;
+                printf("  %-44s : %.2f us/iter  (fp32 / this = %.2fx)  rel err max %.2e mean %.2e, %d-call mean %.2e\n",
+                       label, us, secs > 0.0 ? base_secs / secs : 0.0, emax, emean, WIRE_AVG_CALLS, amean);
+                if (cfg->checks && !(emax < 0.5)) {
+                    fprintf(stderr, "Wire check failed: %s max rel err %g\n", label, emax);
+                    MPI_Abort(comm, 4);
+                }
+            }
+        }
+    }
+    if (cfg->me == 0) fflush(stdout);
+
+    for (int v = 0; v < WIRE_VARIANTS; ++v) free(in[v]);
+    free(avg); free(ref); free(out);
+    ring_plan_free(&ring);
+    tree_plan_free(&tree);
+}
+
+/* ---------- sparse exchange study (--nbx M) ----------
+   Per step every rank sends 0..M 8-byte messages (count and destinations
+   pseudo-random per rank and step, never to itself) and must receive all
+   messages addressed to it.  Timed per step: the message counts summed with
+   MPI_Allreduce or with the tree then exact receives, and NBX.  --checks
+   verifies every payload and that all sent messages were received.
+*/
+enum { SDX_ALLREDUCE, SDX_TREE, SDX_NBX, SDX_NMODES };
+
+static void sdx_make_round(SdxRound *r, int max_msgs, long k, int me, int np) {
+    const uint64_t seed = ((uint64_t)k << 20) ^ (uint64_t)me;
+    r->nmsg = (np > 1) ? (int)(sparse_mix(seed) % (uint64_t)(max_msgs + 1)) : 0;
+    for (int i = 0; i < r->nmsg; ++i) {
+        int d = (int)(sparse_mix(seed * 0x9e3779b97f4a7c15ULL + (uint64_t)i + 1) % (uint64_t)(np - 1));
+        if (d >= me) d++;
+        r->dst[i] = d;
+        r->payload[i] = sdx_payload(k, me, d, np);
+    }
+}
+
+static void sdx_step(int mode, SdxRound *r, TreePlan *tree, int max_msgs, long k, int me, int np, MPI_Comm comm) {
+    sdx_make_round(r, max_msgs, k, me, np);
+    if (mode == SDX_NBX) sdx_nbx(r, k, me, np, comm);
+    else                 sdx_counted(r, mode == SDX_TREE ? tree : NULL, k, me, np, comm);
+}
+
+static void sdx_study(int max_msgs, int fanout, const BenchCfg *cfg, MPI_Comm comm) {
+    RedSpec isum;
+    red_spec_init(&isum, DT_INT32, OP_SUM);
+    TreePlan tree;
+    tree_plan_init(&tree, fanout, cfg->np, 0, &isum, comm);
+    SdxRound r;
+    sdx_init(&r, max_msgs, cfg->np);
+
+    char labels[SDX_NMODES][64];
+    snprintf(labels[SDX_ALLREDUCE], sizeof(labels[0]), "Allreduce message counts + Recv");
+    snprintf(labels[SDX_TREE], sizeof(labels[0]), "TreeReduce (k=%d) message counts + Recv", tree.fanout);
+    snprintf(labels[SDX_NBX], sizeof(labels[0]), "NBX (Issend + Ibarrier + Iprobe)");
+    double secs[SDX_NMODES];
+    long sent = 0;
+    for (int mode = 0; mode < SDX_NMODES; ++mode) {
+        // Tags alternate with k, which restarts per mode: a rank still
+        // receiving the previous mode's last round must not see this mode's
+        // round 0 under the same tag.
+        MPI_Barrier(comm);
+        for (long k = 0; k < cfg->warmup; ++k) {
+            sdx_step(mode, &r, &tree, max_msgs, k, cfg->me, cfg->np, comm);
+            sent += r.nmsg;
+        }
+        MPI_Barrier(comm);
+        double t0 = MPI_Wtime();
+        for (long k = cfg->warmup; k < cfg->warmup + cfg->iters; ++k) {
+            sdx_step(mode, &r, &tree, max_msgs, k, cfg->me, cfg->np, comm);
+            sent += r.nmsg;
+        }
+        secs[mode] = MPI_Wtime() - t0;
+    }
+
+    long mine[3] = { sent, r.received, r.bad }, all[3];
+    MPI_Reduce(mine, all, 3, MPI_LONG, MPI_SUM, 0, comm);
+    int64_t rx_sum = 0;
+    MPI_Reduce(&r.rx_sum, &rx_sum, 1, MPI_INT64_T, MPI_SUM, 0, comm);
+    if (cfg->me == 0) {
+        const double steps = (double)SDX_NMODES * (double)(cfg->warmup + cfg->iters);
+        printf("\nSparse exchange termination (0..%d messages/rank/step, %.2f avg, 8 bytes each):\n",
+               max_msgs, (double)all[0] / steps / (double)cfg->np);
+        for (int mode = 0; mode < SDX_NMODES; ++mode) {
+            const double us = 1e6 * secs[mode] / (double)cfg->iters;
+            printf("  %-44s : %.2f us/step", labels[mode], us);
+            if (mode == SDX_NBX)
+                printf("  (Allreduce counts / this = %.2fx, tree counts / this = %.2fx)",
+                       (secs[mode] > 0.0) ? secs[SDX_ALLREDUCE] / secs[mode] : 0.0,
+                       (secs[mode] > 0.0) ? secs[SDX_TREE] / secs[mode] : 0.0);
+            printf("\n");
+        }
+        printf("  (accumulators) %lld\n", (long long)rx_sum);
+        if (cfg->checks && (all[1] != all[0] || all[2] != 0)) {
+            fprintf(stderr, "Sparse exchange check failed: sent %ld, received %ld, %ld misdelivered\n",
+                    all[0], all[1], all[2]);
+            MPI_Abort(comm, 4);
+        }
+        fflush(stdout);
+    }
+
+    sdx_free(&r);
+    tree_plan_free(&tree);
+}
+
+/* ---------- parameter sweep (--sweep-count / --sweep-fanout) ----------
+   One launch times every selected algorithm at every (fanout, count) point and
+   writes one machine-readable row per point and algorithm instead of the table:
+   CSV with a header line, or JSON Lines (one object per row).  Every row carries
+   the environment (ranks, nodes, MPI library, CPU model), so files from several
+   machines can simply be concatenated before plotting.  The tree and tree-nb
+   plans are built once per fanout for the largest count and re-aimed at each
+   count; the other plans depend on count and are rebuilt per point, outside
+   the timed loop.
+*/
+#define MAX_SWEEP 32
+
+typedef struct {
+    int segment;
+    int combine;                // TREE_COMBINE_*
+    int tree_shape;
+    int ring_chunk;
+    int hier_inter;
+    int roots;                  // multiroot: first --roots value
+} SweepOpts;
+
+typedef struct {
+    int  nodes;
+    char library[256];          // first line of MPI_Get_library_version
+    char cpu[128];              // "model name" from /proc/cpuinfo
+} SweepEnv;
+
+/* Collective (node count); the strings are only filled on rank 0. */
+static void sweep_env_init(SweepEnv *env, MPI_Comm comm) {
+    int me, np;
+    MPI_Comm_rank(comm, &me);
+    MPI_Comm_size(comm, &np);
+    int *node_of = (int*)malloc((size_t)np * sizeof(int));
+    if (!node_of) { perror("malloc node map"); MPI_Abort(comm, 3); }
+    env->nodes = tree_node_map(node_of, comm);
+    free(node_of);
+
+    snprintf(env->library, sizeof(env->library), "unknown");
+    snprintf(env->cpu, sizeof(env->cpu), "unknown");
+    if (me != 0) return;
+    char lib[MPI_MAX_LIBRARY_VERSION_STRING];
+    int len = 0;
+    MPI_Get_library_version(lib, &len);
+    lib[strcspn(lib, "\r\n")] = '\0';
+    if (lib[0]) snprintf(env->library, sizeof(env->library), "%s", lib);
+
+    FILE *f = fopen("/proc/cpuinfo", "r");
+    if (!f) return;
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        const char *colon = strchr(line, ':');
+        if (strncmp(line, "model name", 10) || !colon) continue;
+        colon += 1 + strspn(colon + 1, " \t");
+        snprintf(env->cpu, sizeof(env->cpu), "%.*s", (int)strcspn(colon, "\r\n"), colon);
+        break;
+    }
+    fclose(f);
+}
+
+/* Field writer shared by both formats; in header mode (CSV) only the keys print. */
+typedef struct {
+    FILE *f;
+    int   json;
+    int   header;
+    int   nf;
+} SweepOut;
+
+static void so_begin(SweepOut *o) {
+    o->nf = 0;
+    if (o->json) fputc('{', o->f);
+}
+
+static void so_key(SweepOut *o, const char *key) {
+    if (o->nf++) fputc(',', o->f);
+    if (o->header) fputs(key, o->f);
+    else if (o->json) fprintf(o->f, "\"%s\":", key);
+}
+
+static void so_str(SweepOut *o, const char *key, const char *v) {
+    so_key(o, key);
+    if (o->header) return;
+    fputc('"', o->f);
+    for (const char *p = v; *p; ++p) {
+        if (*p == '"') fputs(o->json ? "\\\"" : "\"\"", o->f);
+        else if (o->json && *p == '\\') fputs("\\\\", o->f);
+        else if ((unsigned char)*p < 0x20) fputc(' ', o->f);
+        else fputc(*p, o->f);
+    }
+    fputc('"', o->f);
+}
+
+static void so_long(SweepOut *o, const char *key, long v) {
+    so_key(o, key);
+    if (!o->header) fprintf(o->f, "%ld", v);
+}
+
+static void so_double(SweepOut *o, const char *key, double v) {
+    so_key(o, key);
+    if (!o->header) fprintf(o->f, "%.6g", v);
+}
+
+static void so_end(SweepOut *o) {
+    if (o->json && !o->header) fputc('}', o->f);
+    fputc('\n', o->f);
+    fflush(o->f);
+}
+
+static void sweep_row(SweepOut *o, const SweepEnv *env, const BenchCfg *cfg, const RedSpec *red,
+                      int algo, int fanout, const BenchRow *row, double allr_us)
+{
+    const double us = 1e6 * row->secs / (double)cfg->iters;
+    const double bytes = (double)cfg->count * (double)red->k.esize;
+    const double algbw = (us > 0.0) ? bytes / (us * 1e3) : 0.0;
+    const double bus_factor = (cfg->np > 1) ? 2.0 * (double)(cfg->np - 1) / (double)cfg->np : 1.0;
+    so_begin(o);
+    so_long(o, "ranks", cfg->np);
+    so_long(o, "nodes", env->nodes);
+    so_str(o, "mpi_library", env->library);
+    so_str(o, "cpu", env->cpu);
+    so_str(o, "dtype", ck_dtype_names[red->k.dtype]);
+    so_str(o, "op", ck_op_names[red->k.op]);
+    so_str(o, "kernel", ck_isa_names[red->k.isa]);
+    so_long(o, "inplace", cfg->inplace);
+    so_long(o, "iters", cfg->iters);
+    so_str(o, "algo", algo_names[algo]);
+    so_str(o, "label", row->label);
+    so_long(o, "fanout", fanout);
+    so_long(o, "count", cfg->count);
+    so_long(o, "bytes", (long)bytes);
+    so_double(o, "us_per_iter", us);
+    so_double(o, "algbw_gbs", algbw);
+    so_double(o, "busbw_gbs", algbw * bus_factor);
+    so_double(o, "allreduce_over_this", (us > 0.0) ? allr_us / us : 0.0);
+    if (cfg->lat) {
+        so_double(o, "p50_us", 1e6 * row->lat.p50);
+        so_double(o, "p90_us", 1e6 * row->lat.p90);
+        so_double(o, "p99_us", 1e6 * row->lat.p99);
+        so_double(o, "p999_us", 1e6 * row->lat.p999);
+        so_double(o, "max_us", 1e6 * row->lat.max);
+    }
+    so_end(o);
+}
+
+/* Per-point plans for everything but tree / tree-nb (built per fanout). */
+static void sweep_plan_init(int algo, AlgoPlans *ap, const SweepOpts *so, int fanout, const BenchCfg *cfg,
+                            void *my, void *out, MPI_Comm comm)
+{
+    const int count = cfg->count;
+    switch (algo) {
+    case ALGO_TREE:    tree_plan_set_count(&ap->tree, count, comm); break;
+    case ALGO_TREE_NB: tree_plan_set_count(&ap->tree_nb, count, comm); break;
+    case ALGO_TREE_PERSIST:
+        tree_plan_init_shape(&ap->tree_persist, so->tree_shape, fanout, count, 0, ap->red, comm);
+        ap->tree_persist.combine = so->combine;
+        tree_plan_persist(&ap->tree_persist, cfg->inplace ? MPI_IN_PLACE : my, out, comm);
+        break;
+    case ALGO_TREE_ASYNC:
+        tree_plan_init_shape(&ap->tree_async, so->tree_shape, fanout, count, 0, ap->red, comm);
+        tree_engine_init(&ap->engine, &ap->tree_async, comm);
+        break;
+    case ALGO_TREE_RMA: rma_tree_init(&ap->tree_rma, fanout, count, ap->red, comm); break;
+    case ALGO_RABENSEIFNER:
+    case ALGO_RECDBL:   rsag_plan_init(&ap->rsag, count, ap->red, comm); break;
+    case ALGO_RING:     ring_plan_init(&ap->ring, count, so->ring_chunk, ap->red, comm); break;
+    case ALGO_DBTREE:   dbt_plan_init(&ap->dbt, count, so->segment, ap->red, comm); break;
+    case ALGO_MULTIROOT:
+        multiroot_plan_init(&ap->mroot, so->roots, fanout, count, so->segment, ap->red, comm);
+        break;
+    case ALGO_HIER:
+        hier_plan_init(&ap->hier, count, so->hier_inter, fanout, so->segment, so->ring_chunk, ap->red, comm);
+        break;
+#if MPI_VERSION >= 4
+    case ALGO_ALLREDUCE_INIT:
+        MPI_Allreduce_init(cfg->inplace ? MPI_IN_PLACE : my, out, count, ap->red->type, ap->red->op, comm,
+                           MPI_INFO_NULL, &ap->allreduce_init);
+        break;
+#endif
+    default: break;
+    }
+}
+
+static void sweep_plan_free(int algo, AlgoPlans *ap) {
+    switch (algo) {
+    case ALGO_TREE_PERSIST: tree_plan_free(&ap->tree_persist); break;
+    case ALGO_TREE_ASYNC:
+        tree_engine_stop(&ap->engine);
+        tree_plan_free(&ap->tree_async);
+        break;
+    case ALGO_TREE_RMA:     rma_tree_free(&ap->tree_rma); break;
+    case ALGO_RABENSEIFNER:
+    case ALGO_RECDBL:       rsag_plan_free(&ap->rsag); break;
+    case ALGO_RING:         ring_plan_free(&ap->ring); break;
+    case ALGO_DBTREE:       forest_free(&ap->dbt); break;
+    case ALGO_MULTIROOT:    forest_free(&ap->mroot); break;
+    case ALGO_HIER:         hier_plan_free(&ap->hier); break;
+#if MPI_VERSION >= 4
+    case ALGO_ALLREDUCE_INIT: MPI_Request_free(&ap->allreduce_init); break;
+#endif
+    default: break;
+    }
+}
+
+/* base->count is the largest count (the bench buffers' size). */
+static void sweep_run(unsigned algos, const int *fanouts, int nfan, const int *counts, int ncount,
+                      const SweepOpts *so, const BenchCfg *base, AlgoPlans *ap, void *my, void *out, void *ref,
+                      FILE *f, int json, MPI_Comm comm)
+{
+    SweepEnv env;
+    sweep_env_init(&env, comm);
+    SweepOut o = { f, json, !json, 0 };
+    if (base->me == 0 && o.header) {
+        BenchRow none;
+        memset(&none, 0, sizeof(none));
+        sweep_row(&o, &env, base, ap->red, ALGO_ALLREDUCE, 0, &none, 0.0);
+    }
+    o.header = 0;
+
+    for (int fi = 0; fi < nfan; ++fi) {
+        const int k = fanouts[fi];
+        if (algos & (1u << ALGO_TREE)) {
+            tree_plan_init_shape(&ap->tree, so->tree_shape, k, base->count, so->segment, ap->red, comm);
+            ap->tree.combine = so->combine;
+        }
+        if (algos & (1u << ALGO_TREE_NB))
+            tree_plan_init_shape(&ap->tree_nb, so->tree_shape, k, base->count, 0, ap->red, comm);
+
+        for (int ci = 0; ci < ncount; ++ci) {
+            BenchCfg cfg = *base;
+            cfg.count = counts[ci];
+            double allr_us = 0.0;
+            for (int a = 0; a < NUM_ALGOS; ++a) {
+                if (!(algos & (1u << a))) continue;
+                BenchRow row;
+                memset(&row, 0, sizeof(row));
+                sweep_plan_init(a, ap, so, k, &cfg, my, out, comm);
+                bench_algo(a, ap, &cfg, my, out, ref, &row, comm);
+                sweep_plan_free(a, ap);
+                if (a == ALGO_ALLREDUCE) allr_us = 1e6 * row.secs / (double)cfg.iters;   // runs first
+                if (base->me == 0) sweep_row(&o, &env, &cfg, ap->red, a, k, &row, allr_us);
+            }
+        }
+
+        if (algos & (1u << ALGO_TREE_NB)) tree_plan_free(&ap->tree_nb);
+        if (algos & (1u << ALGO_TREE)) tree_plan_free(&ap->tree);
+    }
+}
+
+/* tree-async needs MPI_THREAD_MULTIPLE, which has to be requested at init,
+   before the options are parsed properly. */
+static int wants_progress_thread(int argc, char **argv) {
+    for (int i = 1; i + 1 < argc; ++i)
+        if ((!strcmp(argv[i], "--algo") || !strcmp(argv[i], "--algos")) && strstr(argv[i + 1], "tree-async"))
+            return 1;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int thread_level = MPI_THREAD_SINGLE;
+    if (wants_progress_thread(argc, argv)) MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &thread_level);
+    else                                   MPI_Init(&argc, &argv);
+
+    int me, np;
+    MPI_Comm_rank(MPI_COMM_WORLD, &me);
+    MPI_Comm_size(MPI_COMM_WORLD, &np);
+
+    long iters  = 20000;
+    long warmup = 100;
+    int  checks = 0;
+    int  inplace = 0;
+    int  count  = 1;
+    int  fanout = 2;
+    int  segment = 0;
+    enum { CMP_ARRIVAL, CMP_WAITALL, CMP_BOTH } combine = CMP_ARRIVAL;
+    const char *algo_list = "tree";
+    int  ring_chunk = RING_DEFAULT_CHUNK;
+    double overlap_us = 0.0;
+    double progress_us = 10.0;
+    int  fuse_n = 0;
+    long fuse_bytes = 4096;
+    const char *sparse_arg = NULL;
+    double sparse_dense_at = 25.0;
+    int  repro_summands = 0;
+    const char *wire_arg = NULL;
+    int  wire_ef = 0;
+    int  nbx_msgs = -1;
+    int  latency = 0;
+    const char *lat_path = NULL;
+    const char *sweep_count_arg = NULL, *sweep_fanout_arg = NULL;
+    int  json = 0;
+    const char *out_path = NULL;
+    const char *roots_arg = "2";
+    int  hier_inter = HIER_INTER_TREE;
+    int  tree_shape = TREE_SHAPE_HEAP;
+    int  dtype = DT_INT64;
+    int  op = OP_SUM;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--iters") && i + 1 < argc) {
+            iters = strtol(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--warmup") && i + 1 < argc) {
+            warmup = strtol(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--count") && i + 1 < argc) {
+            count = (int)strtol(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--fanout") && i + 1 < argc) {
+            fanout = (int)strtol(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--segment") && i + 1 < argc) {
+            segment = (int)strtol(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--combine") && i + 1 < argc) {
+            const char *c = argv[++i];
+            if (!strcmp(c, "arrival")) combine = CMP_ARRIVAL;
+            else if (!strcmp(c, "waitall")) combine = CMP_WAITALL;
+            else if (!strcmp(c, "both")) combine = CMP_BOTH;
+            else usage_and_exit(argv[0]);
+        } else if ((!strcmp(argv[i], "--algo") || !strcmp(argv[i], "--algos")) && i + 1 < argc) {
+            algo_list = argv[++i];
+        } else if (!strcmp(argv[i], "--overlap-us") && i + 1 < argc) {
+            overlap_us = strtod(argv[++i], NULL);
+        } else if (!strcmp(argv[i], "--progress-us") && i + 1 < argc) {
+            progress_us = strtod(argv[++i], NULL);
+        } else if (!strcmp(argv[i], "--fuse") && i + 1 < argc) {
+            fuse_n = (int)strtol(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--fuse-bytes") && i + 1 < argc) {
+            fuse_bytes = strtol(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--sparse") && i + 1 < argc) {
+            sparse_arg = argv[++i];
+        } else if (!strcmp(argv[i], "--sparse-dense-at") && i + 1 < argc) {
+            sparse_dense_at = strtod(argv[++i], NULL);
+        } else if (!strcmp(argv[i], "--repro") && i + 1 < argc) {
+            repro_summands = (int)strtol(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--wire") && i + 1 < argc) {
+            wire_arg = argv[++i];
+        } else if (!strcmp(argv[i], "--wire-ef")) {
+            wire_ef = 1;
+        } else if (!strcmp(argv[i], "--nbx") && i + 1 < argc) {
+            nbx_msgs = (int)strtol(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--sweep-count") && i + 1 < argc) {
+            sweep_count_arg = argv[++i];
+        } else if (!strcmp(argv[i], "--sweep-fanout") && i + 1 < argc) {
+            sweep_fanout_arg = argv[++i];
+        } else if (!strcmp(argv[i], "--format") && i + 1 < argc) {
+            const char *fm = argv[++i];
+            if (!strcmp(fm, "csv")) json = 0;
+            else if (!strcmp(fm, "json")) json = 1;
+            else usage_and_exit(argv[0]);
+        } else if (!strcmp(argv[i], "--out") && i + 1 < argc) {
+            out_path = argv[++i];
+        } else if (!strcmp(argv[i], "--latency")) {
+            latency = 1;
+        } else if (!strcmp(argv[i], "--lat-dump") && i + 1 < argc) {
+            lat_path = argv[++i];
+            latency = 1;
+        } else if (!strcmp(argv[i], "--ring-chunk") && i + 1 < argc) {
+            ring_chunk = (int)strtol(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--roots") && i + 1 < argc) {
+            roots_arg = argv[++i];
+        } else if (!strcmp(argv[i], "--hier-inter") && i + 1 < argc) {
+            const char *h = argv[++i];
+            if (!strcmp(h, "tree")) hier_inter = HIER_INTER_TREE;
+            else if (!strcmp(h, "ring")) hier_inter = HIER_INTER_RING;
+            else usage_and_exit(argv[0]);
+        } else if (!strcmp(argv[i], "--tree-shape") && i + 1 < argc) {
+            const char *t = argv[++i];
+            tree_shape = -1;
+            for (int sh = 0; sh < TREE_NSHAPES; ++sh)
+                if (!strcmp(t, tree_shape_names[sh])) tree_shape = sh;
+            if (tree_shape < 0) usage_and_exit(argv[0]);
+        } else if (!strcmp(argv[i], "--dtype") && i + 1 < argc) {
+            dtype = ck_dtype_from_name(argv[++i]);
+            if (dtype < 0) usage_and_exit(argv[0]);
+        } else if (!strcmp(argv[i], "--op") && i + 1 < argc) {
+            op = ck_op_from_name(argv[++i]);
+            if (op < 0) usage_and_exit(argv[0]);
+        } else if (!strcmp(argv[i], "--inplace")) {
+            inplace = 1;
+        } else if (!strcmp(argv[i], "--checks")) {
+            checks = 1;
+        } else if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h")) {
+            usage_and_exit(argv[0]);
+        }
+    }
+    unsigned algos = parse_algo_list(algo_list);
+    int roots_list[MAX_ROOTS_LIST];
+    int nroots = parse_int_list(roots_arg, roots_list, MAX_ROOTS_LIST);
+    double densities[MAX_DENSITIES];
+    int ndens = sparse_arg ? parse_double_list(sparse_arg, densities, MAX_DENSITIES) : 0;
+    int wire_fmts[WIRE_NFMTS];
+    int nwire = wire_arg ? parse_wire_list(wire_arg, wire_fmts, WIRE_NFMTS) : 0;
+    const int sweep = sweep_count_arg || sweep_fanout_arg;
+    int sweep_counts[MAX_SWEEP] = { count }, sweep_fanouts[MAX_SWEEP] = { fanout };
+    int ncounts = sweep_count_arg ? parse_int_list(sweep_count_arg, sweep_counts, MAX_SWEEP) : 1;
+    int nfanouts = sweep_fanout_arg ? parse_int_list(sweep_fanout_arg, sweep_fanouts, MAX_SWEEP) : 1;
+    for (int c = 0; c < ncounts; ++c) if (sweep_counts[c] > count) count = sweep_counts[c];
+    if (iters <= 0 || warmup < 0 || count <= 0 || fanout <= 0 || segment < 0 || ring_chunk <= 0 ||
+        overlap_us < 0.0 || progress_us <= 0.0 || fuse_n < 0 || fuse_bytes <= 0 || !algos || nroots == 0 ||
+        (sparse_arg && ndens == 0) || sparse_dense_at < 0.0 || sparse_dense_at > 100.0 ||
+        repro_summands < 0 || repro_summands > (1 << (63 - REPRO_BIN_BITS)) ||
+        (wire_arg && nwire == 0) || nbx_msgs < -1 || (latency && iters > INT_MAX) || ncounts == 0 ||
+        nfanouts == 0)
+        usage_and_exit(argv[0]);
+    algos |= 1u << ALGO_ALLREDUCE;  // always the baseline
+    if ((algos & (1u << ALGO_TREE_ASYNC)) && thread_level < MPI_THREAD_MULTIPLE) {
+        if (me == 0) fprintf(stderr, "tree-async needs MPI_THREAD_MULTIPLE (library provides level %d); skipped\n",
+                             thread_level);
+        algos &= ~(1u << ALGO_TREE_ASYNC);
+    }
+#if MPI_VERSION < 4
+    if (algos & (1u << ALGO_ALLREDUCE_INIT)) {
+        if (me == 0)
+            fprintf(stderr, "allreduce-init needs an MPI-4 library (this one is MPI-%d.%d); skipped\n",
+                    MPI_VERSION, MPI_SUBVERSION);
+        algos &= ~(1u << ALGO_ALLREDUCE_INIT);
+    }
+#endif
+    RedSpec red;
+    if (red_spec_init(&red, (ck_dtype_t)dtype, (ck_op_t)op) != 0) usage_and_exit(argv[0]);
+    const size_t es = red.k.esize;
+
+    static const char *combine_names[] = { "arrival", "waitall", "both" };
+    if (me == 0 && !sweep) {
+        printf("MPI ranks=%d, iters=%ld, warmup=%ld, count=%d, fanout=%d, segment=%d, combine=%s, algo=%s, "
+               "tree-shape=%s, dtype=%s, op=%s, kernel=%s, inplace=%s, checks=%s\n",
+               np, iters, warmup, count, fanout, segment, combine_names[combine], algo_list,
+               tree_shape_names[tree_shape],
+               ck_dtype_names[dtype], ck_op_names[op], ck_isa_names[red.k.isa], inplace ? "on" : "off",
+               checks ? "on" : "off");
+        fflush(stdout);
+    }
+
+    void *my  = malloc((size_t)count * es);
+    void *out = malloc((size_t)count * es);
+    void *ref = malloc((size_t)count * es);
+    if (!my || !out || !ref) { if (me==0) perror("malloc"); MPI_Abort(MPI_COMM_WORLD, 3); }
+
+    LatRec lat_rec = { NULL, NULL, NULL, NULL };
+    if (latency) {
+        lat_rec.mine = (double*)malloc((size_t)iters * sizeof(double));
+        if (me == 0) {
+            lat_rec.all   = (double*)malloc((size_t)np * (size_t)iters * sizeof(double));
+            lat_rec.worst = (double*)malloc((size_t)iters * sizeof(double));
+        }
+        if (!lat_rec.mine || (me == 0 && (!lat_rec.all || !lat_rec.worst))) {
+            perror("malloc latency samples");
+            MPI_Abort(MPI_COMM_WORLD, 3);
+        }
+        if (me == 0 && lat_path && !(lat_rec.dump = fopen(lat_path, "wb"))) {
+            perror(lat_path);
+            MPI_Abort(MPI_COMM_WORLD, 3);
+        }
+    }
+
+    AlgoPlans plans;
+    memset(&plans, 0, sizeof(plans));
+    plans.red = &red;
+    plans.me  = me;
+    plans.overlap_us = overlap_us;
+
+    if (sweep) {
+        FILE *f = stdout;
+        if (me == 0 && out_path && !(f = fopen(out_path, "w"))) { perror(out_path); MPI_Abort(MPI_COMM_WORLD, 3); }
+        const SweepOpts so = { segment, combine == CMP_WAITALL ? TREE_COMBINE_WAITALL : TREE_COMBINE_ON_ARRIVAL,
+                               tree_shape, ring_chunk, hier_inter, roots_list[0] };
+        const BenchCfg base = { me, np, count, iters, warmup, checks, inplace, latency ? &lat_rec : NULL };
+        sweep_run(algos, sweep_fanouts, nfanouts, sweep_counts, ncounts, &so, &base, &plans, my, out, ref,
+                  f, json, MPI_COMM_WORLD);
+        if (me == 0 && f != stdout && fclose(f) != 0) { perror(out_path); MPI_Abort(MPI_COMM_WORLD, 3); }
+        if (lat_rec.dump && fclose(lat_rec.dump) != 0) { perror(lat_path); MPI_Abort(MPI_COMM_WORLD, 3); }
+        free(lat_rec.worst); free(lat_rec.all); free(lat_rec.mine);
+        free(ref); free(out); free(my);
+        MPI_Finalize();
+        return 0;
+    }
+
+#if MPI_VERSION >= 4
+    if (algos & (1u << ALGO_ALLREDUCE_INIT))
+        MPI_Allreduce_init(inplace ? MPI_IN_PLACE : my, out, count, red.type, red.op, MPI_COMM_WORLD,
+                           MPI_INFO_NULL, &plans.allreduce_init);
+#endif
+    if (algos & (1u << ALGO_TREE)) {
+        tree_plan_init_shape(&plans.tree, tree_shape, fanout, count, segment, &red, MPI_COMM_WORLD);
+        plans.tree.combine = (combine == CMP_WAITALL) ? TREE_COMBINE_WAITALL : TREE_COMBINE_ON_ARRIVAL;
+    }
+    if (algos & (1u << ALGO_TREE_NB)) {
+        tree_plan_init_shape(&plans.tree_nb, tree_shape, fanout, count, 0, &red, MPI_COMM_WORLD);
+    }
+    if (algos & (1u << ALGO_TREE_ASYNC)) {
+        tree_plan_init_shape(&plans.tree_async, tree_shape, fanout, count, 0, &red, MPI_COMM_WORLD);
+        tree_engine_init(&plans.engine, &plans.tree_async, MPI_COMM_WORLD);
+    }
+    if (algos & (1u << ALGO_TREE_RMA)) rma_tree_init(&plans.tree_rma, fanout, count, &red, MPI_COMM_WORLD);
+    if (algos & (1u << ALGO_TREE_PERSIST)) {
+        // Persistent requests only cover the store-and-forward tree
+        tree_plan_init_shape(&plans.tree_persist, tree_shape, fanout, count, 0, &red, MPI_COMM_WORLD);
+        plans.tree_persist.combine = (combine == CMP_WAITALL) ? TREE_COMBINE_WAITALL : TREE_COMBINE_ON_ARRIVAL;
+        tree_plan_persist(&plans.tree_persist, inplace ? MPI_IN_PLACE : my, out, MPI_COMM_WORLD);
+    }
+    const unsigned need_rsag = (1u << ALGO_RABENSEIFNER) | (1u << ALGO_RECDBL);
+    if (algos & need_rsag) rsag_plan_init(&plans.rsag, count, &red, MPI_COMM_WORLD);
+    if (algos & (1u << ALGO_RING)) ring_plan_init(&plans.ring, count, ring_chunk, &red, MPI_COMM_WORLD);
+    if (algos & (1u << ALGO_DBTREE)) dbt_plan_init(&plans.dbt, count, segment, &red, MPI_COMM_WORLD);
+    if (algos & (1u << ALGO_HIER))
+        hier_plan_init(&plans.hier, count, hier_inter, fanout, segment, ring_chunk, &red, MPI_COMM_WORLD);
+
+    const BenchCfg cfg = { me, np, count, iters, warmup, checks, inplace, latency ? &lat_rec : NULL };
+    BenchRow rows[MAX_ROWS];
+    memset(rows, 0, sizeof(rows));
+    int nrows = 0;
+    int tree_row = -1, tree_wa_row = -1, persist_row = -1, iallr_row = -1;
+
+    // Bench: each selected algorithm, timed identically
+    for (int a = 0; a < NUM_ALGOS; ++a) {
+        if (!(algos & (1u << a))) continue;
+
+        if (a == ALGO_MULTIROOT) {
+            // One row per --roots value
+            for (int r = 0; r < nroots && nrows < MAX_ROWS; ++r) {
+                multiroot_plan_init(&plans.mroot, roots_list[r], fanout, count, segment, &red, MPI_COMM_WORLD);
+                bench_algo(a, &plans, &cfg, my, out, ref, &rows[nrows++], MPI_COMM_WORLD);
+                forest_free(&plans.mroot);
+            }
+            continue;
+        }
+
+        if (a == ALGO_TREE) tree_row = nrows;
+        if (a == ALGO_TREE_PERSIST) persist_row = nrows;
+        if (a == ALGO_IALLREDUCE) iallr_row = nrows;
+        bench_algo(a, &plans, &cfg, my, out, ref, &rows[nrows++], MPI_COMM_WORLD);
+
+        // Same tree with Waitall-then-combine, to isolate the overlap gained
+        if (a == ALGO_TREE && combine == CMP_BOTH) {
+            plans.tree.combine = TREE_COMBINE_WAITALL;
+            tree_wa_row = nrows;
+            snprintf(rows[tree_wa_row].label, sizeof(rows[tree_wa_row].label),
+                     "TreeReduce, Waitall combine");
+            bench_algo(a, &plans, &cfg, my, out, ref, &rows[nrows++], MPI_COMM_WORLD);
+            plans.tree.combine = TREE_COMBINE_ON_ARRIVAL;
+        }
+    }
+
+    // Tree edges that cross nodes, for the selected shape and for the heap
+    const unsigned shaped = (1u << ALGO_TREE) | (1u << ALGO_TREE_PERSIST) | (1u << ALGO_TREE_NB) |
+                            (1u << ALGO_TREE_ASYNC);
+    int edges[2] = { 0, 0 }, num_nodes = 0;
+    if (algos & shaped) {
+        int *node_of = (int*)malloc((size_t)np * sizeof(int));
+        if (!node_of) { perror("malloc node map"); MPI_Abort(MPI_COMM_WORLD, 3); }
+        num_nodes = tree_node_map(node_of, MPI_COMM_WORLD);
+        for (int v = 0; v < 2; ++v) {
+            TreePlan topo;
+            tree_plan_shape_topology(&topo, v ? TREE_SHAPE_HEAP : tree_shape, fanout, MPI_COMM_WORLD);
+            edges[v] = tree_internode_edges(&topo, node_of, MPI_COMM_WORLD);
+            tree_plan_free(&topo);
+        }
+        free(node_of);
+    }
+
+    // Local memcpy traffic of the tree, summed over ranks: the earlier staged
+    // accumulator vs the zero-copy path as run here
+    double copy_bytes[2] = { 0.0, 0.0 };
+    if (algos & (1u << ALGO_TREE)) {
+        double mine[2] = { tree_copy_traffic(&plans.tree, 1, inplace), tree_copy_traffic(&plans.tree, 0, inplace) };
+        MPI_Reduce(mine, copy_bytes, 2, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    }
+
+    if (me == 0) {
+        double allr_us = 1e6 * rows[0].secs / (double)iters;   // ALGO_ALLREDUCE runs first
+        // algbw = bytes/time; busbw scales it by 2(n-1)/n, the per-rank traffic
+        // of a bandwidth-optimal allreduce, so it compares against link speed.
+        const double bytes = (double)count * (double)es;
+        const double bus_factor = (np > 1) ? 2.0 * (double)(np - 1) / (double)np : 1.0;
+        printf("\nResults (avg per iteration; algbw/busbw in GB/s):\n");
+        for (int r = 0; r < nrows; ++r) {
+            double us = 1e6 * rows[r].secs / (double)iters;
+            double algbw = (us > 0.0) ? bytes / (us * 1e3) : 0.0;
+            printf("  %-44s : %.2f us/iter  algbw %.3f  busbw %.3f", rows[r].label, us, algbw, algbw * bus_factor);
+            if (r == 0)
+                printf("\n");
+            else
+                printf("  (Allreduce / this = %.2fx, >1 => faster)\n", (us > 0.0) ? (allr_us / us) : 0.0);
+        }
+        if (tree_wa_row >= 0) {
+            double tree_us = 1e6 * rows[tree_row].secs / (double)iters;
+            double wa_us = 1e6 * rows[tree_wa_row].secs / (double)iters;
+            printf("  Overlap gained by folding on arrival : %.2f us/iter (%.1f%%)\n",
+                   wa_us - tree_us, (wa_us > 0.0) ? 100.0 * (wa_us - tree_us) / wa_us : 0.0);
+        }
+        if (iallr_row >= 0 && overlap_us > 0.0) {
+            double ia_us = 1e6 * rows[iallr_row].secs / (double)iters;
+            printf("  Iallreduce minus compute window      : %.2f us/iter (blocking Allreduce: %.2f)\n",
+                   ia_us - overlap_us, allr_us);
+        }
+        if (tree_row >= 0 && persist_row >= 0 && !plans.tree.segment) {
+            double tree_us = 1e6 * rows[tree_row].secs / (double)iters;
+            double p_us = 1e6 * rows[persist_row].secs / (double)iters;
+            printf("  Saved by persistent requests         : %.2f us/iter (%.1f%%)\n",
+                   tree_us - p_us, (tree_us > 0.0) ? 100.0 * (tree_us - p_us) / tree_us : 0.0);
+        }
+        if (algos & shaped) {
+            char label[64];
+            snprintf(label, sizeof(label), "Tree inter-node edges, %s", tree_shape_names[tree_shape]);
+            printf("  %-37s: %d of %d (heap: %d; %d node%s)\n",
+                   label, edges[0], np - 1, edges[1], num_nodes, num_nodes == 1 ? "" : "s");
+        }
+        if (tree_row >= 0) {
+            printf("  Tree memcpy traffic, all ranks       : %.3f MB/iter (staged accumulator: %.3f, saved %.1f%%)\n",
+                   copy_bytes[1] / 1e6, copy_bytes[0] / 1e6,
+                   (copy_bytes[0] > 0.0) ? 100.0 * (copy_bytes[0] - copy_bytes[1]) / copy_bytes[0] : 0.0);
+        }
+        printf("  (accumulators)");
+        for (int r = 0; r < nrows; ++r) printf(" %ld", rows[r].sink);
+        printf("\n");
+        if (latency) {
+            printf("\nLatency per iteration (slowest rank each iteration; us):\n");
+            for (int r = 0; r < nrows; ++r) lat_print(stdout, 44, rows[r].label, &rows[r].lat);
+            printf("\nLatency histograms (log2 buckets; iterations per bucket):\n");
+            for (int r = 0; r < nrows; ++r) lat_print_hist(stdout, rows[r].label, &rows[r].lat);
+            if (lat_path) printf("  raw samples (%d ranks x %ld iters per row) -> %s\n", np, iters, lat_path);
+        }
+        fflush(stdout);
+    }
+    if (lat_rec.dump && fclose(lat_rec.dump) != 0) { perror(lat_path); MPI_Abort(MPI_COMM_WORLD, 3); }
+
+    const unsigned need_overlap = (1u << ALGO_TREE_NB) | (1u << ALGO_TREE_ASYNC) | (1u << ALGO_IALLREDUCE);
+    if (overlap_us > 0.0 && (algos & need_overlap)) {
+        if (me == 0) printf("\nOverlap (compute window %.0f us; progress call every %.0f us):\n", overlap_us, progress_us);
+        if (algos & (1u << ALGO_TREE_NB))
+            overlap_study(ALGO_TREE_NB, &plans, &cfg, my, out, overlap_us, progress_us, MPI_COMM_WORLD);
+        if (algos & (1u << ALGO_TREE_ASYNC))
+            overlap_study(ALGO_TREE_ASYNC, &plans, &cfg, my, out, overlap_us, progress_us, MPI_COMM_WORLD);
+        if (algos & (1u << ALGO_IALLREDUCE))
+            overlap_study(ALGO_IALLREDUCE, &plans, &cfg, my, out, overlap_us, progress_us, MPI_COMM_WORLD);
+        if (me == 0) fflush(stdout);
+    }
+
+    if (fuse_n > 0) fusion_study(fuse_n, (size_t)fuse_bytes, fanout, &red, &cfg, MPI_COMM_WORLD);
+    if (repro_summands > 0) repro_study(repro_summands, &cfg, MPI_COMM_WORLD);
+    if (ndens > 0) sparse_study(densities, ndens, sparse_dense_at / 100.0, fanout, &red, &cfg, MPI_COMM_WORLD);
+    if (nwire > 0) wire_study(wire_fmts, nwire, wire_ef, fanout, ring_chunk, &cfg, MPI_COMM_WORLD);
+    if (nbx_msgs >= 0) sdx_study(nbx_msgs, fanout, &cfg, MPI_COMM_WORLD);
+
+    if (algos & (1u << ALGO_HIER)) hier_plan_free(&plans.hier);
+    if (algos & (1u << ALGO_DBTREE)) forest_free(&plans.dbt);
+    if (algos & (1u << ALGO_RING)) ring_plan_free(&plans.ring);
+    if (algos & need_rsag) rsag_plan_free(&plans.rsag);
+#if MPI_VERSION >= 4
+    if (algos & (1u << ALGO_ALLREDUCE_INIT)) MPI_Request_free(&plans.allreduce_init);
+#endif
+    if (algos & (1u << ALGO_TREE_ASYNC)) {
+        tree_engine_stop(&plans.engine);
+        tree_plan_free(&plans.tree_async);
+    }
+    if (algos & (1u << ALGO_TREE_RMA)) rma_tree_free(&plans.tree_rma);
+    if (algos & (1u << ALGO_TREE_NB)) tree_plan_free(&plans.tree_nb);
+    if (algos & (1u << ALGO_TREE_PERSIST)) tree_plan_free(&plans.tree_persist);
+    if (algos & (1u << ALGO_TREE)) tree_plan_free(&plans.tree);
+    free(lat_rec.worst); free(lat_rec.all); free(lat_rec.mine);
     free(ref); free(out); free(my);
     MPI_Finalize();
     return 0;
@@ -0,0 +1,371 @@
+// shmem_treereduce_vs_reduce.c
+// OpenSHMEM counterpart of mpi_bench: a put-based k-ary TreeReduce (+ down-broadcast)
+// on long/double vectors against the library's sum reduction.
+// Build: oshcc -O3 -march=native -std=c11 shmem_treereduce_vs_reduce.c -o shmem_bench
+// Run:   oshrun -np 8 ./shmem_bench --iters 20000 --count 1 --checks
+// Sweep: for c in 1 16 256 4096 65536 1048576; do for k in 2 4 8; do
+//          oshrun -np 8 ./shmem_bench --iters 200 --count $c --fanout $k --dtype double; done; done
+//        (put-with-signal and shmem_<T>_sum_reduce are OpenSHMEM 1.5; on older libraries the
+//         tree uses putmem_nbi + fence + atomic set and the baseline is shmem_<T>_sum_to_all)
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <shmem.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "combine_kernels.h"
+
+#if SHMEM_MAJOR_VERSION * 100 + SHMEM_MINOR_VERSION >= 105
+#define SH_HAVE_15 1            // put-with-signal, teams, shmem_<T>_sum_reduce
+#else
+#define SH_HAVE_15 0
+#endif
+
+_Static_assert(sizeof(long) == sizeof(int64_t), "long must be 64-bit (combine kernels: int64)");
+_Static_assert(sizeof(unsigned long) == sizeof(uint64_t), "signals are set as unsigned long");
+
+static inline double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static inline long value_for_iter(long k, int me) {
+    return k + 1 + me; // make each iteration’s value change
+}
+
+static void usage_and_exit(const char *prog) {
+    if (shmem_my_pe() == 0)
+        fprintf(stderr,
+            "Usage: %s [--iters N] [--warmup W] [--count C] [--fanout K] [--dtype long|double]\n"
+            "          [--inplace] [--checks]\n"
+            "  Times a put-based k-ary tree sum (children put their partial into a per-child\n"
+            "  slot at the parent with a signal, the parent folds them with the SIMD combine\n"
+            "  kernels and puts the result back down) against the library sum reduction.\n", prog);
+    shmem_global_exit(1);
+}
+
+/* ---------- put-based k-ary tree ----------
+   Heap tree rooted at PE 0 (children k*h+1 .. k*h+k).  Symmetric per PE:
+       slots: fanout x count elements, child i of this PE writes slot i
+       sig:   uint64 x (fanout+1), [i] child i arrived, [fanout] result arrived
+   A child puts its partial into its slot at the parent with a signal
+   (shmem_putmem_signal_nbi, or putmem_nbi + fence + atomic set before 1.5);
+   the parent folds the children in arrival order with one combine_n per
+   batch, then puts the result into each child's dest with the down signal.
+   Signals carry the call's epoch, so they are never reset.  A slot is never
+   overwritten early: the child's next put follows its receipt of this call's
+   result, sent only after the parent folded.  Idle polls yield the core, so
+   oversubscribed PEs still make progress.
+*/
+typedef struct {
+    int me, np, fanout;
+    int parent;                 // -1 for root
+    int slot;                   // my slot index at my parent
+    int first_child, num_children;
+    int count;
+    combine_kernel_t k;
+    char        *slots;         // symmetric
+    uint64_t    *sig;           // symmetric
+    uint64_t     epoch;
+    int         *pending;       // children not folded yet
+    const void **srcs;          // ready slots handed to one combine_n
+} ShTreePlan;
+
+static void sh_tree_init(ShTreePlan *pl, int fanout, int count, ck_dtype_t dtype) {
+    memset(pl, 0, sizeof(*pl));
+    pl->me = shmem_my_pe();
+    pl->np = shmem_n_pes();
+    pl->fanout = (fanout < 2 ? 2 : fanout);
+    pl->count  = count;
+    combine_kernel_init(&pl->k, dtype, OP_SUM);
+
+    pl->parent = (pl->me == 0) ? -1 : (pl->me - 1) / pl->fanout;
+    pl->slot   = (pl->me == 0) ? 0  : (pl->me - 1) % pl->fanout;
+    long first = (long)pl->fanout * pl->me + 1;
+    if (first < pl->np) {
+        long last = first + pl->fanout - 1;
+        if (last >= pl->np) last = pl->np - 1;
+        pl->first_child  = (int)first;
+        pl->num_children = (int)(last - first + 1);
+    }
+
+    // shmem_malloc is collective: every PE allocates the same sizes
+    pl->slots   = (char*)shmem_malloc((size_t)pl->fanout * (size_t)count * pl->k.esize);
+    pl->sig     = (uint64_t*)shmem_calloc((size_t)pl->fanout + 1, sizeof(uint64_t));
+    pl->pending = (int*)malloc((size_t)pl->fanout * sizeof(int));
+    pl->srcs    = (const void**)malloc((size_t)pl->fanout * sizeof(*pl->srcs));
+    if (!pl->slots || !pl->sig || !pl->pending || !pl->srcs) {
+        fprintf(stderr, "PE %d: tree allocation failed\n", pl->me);
+        shmem_global_exit(2);
+    }
+    shmem_barrier_all();        // zeroed signals everywhere before the first put
+}
+
+static void sh_tree_free(ShTreePlan *pl) {
+    shmem_barrier_all();
+    shmem_free(pl->sig);
+    shmem_free(pl->slots);
+    free(pl->srcs);
+    free(pl->pending);
+    memset(pl, 0, sizeof(*pl));
+}
+
+static inline void sh_put_signal(void *dest, const void *src, size_t bytes, uint64_t *sig, uint64_t value, int pe) {
+#if SH_HAVE_15
+    shmem_putmem_signal_nbi(dest, src, bytes, sig, value, SHMEM_SIGNAL_SET, pe);
+#else
+    shmem_putmem_nbi(dest, src, bytes, pe);
+    shmem_fence();              // data before signal, same target PE
+    shmem_ulong_atomic_set((unsigned long*)sig, (unsigned long)value, pe);
+#endif
+}
+
+static inline void sh_wait_signal(uint64_t *sig, uint64_t value) {
+    while (!shmem_uint64_test(sig, SHMEM_CMP_GE, value)) sched_yield();
+}
+
+/* dest and source are symmetric, count elements; source == dest is in place. */
+static void sh_tree_allreduce(ShTreePlan *pl, void *dest, const void *source) {
+    const size_t bytes = (size_t)pl->count * pl->k.esize;
+    const uint64_t epoch = ++pl->epoch;
+    if (dest != source) memcpy(dest, source, bytes);
+
+    int left = pl->num_children;
+    for (int i = 0; i < left; ++i) pl->pending[i] = i;
+    while (left > 0) {
+        int ready = 0;
+        for (int i = 0; i < left; ) {
+            const int c = pl->pending[i];
+            if (shmem_uint64_test(&pl->sig[c], SHMEM_CMP_GE, epoch)) {
+                pl->srcs[ready++] = pl->slots + (size_t)c * bytes;
+                pl->pending[i] = pl->pending[--left];
+            } else {
+                ++i;
+            }
+        }
+        if (ready > 0) pl->k.combine_n(dest, pl->srcs, ready, (size_t)pl->count);
+        else           sched_yield();
+    }
+
+    if (pl->parent >= 0) {
+        // The parent reads the slot only after the signal, and our dest is next
+        // written by its down put, so the nbi source needs no quiet here.
+        sh_put_signal(pl->slots + (size_t)pl->slot * bytes, dest, bytes, &pl->sig[pl->slot], epoch, pl->parent);
+        sh_wait_signal(&pl->sig[pl->fanout], epoch);
+    }
+
+    for (int i = 0; i < pl->num_children; ++i)
+        sh_put_signal(dest, dest, bytes, &pl->sig[pl->fanout], epoch, pl->first_child + i);
+    if (pl->num_children > 0) shmem_quiet();    // caller may reuse dest on return
+}
+
+/* ---------- library baseline ---------- */
+
+typedef struct {
+    ck_dtype_t dtype;
+#if !SH_HAVE_15
+    void *pWrk;                 // symmetric, max(count/2+1, SHMEM_REDUCE_MIN_WRKDATA_SIZE)
+    long *pSync[2];             // alternated: back-to-back reductions must not share one
+    int   flip;
+#endif
+} ShReduce;
+
+static void sh_reduce_init(ShReduce *r, int count, ck_dtype_t dtype) {
+    memset(r, 0, sizeof(*r));
+    r->dtype = dtype;
+#if !SH_HAVE_15
+    size_t nwrk = (size_t)count / 2 + 1;
+    if (nwrk < SHMEM_REDUCE_MIN_WRKDATA_SIZE) nwrk = SHMEM_REDUCE_MIN_WRKDATA_SIZE;
+    r->pWrk = shmem_malloc(nwrk * ck_dtype_size[dtype]);
+    for (int i = 0; i < 2; ++i) {
+        r->pSync[i] = (long*)shmem_malloc(SHMEM_REDUCE_SYNC_SIZE * sizeof(long));
+        if (r->pSync[i])
+            for (int j = 0; j < SHMEM_REDUCE_SYNC_SIZE; ++j) r->pSync[i][j] = SHMEM_SYNC_VALUE;
+    }
+    if (!r->pWrk || !r->pSync[0] || !r->pSync[1]) {
+        fprintf(stderr, "PE %d: reduction workspace allocation failed\n", shmem_my_pe());
+        shmem_global_exit(2);
+    }
+    shmem_barrier_all();
+#else
+    (void)count;
+#endif
+}
+
+static void sh_reduce_free(ShReduce *r) {
+#if !SH_HAVE_15
+    shmem_barrier_all();
+    shmem_free(r->pSync[1]);
+    shmem_free(r->pSync[0]);
+    shmem_free(r->pWrk);
+#endif
+    memset(r, 0, sizeof(*r));
+}
+
+static void sh_reduce(ShReduce *r, void *dest, const void *source, int count) {
+#if SH_HAVE_15
+    if (r->dtype == DT_INT64) shmem_long_sum_reduce(SHMEM_TEAM_WORLD, (long*)dest, (const long*)source, (size_t)count);
+    else                      shmem_double_sum_reduce(SHMEM_TEAM_WORLD, (double*)dest, (const double*)source, (size_t)count);
+#else
+    long *ps = r->pSync[r->flip];
+    r->flip ^= 1;
+    if (r->dtype == DT_INT64)
+        shmem_long_sum_to_all((long*)dest, (const long*)source, count, 0, 0, shmem_n_pes(), (long*)r->pWrk, ps);
+    else
+        shmem_double_sum_to_all((double*)dest, (const double*)source, count, 0, 0, shmem_n_pes(), (double*)r->pWrk, ps);
+#endif
+}
+
+static const char *sh_reduce_name(ck_dtype_t dtype) {
+#if SH_HAVE_15
+    return dtype == DT_INT64 ? "shmem_long_sum_reduce" : "shmem_double_sum_reduce";
+#else
+    return dtype == DT_INT64 ? "shmem_long_sum_to_all" : "shmem_double_sum_to_all";
+#endif
+}
+
+/* ---------- bench driver ---------- */
+
+enum { ALGO_REDUCE, ALGO_TREE, NUM_ALGOS };
+
+static void fill_input(void *buf, int count, long k, int me, ck_dtype_t dt) {
+    const long v0 = value_for_iter(k, me);
+    if (dt == DT_INT64) for (int j = 0; j < count; ++j) ((long*)buf)[j] = v0 + j;
+    else                for (int j = 0; j < count; ++j) ((double*)buf)[j] = (double)((v0 + j) & 0x3ff);
+}
+
+/* Folded into the sink so the result is consumed. */
+static long checksum(const void *buf, int count, ck_dtype_t dt) {
+    long s = 0;
+    if (dt == DT_INT64) for (int j = 0; j < count; ++j) s += ((const long*)buf)[j];
+    else                for (int j = 0; j < count; ++j) s += (long)((const double*)buf)[j];
+    return s;
+}
+
+static inline void run_algo(int algo, ShTreePlan *tree, ShReduce *red, void *dest, const void *source, int count) {
+    if (algo == ALGO_TREE) sh_tree_allreduce(tree, dest, source);
+    else                   sh_reduce(red, dest, source, count);
+}
+
+int main(int argc, char **argv) {
+    shmem_init();
+    const int me = shmem_my_pe();
+    const int np = shmem_n_pes();
+
+    long iters  = 20000;
+    long warmup = 100;
+    int  checks = 0;
+    int  inplace = 0;
+    int  count  = 1;
+    int  fanout = 2;
+    ck_dtype_t dtype = DT_INT64;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--iters") && i + 1 < argc) {
+            iters = strtol(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--warmup") && i + 1 < argc) {
+            warmup = strtol(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--count") && i + 1 < argc) {
+            count = (int)strtol(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--fanout") && i + 1 < argc) {
+            fanout = (int)strtol(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--dtype") && i + 1 < argc) {
+            const char *d = argv[++i];
+            if (!strcmp(d, "long")) dtype = DT_INT64;
+            else if (!strcmp(d, "double")) dtype = DT_DOUBLE;
+            else usage_and_exit(argv[0]);
+        } else if (!strcmp(argv[i], "--inplace")) {
+            inplace = 1;
+        } else if (!strcmp(argv[i], "--checks")) {
+            checks = 1;
+        } else if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h")) {
+            usage_and_exit(argv[0]);
+        }
+    }
+    if (iters <= 0 || warmup < 0 || count <= 0 || fanout <= 0) usage_and_exit(argv[0]);
+
+    const size_t es = ck_dtype_size[dtype];
+    ShTreePlan tree;
+    ShReduce red;
+    sh_tree_init(&tree, fanout, count, dtype);
+    sh_reduce_init(&red, count, dtype);
+
+    // Reductions need symmetric source and target
+    void *my  = shmem_malloc((size_t)count * es);
+    void *out = shmem_malloc((size_t)count * es);
+    void *ref = shmem_malloc((size_t)count * es);
+    if (!my || !out || !ref) { fprintf(stderr, "PE %d: shmem_malloc failed\n", me); shmem_global_exit(3); }
+
+    if (me == 0) {
+        printf("PEs=%d, iters=%ld, warmup=%ld, count=%d, fanout=%d, dtype=%s, kernel=%s, signal=%s, "
+               "inplace=%s, checks=%s\n",
+               np, iters, warmup, count, tree.fanout, dtype == DT_INT64 ? "long" : "double",
+               ck_isa_names[tree.k.isa], SH_HAVE_15 ? "put-with-signal" : "put+fence+atomic",
+               inplace ? "on" : "off", checks ? "on" : "off");
+        fflush(stdout);
+    }
+
+    double secs[NUM_ALGOS];
+    long sink[NUM_ALGOS];
+    for (int a = 0; a < NUM_ALGOS; ++a) {
+        void *src = inplace ? out : my;
+        for (long k = 0; k < warmup; ++k) {
+            fill_input(src, count, k, me, dtype);
+            run_algo(a, &tree, &red, out, src, count);
+            if (checks && a == ALGO_TREE) {
+                fill_input(my, count, k, me, dtype);
+                sh_reduce(&red, ref, my, count);
+                if (memcmp(out, ref, (size_t)count * es)) {
+                    fprintf(stderr, "Warmup mismatch PE %d, iteration %ld: tree=%ld reduce=%ld\n",
+                            me, k, checksum(out, count, dtype), checksum(ref, count, dtype));
+                    shmem_global_exit(4);
+                }
+            }
+        }
+
+        sink[a] = 0;
+        shmem_barrier_all();
+        const double t0 = now_sec();
+        for (long k = 0; k < iters; ++k) {
+            fill_input(src, count, k, me, dtype);
+            run_algo(a, &tree, &red, out, src, count);
+            sink[a] += checksum(out, count, dtype);   // prevent over-optimization
+        }
+        secs[a] = now_sec() - t0;
+    }
+
+    if (me == 0) {
+        // algbw = bytes/time; busbw scales it by 2(n-1)/n as in mpi_bench
+        const double bytes = (double)count * (double)es;
+        const double bus_factor = (np > 1) ? 2.0 * (double)(np - 1) / (double)np : 1.0;
+        const double red_us = 1e6 * secs[ALGO_REDUCE] / (double)iters;
+        char label[64];
+        printf("\nResults (avg per iteration, PE0 local timing; algbw/busbw in GB/s):\n");
+        for (int a = 0; a < NUM_ALGOS; ++a) {
+            const double us = 1e6 * secs[a] / (double)iters;
+            const double algbw = (us > 0.0) ? bytes / (us * 1e3) : 0.0;
+            if (a == ALGO_TREE) snprintf(label, sizeof(label), "TreeReduce put+signal (k=%d) + Bcast", tree.fanout);
+            else                snprintf(label, sizeof(label), "%s", sh_reduce_name(dtype));
+            printf("  %-44s : %.2f us/iter  algbw %.3f  busbw %.3f", label, us, algbw, algbw * bus_factor);
+            if (a == ALGO_REDUCE) printf("\n");
+            else printf("  (Reduce / this = %.2fx, >1 => faster)\n", (us > 0.0) ? red_us / us : 0.0);
+        }
+        printf("  (accumulators) %ld %ld\n", sink[0], sink[1]);
+        fflush(stdout);
+    }
+
+    shmem_barrier_all();
+    shmem_free(ref);
+    shmem_free(out);
+    shmem_free(my);
+    sh_reduce_free(&red);
+    sh_tree_free(&tree);
+    shmem_finalize();
+    return 0;
+}
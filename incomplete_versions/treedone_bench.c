@@ -1,5 +1,9 @@
 /* treedone_bench.c
  * OpenSHMEM benchmark: non-collective tree (Youssef-style) vs. Allreduce (AND).
+ * Build: oshcc -O3 -std=c11 treedone_bench.c -o treedone_bench
+ * --latency: per-iteration detection latency on every PE (barrier exit, including
+ * any jitter, to GLOBAL_DONE seen), reported as percentiles and a log2 histogram
+ * of the slowest PE; --lat-dump FILE writes the raw samples (format: lat_stats.h).
  */
 
  #define _POSIX_C_SOURCE 199309L
@@ -10,6 +14,8 @@
  #include <stdlib.h>
  #include <string.h>
  #include <time.h>
+
+ #include "lat_stats.h"
  
  /* timing */
  static inline double now_sec(void) {
@@ -161,7 +167,36 @@
  
  static void usage(const char *p) {
      if (shmem_my_pe() == 0)
-         fprintf(stderr, "Usage: %s [--iters N] [--warmup W] [--fanout K] [--bench both|tree|allreduce] [--jitter_us J]\n", p);
+         fprintf(stderr, "Usage: %s [--iters N] [--warmup W] [--fanout K] [--bench both|tree|allreduce] [--jitter_us J]\n"
+                         "          [--latency] [--lat-dump FILE]\n", p);
+ }
+
+ /* --latency: PE 0 pulls every PE's symmetric samples, summarises the
+  * per-iteration slowest PE into *sum and appends the raw samples to dump. */
+ typedef struct {
+     double *mine;     /* symmetric, iters */
+     double *all;      /* PE 0: np x iters */
+     double *worst;    /* PE 0: iters */
+     FILE   *dump;     /* PE 0, --lat-dump */
+ } lat_rec_t;
+
+ static void lat_collect(lat_rec_t *lr, long iters, const char *label, lat_summary_t *sum) {
+     shmem_barrier_all();
+     if (shmem_my_pe() == 0) {
+         const int np = shmem_n_pes();
+         for (int pe = 0; pe < np; ++pe)
+             shmem_getmem(lr->all + (size_t)pe * (size_t)iters, lr->mine, (size_t)iters * sizeof(double), pe);
+         lat_worst(lr->all, np, iters, lr->worst);
+         if (lat_summarize(lr->worst, iters, sum) != 0) {
+             fprintf(stderr, "malloc latency sort failed\n");
+             shmem_global_exit(1);
+         }
+         if (lr->dump && lat_dump(lr->dump, label, np, iters, lr->all) != 0) {
+             perror("write --lat-dump");
+             shmem_global_exit(1);
+         }
+     }
+     shmem_barrier_all();
  }
  
  int main(int argc, char **argv) {
@@ -174,6 +209,8 @@
      long warmup = 200;
      int  fanout = 2;
      int  jitter_us = 0;
+     int  latency = 0;
+     const char *lat_path = NULL;
      enum { BENCH_BOTH, BENCH_TREE, BENCH_ALLR } mode = BENCH_BOTH;
  
      for (int i = 1; i < argc; ++i) {
@@ -181,6 +218,8 @@
          else if (!strcmp(argv[i], "--warmup") && i + 1 < argc) warmup = strtol(argv[++i], NULL, 10);
          else if (!strcmp(argv[i], "--fanout") && i + 1 < argc) fanout = atoi(argv[++i]);
          else if (!strcmp(argv[i], "--jitter_us") && i + 1 < argc) jitter_us = atoi(argv[++i]);
+         else if (!strcmp(argv[i], "--latency")) latency = 1;
+         else if (!strcmp(argv[i], "--lat-dump") && i + 1 < argc) { lat_path = argv[++i]; latency = 1; }
          else if (!strcmp(argv[i], "--bench") && i + 1 < argc) {
              const char *b = argv[++i];
              if (!strcmp(b, "tree")) mode = BENCH_TREE;
@@ -192,6 +231,24 @@
  
      tree_done_t td;
      treedone_init(&td, fanout);
+
+     lat_rec_t lr = { NULL, NULL, NULL, NULL };
+     lat_summary_t lat_tree, lat_allr;
+     if (latency) {
+         lr.mine = shmem_malloc((size_t)iters * sizeof(double));
+         if (me == 0) {
+             lr.all   = malloc((size_t)np * (size_t)iters * sizeof(double));
+             lr.worst = malloc((size_t)iters * sizeof(double));
+         }
+         if (!lr.mine || (me == 0 && (!lr.all || !lr.worst))) {
+             if (me == 0) fprintf(stderr, "latency sample allocation failed\n");
+             shmem_global_exit(1);
+         }
+         if (me == 0 && lat_path && !(lr.dump = fopen(lat_path, "wb"))) {
+             perror(lat_path);
+             shmem_global_exit(1);
+         }
+     }
  
      if (me == 0) {
          const char *m = (mode == BENCH_BOTH ? "both" : (mode == BENCH_TREE ? "tree" : "allreduce"));
@@ -220,11 +277,14 @@
          for (long k = 0; k < iters; ++k) {
              reset_tree_round(&td);
              shmem_barrier_all();
+             double ts = latency ? now_sec() : 0.0;
              if (jitter_us) nanosleep_us(((unsigned)me * 1315423911u + (unsigned)k) % (unsigned)jitter_us);
              treedone_async_tree(&td);
+             if (latency) lr.mine[k] = now_sec() - ts;
              shmem_barrier_all();
          }
          t_tree1 = now_sec();
+         if (latency) lat_collect(&lr, iters, "Tree (non-collective) termination", &lat_tree);
      }
  
      /* warmup: allreduce */
@@ -245,10 +305,13 @@
          for (long k = 0; k < iters; ++k) {
              reset_allreduce_round(&td);
              shmem_barrier_all();
+             double ts = latency ? now_sec() : 0.0;
              treedone_collective_allreduce(&td);
+             if (latency) lr.mine[k] = now_sec() - ts;
              shmem_barrier_all();
          }
          t_allr1 = now_sec();
+         if (latency) lat_collect(&lr, iters, "Allreduce (AND) termination", &lat_allr);
      }
  
      if (me == 0) {
@@ -265,9 +328,26 @@
              double speedup = (tree_us > 0.0) ? (allr_us / tree_us) : 0.0;
              printf("  Rel. speed (Allreduce / Tree)     : %.2fx  (>=1 ⇒ Tree faster)\n", speedup);
          }
+         if (latency) {
+             printf("\nLatency per iteration (slowest PE each iteration; us):\n");
+             if (mode == BENCH_BOTH || mode == BENCH_TREE)
+                 lat_print(stdout, 33, "Tree (non-collective) termination", &lat_tree);
+             if (mode == BENCH_BOTH || mode == BENCH_ALLR)
+                 lat_print(stdout, 33, "Allreduce (AND) termination", &lat_allr);
+             printf("\nLatency histograms (log2 buckets; iterations per bucket):\n");
+             if (mode == BENCH_BOTH || mode == BENCH_TREE)
+                 lat_print_hist(stdout, "Tree (non-collective) termination", &lat_tree);
+             if (mode == BENCH_BOTH || mode == BENCH_ALLR)
+                 lat_print_hist(stdout, "Allreduce (AND) termination", &lat_allr);
+             if (lat_path) printf("  raw samples (%d PEs x %ld iters per bench) -> %s\n", np, iters, lat_path);
+         }
          fflush(stdout);
      }
+     if (lr.dump && fclose(lr.dump) != 0) { perror(lat_path); shmem_global_exit(1); }
  
+     free(lr.worst);
+     free(lr.all);
+     if (lr.mine) { shmem_barrier_all(); shmem_free(lr.mine); }
      treedone_finalize(&td);
      shmem_finalize();
      return 0;